@@ -0,0 +1,43 @@
+#ifndef _BACKEND_H_
+#define _BACKEND_H_
+
+#include <libmtp.h>
+
+/* The libmtp calls made on an opened device, so that a simulated device
+ * can stand in for a real one.  Each member has the signature of the
+ * libmtp function it is named after. */
+typedef struct
+{
+    void (*release_device) (LIBMTP_mtpdevice_t *);
+    char *(*get_friendlyname) (LIBMTP_mtpdevice_t *);
+    char *(*get_serialnumber) (LIBMTP_mtpdevice_t *);
+    int (*check_capability) (LIBMTP_mtpdevice_t *, LIBMTP_devicecap_t);
+    int (*get_storage) (LIBMTP_mtpdevice_t *, int);
+    LIBMTP_file_t *(*get_filelisting_with_callback) (LIBMTP_mtpdevice_t *, LIBMTP_progressfunc_t,
+                                                     void const *);
+    LIBMTP_folder_t *(*get_folder_list_for_storage) (LIBMTP_mtpdevice_t *, uint32_t);
+    LIBMTP_file_t *(*get_files_and_folders) (LIBMTP_mtpdevice_t *, uint32_t, uint32_t);
+    int (*get_partial_object) (LIBMTP_mtpdevice_t *, uint32_t, uint64_t, uint32_t,
+                               unsigned char **, unsigned int *);
+    int (*get_file_to_file_descriptor) (LIBMTP_mtpdevice_t *, uint32_t, int,
+                                        LIBMTP_progressfunc_t, void const *);
+    int (*send_file_from_file_descriptor) (LIBMTP_mtpdevice_t *, int, LIBMTP_file_t *,
+                                           LIBMTP_progressfunc_t, void const *);
+    int (*delete_object) (LIBMTP_mtpdevice_t *, uint32_t);
+    uint32_t (*create_folder) (LIBMTP_mtpdevice_t *, char *, uint32_t, uint32_t);
+    int (*set_file_name) (LIBMTP_mtpdevice_t *, LIBMTP_file_t *, const char *);
+    int (*set_folder_name) (LIBMTP_mtpdevice_t *, LIBMTP_folder_t *, const char *);
+    int (*move_object) (LIBMTP_mtpdevice_t *, uint32_t, uint32_t, uint32_t);
+    int (*copy_object) (LIBMTP_mtpdevice_t *, uint32_t, uint32_t, uint32_t);
+    int (*begin_edit_object) (LIBMTP_mtpdevice_t *, uint32_t const);
+    int (*send_partial_object) (LIBMTP_mtpdevice_t *, uint32_t const, uint64_t, unsigned char *,
+                                unsigned int);
+    int (*truncate_object) (LIBMTP_mtpdevice_t *, uint32_t const, uint64_t);
+    int (*end_edit_object) (LIBMTP_mtpdevice_t *, uint32_t const);
+} MtpBackend;
+
+/* Simulated device, see mtpsim.c */
+extern const MtpBackend sim_backend;
+LIBMTP_mtpdevice_t *sim_open (const char *spec);
+
+#endif /* _BACKEND_H_ */
@@ -0,0 +1,106 @@
+#!/bin/sh
+# Measure mtpfs on a simulated device: mount it, list it with ls -lR, copy
+# a folder out and back in, read random blocks and remove the copy, then
+# print the throughput of each step and the latencies from /.mtpfs/stats.
+#
+# Usage: bench.sh [mtpfs binary] [simulated device, see --simulate]
+# BENCH_READS sets the number of random reads (200).
+
+set -e
+
+MTPFS=${1:-./mtpfs}
+SPEC=${2:-depth=3,fanout=4,files=8,size=262144,latency=1000,bandwidth=16384}
+READS=${BENCH_READS:-200}
+
+WORK=$(mktemp -d "${TMPDIR:-/tmp}/mtpfs-bench.XXXXXX")
+MNT=$WORK/mnt
+mkdir "$MNT" "$WORK/out"
+
+cleanup ()
+{
+    fusermount -u "$MNT" 2>/dev/null || true
+    rm -rf "$WORK"
+}
+trap cleanup EXIT INT TERM
+
+now ()
+{
+    date +%s%N
+}
+
+# Name of the step, bytes moved, start and end in nanoseconds
+report ()
+{
+    awk -v name="$1" -v bytes="$2" -v start="$3" -v end="$4" 'BEGIN {
+        secs = (end - start) / 1e9
+        if (bytes > 0 && secs > 0)
+            printf "%-10s %9.3f s %10.2f MB/s\n", name, secs, bytes / secs / 1048576
+        else
+            printf "%-10s %9.3f s\n", name, secs
+    }'
+}
+
+# The tree is read from the device, not from an index of a previous run
+"$MTPFS" --no-index --simulate "$SPEC" "$MNT"
+tries=0
+while [ ! -e "$MNT/.mtpfs/stats" ]; do
+    tries=$((tries + 1))
+    if [ $tries -gt 100 ]; then
+        echo "mtpfs did not mount $MNT" >&2
+        exit 1
+    fi
+    sleep 0.1
+done
+
+STORAGE=$MNT/$(ls "$MNT" | grep -v '^lost+found$' | head -n 1)
+SRC=$(find "$STORAGE" -mindepth 1 -maxdepth 1 -type d | head -n 1)
+if [ -z "$SRC" ]; then
+    echo "No folder to copy on the simulated device" >&2
+    exit 1
+fi
+
+echo "mtpfs --simulate $SPEC"
+
+start=$(now)
+entries=$(ls -lR "$MNT" | wc -l)
+report "ls -lR" 0 "$start" "$(now)"
+echo "           $entries lines listed"
+
+start=$(now)
+cp -r "$SRC" "$WORK/out/"
+bytes=$(du -sb "$WORK/out" | cut -f1)
+report "copy out" "$bytes" "$start" "$(now)"
+
+start=$(now)
+cp -r "$WORK/out/$(basename "$SRC")" "$STORAGE/bench"
+report "copy in" "$bytes" "$start" "$(now)"
+
+# Blocks of 4 KB at random offsets of random files, always the same ones
+find "$STORAGE" -type f -printf '%s %p\n' |
+    awk -v n="$READS" 'BEGIN { srand(1) }
+        { size[NR] = $1; sub(/^[0-9]+ /, ""); path[NR] = $0 }
+        END {
+            for (i = 0; i < n && NR > 0; i++) {
+                k = int(rand() * NR) + 1
+                blocks = int(size[k] / 4096)
+                print int(rand() * (blocks > 0 ? blocks : 1)), path[k]
+            }
+        }' > "$WORK/reads"
+start=$(now)
+while read -r skip path; do
+    dd if="$path" of=/dev/null bs=4096 count=1 skip="$skip" 2>/dev/null
+done < "$WORK/reads"
+end=$(now)
+report "reads" $((READS * 4096)) "$start" "$end"
+awk -v n="$READS" -v start="$start" -v end="$end" \
+    'BEGIN { printf "           %.1f ms per read\n", (end - start) / n / 1e6 }'
+
+start=$(now)
+rm -rf "$STORAGE/bench"
+report "rm -rf" 0 "$start" "$(now)"
+
+echo
+echo "Latencies (us):"
+awk '$1 == "timer" && $3 > 0 {
+        printf "  %-24s %8d calls %12.1f avg %10d max\n", $2, $3, $4 / $3, $5
+    }' "$MNT/.mtpfs/stats"
@@ -8,23 +8,26 @@
 
 /* Headers */
 #include "mtpfs.h"
+#include "backend.h"
 
 #include <assert.h>
 #include <dirent.h>
 #include <errno.h>
-#include <fuse.h>
+#include <fuse_lowlevel.h>
 #include <fcntl.h>
-#include <getopt.h>
 #include <glib.h>
 #include <glib/gprintf.h>
 #include <libmtp.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <syslog.h>
 #include <sys/mman.h>
 #include <sys/statfs.h>
 #include <unistd.h>
+#include <utime.h>
 
 
 /* Debugging macro */
@@ -55,340 +58,2186 @@ typedef struct
 {
     LIBMTP_devicestorage_t *storage;
     LIBMTP_folder_t *folders;
+    GHashTable *folder_index;  /* parent_id -> (folded name -> NameEntry of LIBMTP_folder_t) */
+    GHashTable *folders_by_id; /* folder_id -> LIBMTP_folder_t */
     gboolean folders_changed;
 } StorageArea;
 
-/* Static variables */
-static LIBMTP_mtpdevice_t *device;
-static StorageArea storageArea[MAX_STORAGE_AREA];
-static LIBMTP_file_t *files = NULL;
-static gboolean files_changed = TRUE;
-static GSList *lostfiles = NULL;
-static GHashTable *myfiles = NULL;
+/* A mounted device and what is known of it.  The first one is the private
+ * data of FUSE, the others follow it when several devices are mounted. */
+typedef struct MtpfsContext
+{
+    struct MtpfsContext *next;
+    gchar *name;                       /* Subdirectory of the device, NULL if alone */
+    guint index;                       /* Position among the mounted devices */
+    LIBMTP_mtpdevice_t *device;
+    const MtpBackend *mtp;             /* libmtp, or the simulated device */
+    gchar *device_serial;
+    gboolean partial_read;
+    gboolean move_objects;             /* MoveObject support, see mtpfs_rename */
+    gboolean copy_objects;             /* CopyObject support, see mtpfs_copy */
+    gboolean edit_objects;             /* Android edit extensions, see commit_changes */
+    StorageArea storageArea[MAX_STORAGE_AREA];
+    GHashTable *files;                 /* item_id -> LIBMTP_file_t, owns the files */
+    GHashTable *files_by_parent;       /* (storage_id, parent_id) -> (folded name -> NameEntry of LIBMTP_file_t) */
+    gboolean files_changed;
+    gboolean tree_from_index;          /* Read from an index, not replaced yet, see revalidate_worker */
+    GThread *revalidate_thread;        /* Reads the tree behind the indexed one */
+    GMutex revalidate_lock;
+    GCond revalidate_cond;             /* tree_from_index cleared */
+    GSList *lostfiles;
+    GHashTable *myfiles;               /* Path -> FileHandle of new files, under myfiles_lock */
+    GHashTable *populated;             /* (storage_id, parent_id) enumerated in lazy mode */
+    GHashTable *resolved;              /* Folder path -> folder_id, see lookup_folder_id */
+    GHashTable *missing;               /* (storage_id, parent_id) -> folded names not found */
+    GRWLock tree_lock;                 /* Cached tree and lookups in it */
+    GMutex device_lock;                /* Protects the fields below */
+    GCond device_cond;
+    gboolean device_busy;              /* A thread is calling libmtp */
+    guint device_waiting[2];
+    gint64 device_since;               /* When the current libmtp call started */
+    sig_atomic_t refresh_seen;         /* Last refresh_generation applied */
+    GHashTable *shared_stages;         /* item_id -> SharedStage, under shared_lock */
+    GThread *readahead_thread;
+    GAsyncQueue *readahead_queue;
+    GThread *writeback_thread;         /* Write-back mode only, see queue_upload */
+    GMutex writeback_lock;             /* Taken last, protects the fields below */
+    GCond writeback_cond;
+    GQueue writeback;                  /* PendingUpload, in the order of release */
+    GHashTable *pending;               /* Path -> PendingUpload until uploaded, or NULL */
+    GHashTable *failed;                /* Path -> second of its failed upload, see forget_failed */
+    gboolean writeback_stopping;
+} MtpfsContext;
+
+/* New file closed in write-back mode, waiting for its upload */
+typedef struct
+{
+    gchar *path;
+    int fd;                    /* Staged content */
+    uint64_t staged;           /* Bytes of the staging budget held by fd */
+    uint64_t size;
+    time_t mtime;
+} PendingUpload;
+
+/* Staged copy of an object shared by the read-only handles opening it */
+typedef struct
+{
+    MtpfsContext *ctx;
+    uint32_t item_id;
+    uint64_t filesize;
+    int fd;
+    uint64_t staged;           /* Bytes of the staging budget held by fd */
+    guint refs;
+    gboolean done;             /* Download finished, successfully if fd != -1 */
+} SharedStage;
+
+/* Bytes [start, end) written to an existing file */
+typedef struct
+{
+    uint64_t start;
+    uint64_t end;
+} DirtyRange;
 
-G_LOCK_DEFINE_STATIC(device_lock);
-#define return_unlock(a)       do { G_UNLOCK(device_lock); return a; } while(0)
+typedef struct
+{
+    MtpfsContext *ctx;
+    uint32_t item_id;
+    uint64_t filesize;
+    int fd;                    /* Local staging file, -1 when reading ranges from the device */
+    uint64_t staged;           /* Bytes of the staging budget held by fd */
+    uint64_t next_offset;      /* Where a sequential read would continue */
+    uint32_t readahead;        /* Current read-ahead window, in blocks */
+    uint32_t readahead_end;    /* First block not yet requested */
+    SharedStage *shared;       /* Owner of the staged copy fd duplicates, or NULL */
+    GArray *dirty;             /* DirtyRange, sorted, when writing to an existing file */
+    gboolean resized;          /* ftruncate changed the size of an existing file */
+    gboolean streaming;        /* New file sent while written, see stream_write */
+    LIBMTP_file_t *streamed;   /* Its object, once created and being edited */
+    unsigned char *chunk;      /* Bytes written in order past sent, STAGE_CHUNK_SIZE at most */
+    uint32_t chunk_len;
+    uint64_t sent;             /* Bytes [0, sent) are on the device, the size of the object */
+    int stream_error;          /* Sending failed, the file is lost */
+    GMutex lock;               /* Protects the fields above */
+} FileHandle;
+
+#define FILE_HANDLE(fi)        ((FileHandle *) (uintptr_t) (fi)->fh)
+
+/* Receives the entries of mtpfs_readdir, returns non-zero once full */
+typedef int (*DirFiller) (void *buf, const char *name, const struct stat *st, off_t off);
+
+/* Entry of a directory listed at opendir, see ll_readdir */
+typedef struct
+{
+    gchar *name;
+    struct stat st;
+} DirEntry;
 
-/* Freeing tree representation */
-static void
-free_files(LIBMTP_file_t *filelist)
+#define DIR_ENTRIES(fi)        ((GArray *) (uintptr_t) (fi)->fh)
+
+/* An entry the kernel looked up, by the node id it was given: the inode
+ * of the entry, see mtpfs.h.  Kept until forgotten by the kernel and no
+ * longer a parent. */
+typedef struct Node
 {
-    DBG_F("Free_files(%p)", filelist);
+    uint64_t ino;              /* Node id */
+    uint64_t inode;            /* st_ino of the entry, the node id unless taken */
+    struct Node *parent;       /* NULL for the root */
+    gchar *name;
+    uint64_t nlookup;          /* Lookups the kernel has not forgotten */
+    guint children;            /* Nodes having this one as parent */
+    gboolean linked;           /* In node_names, until removed or replaced */
+    MtpfsContext *ctx;         /* Device of the entry, NULL for the root of several */
+    gboolean by_id;            /* Folder or file of the tree, see mtpfs_getattr_id */
+    gboolean folder;
+    int storageid;             /* Storage area of a folder, or -1 */
+    uint32_t object_id;        /* 0 for the storage itself */
+} Node;
+
+/* What an operation needs of a node, copied under nodes_lock */
+typedef struct
+{
+    gchar *path;               /* Within the mount point, NULL for an unknown node */
+    uint64_t ino;
+    uint64_t parent_ino;
+    MtpfsContext *ctx;
+    gboolean by_id;
+    gboolean folder;
+    int storageid;
+    uint32_t object_id;
+} NodeInfo;
 
-    LIBMTP_file_t *file = filelist, *tmp;
-    while (file) {
-        tmp = file;
-        file = file->next;
-        LIBMTP_destroy_file_t(tmp);
-    }
-}
+typedef struct
+{
+    MtpfsContext *ctx;         /* Device of the object */
+    uint32_t item_id;
+    uint32_t index;            /* Block index in the object */
+} BlockKey;
 
-/* Checking tree representation */
-static void
-check_files ()
+typedef struct
 {
-    DBG_F("check_files()");
+    BlockKey key;
+    unsigned char *data;
+    uint32_t size;
+    GList *link;               /* in BlockCache.lru */
+} CacheBlock;
 
-    if (files_changed) {
-        DBG("Refreshing Filelist");
-        if (files) free_files(files);
-        files = LIBMTP_Get_Filelisting_With_Callback(device, NULL, NULL);
-        files_changed = FALSE;
-        //check_lost_files ();
-        DBG("Refreshing Filelist exiting");
-    }
-}
+typedef struct
+{
+    GHashTable *blocks;        /* key -> CacheBlock, owns the blocks */
+    GQueue lru;                /* Most recently used first */
+    guint64 size;
+    guint64 max_size;
+    guint64 hits;
+    guint64 misses;
+    guint64 evictions;
+} BlockCache;
 
-static void
-check_lost_files ()
+typedef struct
 {
-    uint32_t last_parent_id = 0xFFFFFFFF;
-    gboolean last_parent_found = FALSE;
-    LIBMTP_file_t *item;
+    uint32_t item_id;
+    uint64_t filesize;
+    uint32_t index;
+    const void *owner;         /* FileHandle asking for it, see cancel_readahead */
+} ReadaheadRequest;
+
+/* Objects of a directory answering to the same folded name, usually a
+ * single one: names differing only in case are all listed */
+typedef struct NameEntry
+{
+    gchar *name;               /* Exact name */
+    gpointer object;
+    struct NameEntry *next;
+} NameEntry;
 
-    DBG_F("check_lost_files()");
+/* On-disk index of a storage, see save_index() */
+typedef struct
+{
+    char magic[8];
+    uint64_t free_bytes;       /* Storage state when written, checked on load */
+    uint64_t free_objects;
+    uint64_t max_capacity;
+    uint32_t storage_id;
+    uint32_t nfolders;         /* IndexFolder records following the header */
+    uint32_t nfiles;           /* IndexFile records following the folders */
+    uint32_t names_size;       /* NUL-terminated names following the files */
+} IndexHeader;
 
-    if (lostfiles != NULL)
-        g_slist_free (lostfiles);
+typedef struct
+{
+    uint32_t id;
+    uint32_t parent_id;
+    uint32_t name;             /* Offset in the names */
+    uint32_t reserved;
+} IndexFolder;
 
-    lostfiles = NULL;
-    for (item = files; item != NULL; item = item->next) {
-        gboolean parent_found;
+typedef struct
+{
+    uint32_t id;
+    uint32_t parent_id;
+    uint32_t name;
+    uint32_t filetype;
+    uint64_t filesize;
+    int64_t modificationdate;
+} IndexFile;
 
-        if (last_parent_id == 0xFFFFFFFF || last_parent_id != item->parent_id) {
-            if (item->parent_id == 0) {
-                parent_found = TRUE;
-            } else {
-                int i;
-                for (i = 0; i < MAX_STORAGE_AREA; ++i) {
-                    if (storageArea[i].folders!=NULL) {
-                        if (LIBMTP_Find_Folder (storageArea[i].folders, item->parent_id) != NULL) {
-                            parent_found = FALSE;
-                        }
-                    }
-                }
-            }
-            last_parent_id = item->parent_id;
-            last_parent_found = parent_found;
-        } else {
-            parent_found = last_parent_found;
-        }
-        DBG("MTPFS checking for lost files %s, parent %d - %s", item->filename, last_parent_id, ( parent_found ? "FALSE" : "TRUE" ) );
-        if (parent_found == FALSE) {
-            lostfiles = g_slist_append (lostfiles, item);
-        }
-    }
-    DBG("MTPFS checking for lost files exit found %d lost tracks", g_slist_length (lostfiles) );
-}
+#define INDEX_MAGIC "MTPFSIX1"
 
-static void
-check_folders ()
+typedef struct
 {
-    int i;
+    gchar *name;               /* serial-item_id-filesize-modificationdate */
+    uint64_t size;
+    time_t used;
+} ContentEntry;
 
-    DBG_F("check_folders()");
+typedef struct
+{
+    gchar *dir;                /* NULL when disabled */
+    GHashTable *entries;       /* name -> GList link in lru */
+    GQueue lru;                /* ContentEntry, most recently used first */
+    guint64 size;
+    guint64 max_size;
+} ContentCache;
+
+typedef enum
+{
+    DEVICE_INTERACTIVE,        /* Someone is waiting on it: lookups, listings, reads */
+    DEVICE_BULK,               /* Chunks of transfers, read-ahead, whole uploads */
+} DevicePriority;
 
-    for (i = 0; i < MAX_STORAGE_AREA; ++i) {
-        if (storageArea[i].folders_changed) {
-            DBG("Refreshing Folderlist %d-%s", i,storageArea[i].storage->StorageDescription);
-            if (storageArea[i].folders) {
-                LIBMTP_destroy_folder_t(storageArea[i].folders);
-            }
-            storageArea[i].folders = LIBMTP_Get_Folder_List_For_Storage(device, storageArea[i].storage->id);
-            storageArea[i].folders_changed= FALSE;
-        }
+/* Runtime statistics, see stats_snapshot */
+typedef enum
+{
+    STAT_OP_LOOKUP,
+    STAT_OP_GETATTR,
+    STAT_OP_READDIR,
+    STAT_OP_OPEN,
+    STAT_OP_READ,
+    STAT_OP_WRITE,
+    STAT_OP_RELEASE,
+    STAT_OP_MKNOD,
+    STAT_OP_TRUNCATE,
+    STAT_OP_FTRUNCATE,
+    STAT_OP_FALLOCATE,
+    STAT_OP_UNLINK,
+    STAT_OP_MKDIR,
+    STAT_OP_RMDIR,
+    STAT_OP_RENAME,
+    STAT_OP_STATFS,
+    STAT_OP_FLUSH,
+    STAT_OP_FSYNC,
+    STAT_OP_SETXATTR,
+    STAT_MTP_FILE_LISTING,
+    STAT_MTP_FOLDER_LIST,
+    STAT_MTP_FILES_AND_FOLDERS,
+    STAT_MTP_GET_STORAGE,
+    STAT_MTP_GET_FILE,
+    STAT_MTP_PARTIAL_OBJECT,
+    STAT_MTP_SEND_FILE,
+    STAT_MTP_DELETE_OBJECT,
+    STAT_MTP_CREATE_FOLDER,
+    STAT_MTP_MOVE_OBJECT,
+    STAT_MTP_COPY_OBJECT,
+    STAT_MTP_EDIT_OBJECT,
+    STAT_MTP_SEND_PARTIAL,
+    STAT_MTP_SET_NAME,
+    STAT_MTP_RELEASE_DEVICE,
+    STAT_WAIT_DEVICE_INTERACTIVE,
+    STAT_WAIT_DEVICE_BULK,
+    STAT_WAIT_TREE_READ,
+    STAT_WAIT_TREE_WRITE,
+    STAT_WAIT_STAGING,
+    STAT_WAIT_WRITEBACK,
+    STAT_WAIT_INDEX,
+    STAT_TIMERS
+} StatTimer;
+
+static const gchar *stat_timer_names[STAT_TIMERS] = {
+    "op.lookup", "op.getattr", "op.readdir", "op.open", "op.read", "op.write",
+    "op.release", "op.mknod", "op.truncate", "op.ftruncate", "op.fallocate",
+    "op.unlink", "op.mkdir", "op.rmdir", "op.rename", "op.statfs", "op.flush",
+    "op.fsync", "op.setxattr",
+    "mtp.file_listing", "mtp.folder_list", "mtp.files_and_folders", "mtp.get_storage",
+    "mtp.get_file", "mtp.partial_object", "mtp.send_file", "mtp.delete_object",
+    "mtp.create_folder", "mtp.move_object", "mtp.copy_object",
+    "mtp.edit_object", "mtp.send_partial", "mtp.set_name", "mtp.release_device",
+    "wait.device_interactive", "wait.device_bulk", "wait.tree_read", "wait.tree_write",
+    "wait.staging", "wait.writeback", "wait.index",
+};
+
+typedef enum
+{
+    STAT_BYTES_READ,           /* Returned by mtpfs_read */
+    STAT_BYTES_WRITTEN,        /* Accepted by mtpfs_write */
+    STAT_BYTES_DOWNLOADED,     /* Received from the device */
+    STAT_BYTES_UPLOADED,       /* Sent to the device */
+    STAT_FULL_LISTINGS,        /* check_files */
+    STAT_FOLDER_LISTINGS,      /* check_folders, per storage */
+    STAT_DIR_LISTINGS,         /* populate_dir, in lazy mode */
+    STAT_SHARED_STAGES,        /* Opens served by another handle's download */
+    STAT_CONTENT_HITS,
+    STAT_CONTENT_MISSES,
+    STAT_NEGATIVE_HITS,        /* getattr answered from the missing names */
+    STAT_UPLOADS_QUEUED,       /* Releases left to the write-back thread */
+    STAT_UPLOADS_FAILED,       /* Queued files the device refused */
+    STAT_EDITS_PARTIAL,        /* Existing files changed in place */
+    STAT_EDITS_REPLACED,       /* Existing files uploaded again */
+    STAT_COUNTERS
+} StatCounter;
+
+static const gchar *stat_counter_names[STAT_COUNTERS] = {
+    "bytes.read", "bytes.written", "bytes.downloaded", "bytes.uploaded",
+    "tree.full_listings", "tree.folder_listings", "tree.dir_listings",
+    "stage.shared", "content.hits", "content.misses", "tree.negative_hits",
+    "upload.queued", "upload.failed", "edit.partial", "edit.replaced",
+};
+
+typedef struct
+{
+    guint64 count;
+    guint64 total_us;
+    guint64 max_us;
+    guint64 buckets[STAT_BUCKETS];  /* Durations under 1us, 2us, 4us..., then longer */
+} StatTimes;
+
+/* Calls on a real device */
+static const MtpBackend libmtp_backend = {
+    .release_device = LIBMTP_Release_Device,
+    .get_friendlyname = LIBMTP_Get_Friendlyname,
+    .get_serialnumber = LIBMTP_Get_Serialnumber,
+    .check_capability = LIBMTP_Check_Capability,
+    .get_storage = LIBMTP_Get_Storage,
+    .get_filelisting_with_callback = LIBMTP_Get_Filelisting_With_Callback,
+    .get_folder_list_for_storage = LIBMTP_Get_Folder_List_For_Storage,
+    .get_files_and_folders = LIBMTP_Get_Files_And_Folders,
+    .get_partial_object = LIBMTP_GetPartialObject,
+    .get_file_to_file_descriptor = LIBMTP_Get_File_To_File_Descriptor,
+    .send_file_from_file_descriptor = LIBMTP_Send_File_From_File_Descriptor,
+    .delete_object = LIBMTP_Delete_Object,
+    .create_folder = LIBMTP_Create_Folder,
+    .set_file_name = LIBMTP_Set_File_Name,
+    .set_folder_name = LIBMTP_Set_Folder_Name,
+    .move_object = LIBMTP_Move_Object,
+    .copy_object = LIBMTP_Copy_Object,
+    .begin_edit_object = LIBMTP_BeginEditObject,
+    .send_partial_object = LIBMTP_SendPartialObject,
+    .truncate_object = LIBMTP_TruncateObject,
+    .end_edit_object = LIBMTP_EndEditObject,
+};
+
+/* Static variables, shared by the threads of FUSE */
+static MtpfsContext *contexts = NULL;     /* The mounted devices, see route */
+static uid_t owner_uid;                   /* Of the mount, owns every entry */
+static gid_t owner_gid;
+static volatile sig_atomic_t refresh_generation = 0;  /* Bumped by SIGUSR1 */
+static gchar *index_dir = NULL;           /* NULL when not persisting the tree */
+static ContentCache content_cache;
+G_LOCK_DEFINE_STATIC(content_lock);       /* content_cache, taken alone */
+static BlockCache block_cache;
+static ReadaheadRequest readahead_stop;
+static volatile gint readahead_stopping = FALSE;
+static gboolean lazy = FALSE;
+static gboolean write_back = FALSE;
+static double entry_timeout = DEFAULT_ENTRY_TIMEOUT;    /* Seconds, see ll_lookup */
+static double attr_timeout = DEFAULT_ATTR_TIMEOUT;
+static double negative_timeout = DEFAULT_NEGATIVE_TIMEOUT;
+G_LOCK_DEFINE_STATIC(resolved_lock);      /* resolved and missing of contexts, taken alone */
+static StatTimes stat_times[STAT_TIMERS];
+static guint64 stat_counters[STAT_COUNTERS];
+static GMutex stats_lock;                 /* Taken alone, protects the two above */
+
+/* Locks, taken in this order when nested: tree_lock of the context,
+ * myfiles_lock, the lock of a FileHandle, cache_lock, the device
+ * (lock_device) */
+static GPrivate tree_writer = G_PRIVATE_INIT(NULL);
+G_LOCK_DEFINE_STATIC(myfiles_lock);
+G_LOCK_DEFINE_STATIC(cache_lock);         /* block_cache */
+static GMutex staging_lock;               /* Taken alone, protects the fields below */
+static GCond staging_cond;
+static uint64_t staging_used = 0;
+static uint64_t staging_budget = (uint64_t) DEFAULT_STAGING_SIZE_MB * 1024 * 1024;
+static GMutex shared_lock;                /* Taken alone, shared_stages of contexts */
+static GCond shared_cond;
+static GMutex nodes_lock;                 /* Taken alone, protects the fields below */
+static GHashTable *nodes;                 /* Node id -> Node, owns the nodes */
+static GHashTable *node_names;            /* Node -> itself, by parent and name */
+static uint64_t spare_inodes = 0;         /* See remember_node */
+#define return_unlock(a)       do { unlock_tree(ctx); return a; } while(0)
+
+/* Indexing tree representation */
+
+static void
+free_name_entries (NameEntry * entry)
+{
+    NameEntry *next;
+
+    for (; entry != NULL; entry = next) {
+        next = entry->next;
+        g_free(entry->name);
+        g_free(entry);
     }
 }
 
-/* Finding elements in representation */
+static GHashTable *
+new_name_index ()
+{
+    return g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify) free_name_entries);
+}
 
-static int
-find_storage(const gchar * path)
+/* Objects without a name get one from their id, so that they can be
+ * listed, opened and removed like the others */
+static gchar *
+unnamed_object (uint32_t id)
 {
-    int i;
-    gsize storage_len;
-    gchar * second_slash;
+    return g_strdup_printf("<mtpfs null %u>", id);
+}
 
-    DBG_F("find_storage(%s)", path);
+/* Names are folded once when indexed; the index keeps the hash of each
+ * folded key, so a lookup only folds the name looked for and compares
+ * hashes before bytes */
+static gchar *
+fold_name (const gchar * name)
+{
+    return g_ascii_strdown(name, -1);
+}
 
-    // Skip initial '/'
-    if (*path != '/') {
-       DBG("find_storage: internal error: unexpected root");
-       return -1;
+/* Fold in the caller's buffer, only names too long for it are allocated */
+static gchar *
+fold_name_in (const gchar * name, gchar * buffer)
+{
+    gsize i;
+
+    for (i = 0; name[i] != '\0'; ++i) {
+        if (i == FOLD_BUFFER_SIZE - 1)
+            return fold_name(name);
+        buffer[i] = g_ascii_tolower(name[i]);
     }
-    ++path;
+    buffer[i] = '\0';
+    return buffer;
+}
 
-    // find storage len
-    second_slash = strstr(path, "/");
-    if (second_slash == NULL) {
-        storage_len = strlen(path);
-    } else {
-        assert(second_slash > path);
-        storage_len = (gsize)(second_slash - path);
+static void
+name_index_add (GHashTable * index, const gchar * name, gpointer object)
+{
+    NameEntry *entry, *first;
+    gchar *folded;
+
+    if (name == NULL) {
+        DBG("MTPFS filename NULL");
+        return;
     }
+    entry = g_new(NameEntry, 1);
+    entry->name = g_strdup(name);
+    entry->object = object;
+    entry->next = NULL;
+    folded = fold_name(name);
+    first = g_hash_table_lookup(index, folded);
+    if (first != NULL) {
+        // The first entry stays in place, it is the value of the key
+        DBG("Names differing only in case: %s and %s", first->name, name);
+        entry->next = first->next;
+        first->next = entry;
+        g_free(folded);
+        return;
+    }
+    g_hash_table_insert(index, folded, entry);
+}
 
-    for (i = 0; i < MAX_STORAGE_AREA; ++i) {
-        if (storageArea[i].storage != NULL) {
-            if ((storage_len == strlen(storageArea[i].storage->StorageDescription)) &&
-                (strncmp(storageArea[i].storage->StorageDescription, path, storage_len) == 0)) {
-                DBG("find_storage:%s found as %d", storageArea[i].storage->StorageDescription, i);
-                return i;
-            }
-        }
+/* Names differing only in case resolve to the one matching exactly, or
+ * else to the first one indexed */
+static gpointer
+name_index_lookup (GHashTable * index, const gchar * name)
+{
+    gchar buffer[FOLD_BUFFER_SIZE];
+    NameEntry *first, *entry;
+    gchar *folded;
+
+    if (index == NULL)
+        return NULL;
+    folded = fold_name_in(name, buffer);
+    first = g_hash_table_lookup(index, folded);
+    if (folded != buffer)
+        g_free(folded);
+    if (first == NULL)
+        return NULL;
+    for (entry = first; entry != NULL; entry = entry->next) {
+        if (strcmp(entry->name, name) == 0)
+            return entry->object;
     }
-    DBG("find_storage: %s not found", path - 1);
-    return -1;
+    return first->object;
 }
 
-static uint32_t
-lookup_folder_id (LIBMTP_folder_t * folder, const gchar * path)
+/* Remove the entry of this object, other ones of the same name stay */
+static void
+name_index_remove (GHashTable * index, const gchar * name, gpointer object)
 {
-    gchar ** fields;
-    gsize pos;
-    uint32_t ret = 0xFFFFFFFF;
+    gchar buffer[FOLD_BUFFER_SIZE];
+    NameEntry *first, *entry, **link;
+    gchar *folded;
+
+    if (index == NULL || name == NULL)
+        return;
+    folded = fold_name_in(name, buffer);
+    first = g_hash_table_lookup(index, folded);
+    for (link = &first; *link != NULL && (*link)->object != object; link = &(*link)->next)
+        ;
+    entry = *link;
+    if (entry == NULL) {
+        // Not indexed under this name
+    } else if (entry != first) {
+        *link = entry->next;
+        entry->next = NULL;
+        free_name_entries(entry);
+    } else if (first->next == NULL) {
+        g_hash_table_remove(index, folded);
+    } else {
+        // Keep the value of the key, the second entry moves into it
+        entry = first->next;
+        g_free(first->name);
+        first->name = entry->name;
+        first->object = entry->object;
+        first->next = entry->next;
+        g_free(entry);
+    }
+    if (folded != buffer)
+        g_free(folded);
+}
 
-    DBG_F("lookup_folder_id(%p, %s)", folder, path);
+static gint64
+parent_key (uint32_t storage_id, uint32_t parent_id)
+{
+    return ((gint64) storage_id << 32) | parent_id;
+}
 
-    if (folder == NULL) {
-        DBG_F("lookup_folder_id: Empty list");
-        return 0xFFFFFFFF;
+static GHashTable *
+file_children (MtpfsContext * ctx, uint32_t storage_id, uint32_t parent_id, gboolean create)
+{
+    gint64 key = parent_key(storage_id, parent_id);
+    GHashTable *children;
+
+    if (ctx->files_by_parent == NULL)
+        return NULL;
+    children = g_hash_table_lookup(ctx->files_by_parent, &key);
+    if (children == NULL && create) {
+        gint64 *pkey = g_new(gint64, 1);
+        *pkey = key;
+        children = new_name_index();
+        g_hash_table_insert(ctx->files_by_parent, pkey, children);
     }
-    if (path[0] != '/') {
-        DBG("lookup_folder_id: Internal error: unexpected root")
-        return 0xFFFFFFFF;
+    return children;
+}
+
+static GHashTable *
+folder_children (MtpfsContext * ctx, int storageid, uint32_t parent_id, gboolean create)
+{
+    GHashTable *children;
+
+    if (ctx->storageArea[storageid].folder_index == NULL)
+        return NULL;
+    children = g_hash_table_lookup(ctx->storageArea[storageid].folder_index, GUINT_TO_POINTER(parent_id));
+    if (children == NULL && create) {
+        children = new_name_index();
+        g_hash_table_insert(ctx->storageArea[storageid].folder_index, GUINT_TO_POINTER(parent_id), children);
     }
+    return children;
+}
 
-    check_folders();
+/* Instead of LIBMTP_Find_Folder, which walks the whole tree */
+static LIBMTP_folder_t *
+folder_by_id (MtpfsContext * ctx, int storageid, uint32_t folder_id)
+{
+    if (ctx->storageArea[storageid].folders_by_id == NULL)
+        return NULL;
+    return g_hash_table_lookup(ctx->storageArea[storageid].folders_by_id, GUINT_TO_POINTER(folder_id));
+}
 
-    fields = g_strsplit(path + 1, "/", -1);
+/* Whether folder_id is ancestor_id or one of its subfolders */
+static gboolean
+folder_below (MtpfsContext * ctx, int storageid, uint32_t folder_id, uint32_t ancestor_id)
+{
+    LIBMTP_folder_t *folder;
 
-    if (fields[1] == NULL) {
-        DBG("lookup_folder_id: Storage dir");
-        return 0;
+    while (folder_id != 0 && (folder = folder_by_id(ctx, storageid, folder_id)) != NULL) {
+        if (folder_id == ancestor_id)
+            return TRUE;
+        folder_id = folder->parent_id;
     }
+    return FALSE;
+}
 
-    //DBG("lookup_folder_id: Strip storage area name");
-    pos = 1;
+static void
+index_folder (MtpfsContext * ctx, int storageid, LIBMTP_folder_t * folder)
+{
+    name_index_add(folder_children(ctx, storageid, folder->parent_id, TRUE), folder->name, folder);
+    g_hash_table_insert(ctx->storageArea[storageid].folders_by_id, GUINT_TO_POINTER(folder->folder_id), folder);
+}
 
-    while (fields[pos] != NULL && folder != NULL) {
-        if (*fields[pos] == '\0') {
-            //DBG("lookup_folder_id: Skipping empty part in path");
-            ++pos;
-            continue;
-        }
-        //DBG("lookup_folder_id: Compare %s(%i) and %s", fields[pos], pos, folder->name);
-        if (g_ascii_strncasecmp(fields[pos], folder->name, strlen(folder->name)) == 0) {
-            //DBG("lookup_folder_id: match, going deeper");
-            ret = folder->folder_id;
-            ++pos;
-            folder = folder->child;
-        } else {
-            //DBG("lookup_folder_id: no match, try sibling");
-            folder = folder->sibling;
-        }
+static void
+index_folders (MtpfsContext * ctx, int storageid, LIBMTP_folder_t * folder)
+{
+    for (; folder != NULL; folder = folder->sibling) {
+        if (folder->name == NULL)
+            folder->name = unnamed_object(folder->folder_id);
+        index_folder(ctx, storageid, folder);
+        index_folders(ctx, storageid, folder->child);
     }
+}
 
-    if (fields[pos] == NULL) {
-        DBG("lookup_folder_id %s: found %i", path, ret);
-        return ret;
+/* Names looked up in vain, so that repeated probes (.hidden, desktop.ini,
+ * ...) do not search again.  Anything added to a directory forgets its
+ * missing names, a refresh forgets them all. */
+static void
+forget_missing (MtpfsContext * ctx, uint32_t storage_id, uint32_t parent_id)
+{
+    gint64 key = parent_key(storage_id, parent_id);
+
+    G_LOCK(resolved_lock);
+    if (ctx->missing != NULL)
+        g_hash_table_remove(ctx->missing, &key);
+    G_UNLOCK(resolved_lock);
+}
+
+static void
+forget_all_missing (MtpfsContext * ctx)
+{
+    G_LOCK(resolved_lock);
+    if (ctx->missing != NULL)
+        g_hash_table_remove_all(ctx->missing);
+    G_UNLOCK(resolved_lock);
+}
+
+static gboolean
+is_missing (MtpfsContext * ctx, uint32_t storage_id, uint32_t parent_id, const gchar * name)
+{
+    gint64 key = parent_key(storage_id, parent_id);
+    GHashTable *names;
+    gboolean ret;
+
+    G_LOCK(resolved_lock);
+    names = g_hash_table_lookup(ctx->missing, &key);
+    ret = names != NULL && name_index_lookup(names, name) != NULL;
+    G_UNLOCK(resolved_lock);
+    return ret;
+}
+
+static void
+remember_missing (MtpfsContext * ctx, uint32_t storage_id, uint32_t parent_id, const gchar * name)
+{
+    gint64 key = parent_key(storage_id, parent_id);
+    GHashTable *names;
+
+    G_LOCK(resolved_lock);
+    names = g_hash_table_lookup(ctx->missing, &key);
+    if (names == NULL || g_hash_table_size(names) >= MISSING_PER_DIR) {
+        gint64 *pkey = g_new(gint64, 1);
+        *pkey = key;
+        names = new_name_index();
+        g_hash_table_replace(ctx->missing, pkey, names);
     }
-    g_strfreev(fields);
-    DBG("lookup_folder_id %s: not found", path);
-    return 0xFFFFFFFF;
+    // Any non-NULL value, lookups only tell whether the name is there
+    g_hash_table_replace(names, fold_name(name), GINT_TO_POINTER(TRUE));
+    G_UNLOCK(resolved_lock);
 }
 
-static uint32_t
-parse_path (const gchar * path)
+/* Freeing tree representation */
+static void
+free_files (MtpfsContext * ctx)
 {
-    uint32_t res;
-    uint32_t item_id = 0xFFFFFFFF;
-    int i;
+    DBG_F("Free_files()");
 
-    DBG_F("parse_path(%s)", path);
+    if (ctx->files_by_parent) g_hash_table_destroy(ctx->files_by_parent);
+    if (ctx->files) g_hash_table_destroy(ctx->files);
+    ctx->files_by_parent = NULL;
+    ctx->files = NULL;
+}
 
-    // Check lost+found
-    if (strncmp("/lost+found", path, 11) == 0) {
-        GSList *item;
-        gchar *filename  = g_path_get_basename (path);
+static void
+new_files (MtpfsContext * ctx)
+{
+    free_files(ctx);
+    forget_all_missing(ctx);
+    ctx->files = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL,
+                                  (GDestroyNotify) LIBMTP_destroy_file_t);
+    ctx->files_by_parent = g_hash_table_new_full(g_int64_hash, g_int64_equal, g_free,
+                                            (GDestroyNotify) g_hash_table_destroy);
+}
 
-        res = 0xFFFFFFFF;
-        for (item = lostfiles; item != NULL; item = g_slist_next (item) ) {
-            LIBMTP_file_t *file = (LIBMTP_file_t *) item->data;
+/* Resolved paths are only valid until folders move or go away */
+static void
+forget_resolved (MtpfsContext * ctx)
+{
+    G_LOCK(resolved_lock);
+    if (ctx->resolved != NULL)
+        g_hash_table_remove_all(ctx->resolved);
+    G_UNLOCK(resolved_lock);
+}
 
-            if (strcmp( file->filename, filename) == 0) {
-                res = file->item_id;
-                break;
-            }
+/* Only forget the paths resolved to a folder and those below them, the
+ * other ones stay valid */
+static void
+forget_resolved_folder (MtpfsContext * ctx, uint32_t folder_id)
+{
+    GPtrArray *prefixes = g_ptr_array_new_with_free_func(g_free);
+    GHashTableIter iter;
+    gpointer key, value;
+    guint i;
+
+    G_LOCK(resolved_lock);
+    g_hash_table_iter_init(&iter, ctx->resolved);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        if (GPOINTER_TO_UINT(value) == folder_id) {
+            g_ptr_array_add(prefixes, g_strconcat(key, "/", NULL));
+            g_hash_table_iter_remove(&iter);
         }
-        g_free (filename);
-        return res;
-    }
-
-    // Check device
-    LIBMTP_folder_t *folder;
-    gchar **fields;
-    gchar *directory;
-    size_t path_len = strlen (path) + 1;
-    directory = (gchar *) g_malloc(path_len);
-    if (directory == NULL) {
-        DBG("Memory error")
-        res = 0xFFFFFFFF;
-        goto end;
     }
-    *directory = '\0';
-    fields = g_strsplit (path, "/", -1);
-    res = 0xFFFFFFFF;
-    int storageid;
-    storageid = find_storage(path);
-    for (i = 0; fields[i] != NULL; i++) {
-        if (strlen (fields[i]) > 0) {
-            if (fields[i + 1] != NULL) {
-                if (path_len < (strlen(fields[i]) + 2)) {
-                    DBG("INTERNAL ERROR, please report");
-                    res = 0xFFFFFFFF;
-                    goto freeall;
-                }
-                directory = strncat (directory, "/", path_len);
-                --path_len;
-                directory = strncat (directory, fields[i], path_len);
-                path_len -= strlen(fields[i]);
-            } else {
-                check_folders();
-                folder = storageArea[storageid].folders;
-                uint32_t folder_id = 0;
-                if (strcmp (directory, "") != 0) {
-                    folder_id = lookup_folder_id (folder, directory);
-                }
-                DBG("parent id:%d:%s", folder_id, directory);
-                LIBMTP_file_t *file;
-                check_files();
-                file = files;
-                while (file != NULL) {
-                    if (file->parent_id == folder_id) {
-                        if (folder_id == 0 && (file->storage_id != storageArea[storageid].storage->id)) {
-                            goto next;
-                        }
-                        if (file->filename == NULL) DBG("MTPFS filename NULL");
-                        if (file->filename != NULL && g_ascii_strcasecmp (file->filename, fields[i]) == 0) {
-                            DBG("found:%d:%s", file->item_id, file->filename);
-
-                            item_id = file->item_id;
-                            break; // found!
-                        }
-                    }
-next:
-                    file = file->next;
-                }
-                if (item_id == 0xFFFFFFFF) {
-                    if (path_len < (strlen(fields[i]) + 2)) {
-                        DBG("INTERNAL ERROR, please report");
-                        res = 0xFFFFFFFF;
-                        goto freeall;
-                    }
-                    directory = strncat (directory, "/", path_len);
-                    --path_len;
-                    directory = strncat (directory, fields[i], path_len);
-                    path_len -= strlen(fields[i]);
-                    item_id = lookup_folder_id (folder, directory);
-                    res = item_id;
-                    break;
-                } else {
-                    res = item_id;
+    if (prefixes->len > 0) {
+        g_hash_table_iter_init(&iter, ctx->resolved);
+        while (g_hash_table_iter_next(&iter, &key, NULL)) {
+            for (i = 0; i < prefixes->len; ++i) {
+                if (g_str_has_prefix(key, g_ptr_array_index(prefixes, i))) {
+                    g_hash_table_iter_remove(&iter);
                     break;
                 }
             }
         }
     }
-freeall:
-    g_strfreev (fields);
-    g_free (directory);
-end:
-    DBG("parse_path exiting:%s - %d",path,res);
-    return res;
+    G_UNLOCK(resolved_lock);
+    g_ptr_array_free(prefixes, TRUE);
 }
 
-/* Find the file type based on extension */
-static LIBMTP_filetype_t
-find_filetype (const gchar * filename)
+static void
+free_folders (MtpfsContext * ctx, int storageid)
 {
-    DBG("find_filetype");
-    gchar **fields;
-    fields = g_strsplit (filename, ".", -1);
-    gchar *ptype;
-    ptype = g_strdup (fields[g_strv_length (fields) - 1]);
-    g_strfreev (fields);
-    LIBMTP_filetype_t filetype;
+    DBG_F("free_folders(%d)", storageid);
 
-    // This need to be kept constantly updated as new file types arrive.
-    if (!g_ascii_strncasecmp (ptype, "wav",3)) {
-        filetype = LIBMTP_FILETYPE_WAV;
-    } else if (!g_ascii_strncasecmp (ptype, "mp3",3)) {
-        filetype = LIBMTP_FILETYPE_MP3;
-    } else if (!g_ascii_strncasecmp (ptype, "wma",3)) {
-        filetype = LIBMTP_FILETYPE_WMA;
-    } else if (!g_ascii_strncasecmp (ptype, "ogg",3)) {
-        filetype = LIBMTP_FILETYPE_OGG;
-    } else if (!g_ascii_strncasecmp (ptype, "aa",2)) {
+    forget_resolved(ctx);
+    forget_all_missing(ctx);
+    if (ctx->storageArea[storageid].folder_index) {
+        g_hash_table_destroy(ctx->storageArea[storageid].folder_index);
+    }
+    if (ctx->storageArea[storageid].folders_by_id) {
+        g_hash_table_destroy(ctx->storageArea[storageid].folders_by_id);
+    }
+    if (ctx->storageArea[storageid].folders) {
+        LIBMTP_destroy_folder_t(ctx->storageArea[storageid].folders);
+    }
+    ctx->storageArea[storageid].folder_index = NULL;
+    ctx->storageArea[storageid].folders_by_id = NULL;
+    ctx->storageArea[storageid].folders = NULL;
+}
+
+static void
+new_folders (MtpfsContext * ctx, int storageid)
+{
+    free_folders(ctx, storageid);
+    ctx->storageArea[storageid].folder_index = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL,
+                                                                (GDestroyNotify) g_hash_table_destroy);
+    ctx->storageArea[storageid].folders_by_id = g_hash_table_new(g_direct_hash, g_direct_equal);
+}
+
+/* Runtime statistics */
+
+static void
+stats_time (StatTimer timer, gint64 start)
+{
+    guint64 us = (guint64) (g_get_monotonic_time() - start);
+    StatTimes *times = &stat_times[timer];
+    guint bucket = 0;
+
+    while (bucket < STAT_BUCKETS - 1 && us >= ((guint64) 1 << bucket))
+        bucket++;
+    g_mutex_lock(&stats_lock);
+    times->count++;
+    times->total_us += us;
+    times->max_us = MAX(times->max_us, us);
+    times->buckets[bucket]++;
+    g_mutex_unlock(&stats_lock);
+}
+
+static void
+stats_add (StatCounter counter, guint64 value)
+{
+    g_mutex_lock(&stats_lock);
+    stat_counters[counter] += value;
+    g_mutex_unlock(&stats_lock);
+}
+
+/* Text of /.mtpfs/stats, one value per line */
+static GString *
+stats_snapshot ()
+{
+    GString *out = g_string_new(NULL);
+    guint64 hits, misses, evictions;
+    int i, j;
+
+    G_LOCK(cache_lock);
+    hits = block_cache.hits;
+    misses = block_cache.misses;
+    evictions = block_cache.evictions;
+    G_UNLOCK(cache_lock);
+
+    g_string_append(out, "# counter <name> <value>\n");
+    g_string_append_printf(out, "# timer <name> <count> <total_us> <max_us> <calls under 1us 2us 4us ... %lluus> <longer calls>\n",
+                           1ULL << (STAT_BUCKETS - 2));
+    g_mutex_lock(&stats_lock);
+    for (i = 0; i < STAT_COUNTERS; ++i)
+        g_string_append_printf(out, "counter %s %" G_GUINT64_FORMAT "\n", stat_counter_names[i], stat_counters[i]);
+    g_string_append_printf(out, "counter block_cache.hits %" G_GUINT64_FORMAT "\n", hits);
+    g_string_append_printf(out, "counter block_cache.misses %" G_GUINT64_FORMAT "\n", misses);
+    g_string_append_printf(out, "counter block_cache.evictions %" G_GUINT64_FORMAT "\n", evictions);
+    for (i = 0; i < STAT_TIMERS; ++i) {
+        StatTimes *times = &stat_times[i];
+
+        g_string_append_printf(out, "timer %s %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT,
+                               stat_timer_names[i], times->count, times->total_us, times->max_us);
+        for (j = 0; j < STAT_BUCKETS; ++j)
+            g_string_append_printf(out, " %" G_GUINT64_FORMAT, times->buckets[j]);
+        g_string_append_c(out, '\n');
+    }
+    g_mutex_unlock(&stats_lock);
+    return out;
+}
+
+/* Accessing the device: libmtp calls are serialized, interactive requests
+ * going first so they only wait for the chunk being transferred */
+
+static void
+lock_device (MtpfsContext * ctx, DevicePriority priority)
+{
+    gint64 start = g_get_monotonic_time();
+
+    g_mutex_lock(&ctx->device_lock);
+    ctx->device_waiting[priority]++;
+    while (ctx->device_busy || (priority == DEVICE_BULK && ctx->device_waiting[DEVICE_INTERACTIVE] > 0))
+        g_cond_wait(&ctx->device_cond, &ctx->device_lock);
+    ctx->device_waiting[priority]--;
+    ctx->device_busy = TRUE;
+    g_mutex_unlock(&ctx->device_lock);
+    stats_time(priority == DEVICE_BULK ? STAT_WAIT_DEVICE_BULK : STAT_WAIT_DEVICE_INTERACTIVE, start);
+    ctx->device_since = g_get_monotonic_time();
+}
+
+/* Release the device after the libmtp call timed as call */
+static void
+unlock_device (MtpfsContext * ctx, StatTimer call)
+{
+    stats_time(call, ctx->device_since);
+    g_mutex_lock(&ctx->device_lock);
+    ctx->device_busy = FALSE;
+    g_cond_broadcast(&ctx->device_cond);
+    g_mutex_unlock(&ctx->device_lock);
+}
+
+/* Caching blocks of file content */
+
+static void
+free_block (CacheBlock * block)
+{
+    g_queue_delete_link(&block_cache.lru, block->link);
+    block_cache.size -= block->size;
+    free(block->data);
+    g_free(block);
+}
+
+static guint
+block_key_hash (gconstpointer data)
+{
+    const BlockKey *key = data;
+
+    return g_direct_hash(key->ctx) ^ (key->item_id * 31) ^ key->index;
+}
+
+static gboolean
+block_key_equal (gconstpointer a, gconstpointer b)
+{
+    const BlockKey *ka = a, *kb = b;
+
+    return ka->ctx == kb->ctx && ka->item_id == kb->item_id && ka->index == kb->index;
+}
+
+static void
+init_block_cache (guint64 max_size)
+{
+    block_cache.blocks = g_hash_table_new_full(block_key_hash, block_key_equal, NULL,
+                                               (GDestroyNotify) free_block);
+    g_queue_init(&block_cache.lru);
+    block_cache.size = 0;
+    block_cache.max_size = max_size;
+}
+
+static gboolean
+block_of_item (gpointer key, gpointer value, gpointer item)
+{
+    return ((BlockKey *) key)->ctx == ((BlockKey *) item)->ctx &&
+        ((BlockKey *) key)->item_id == ((BlockKey *) item)->item_id;
+}
+
+static gboolean
+block_of_device (gpointer key, gpointer value, gpointer ctx)
+{
+    return ((BlockKey *) key)->ctx == ctx;
+}
+
+/* Drop the cached content of an object that was removed or replaced */
+static void
+block_cache_invalidate (MtpfsContext * ctx, uint32_t item_id)
+{
+    BlockKey item;
+
+    DBG_F("block_cache_invalidate(%d)", item_id);
+
+    item.ctx = ctx;
+    item.item_id = item_id;
+    G_LOCK(cache_lock);
+    g_hash_table_foreach_remove(block_cache.blocks, block_of_item, &item);
+    G_UNLOCK(cache_lock);
+}
+
+/* Drop the cached content of a device, the others keep theirs */
+static void
+block_cache_clear (MtpfsContext * ctx)
+{
+    G_LOCK(cache_lock);
+    g_hash_table_foreach_remove(block_cache.blocks, block_of_device, ctx);
+    G_UNLOCK(cache_lock);
+}
+
+/* Copy the part of a block past skip, fetching it from the device if needed.
+ * Returns the number of bytes copied, -1 if the block cannot be read.
+ * Without buf, only brings the block in the cache. */
+static int
+block_cache_read (MtpfsContext * ctx, uint32_t item_id, uint64_t filesize, uint32_t index,
+                  uint32_t skip, gchar * buf, size_t size)
+{
+    BlockKey key = { ctx, item_id, index };
+    uint64_t offset = (uint64_t) index * CACHE_BLOCK_SIZE;
+    CacheBlock *block;
+    unsigned char *data = NULL;
+    unsigned int len = 0;
+    int ret;
+
+    G_LOCK(cache_lock);
+    block = g_hash_table_lookup(block_cache.blocks, &key);
+    if (block != NULL && buf == NULL) {
+        G_UNLOCK(cache_lock);
+        return 0;
+    }
+    if (block != NULL) {
+        block_cache.hits++;
+    } else {
+        block_cache.misses++;
+        // Do not keep other readers out of the cache during the transfer
+        G_UNLOCK(cache_lock);
+        lock_device(ctx, buf == NULL ? DEVICE_BULK : DEVICE_INTERACTIVE);
+        ret = ctx->mtp->get_partial_object(ctx->device, item_id, offset,
+                                      (uint32_t) MIN(CACHE_BLOCK_SIZE, filesize - offset), &data, &len);
+        if (ret != 0)
+            dump_mtp_error(ctx->device);
+        unlock_device(ctx, STAT_MTP_PARTIAL_OBJECT);
+        if (ret != 0) {
+            free(data);
+            return -1;
+        }
+        stats_add(STAT_BYTES_DOWNLOADED, len);
+
+        G_LOCK(cache_lock);
+        // Another thread may have fetched it meanwhile
+        block = g_hash_table_lookup(block_cache.blocks, &key);
+        if (block != NULL) {
+            free(data);
+        } else {
+            block = g_new(CacheBlock, 1);
+            block->key = key;
+            block->data = data;
+            block->size = len;
+            g_queue_push_head(&block_cache.lru, block);
+            block->link = g_queue_peek_head_link(&block_cache.lru);
+            g_hash_table_insert(block_cache.blocks, &block->key, block);
+            block_cache.size += len;
+        }
+    }
+    g_queue_unlink(&block_cache.lru, block->link);
+    g_queue_push_head_link(&block_cache.lru, block->link);
+
+    ret = 0;
+    if (buf != NULL && block->size > skip) {
+        ret = (int) MIN(block->size - skip, size);
+        memcpy(buf, block->data + skip, (size_t) ret);
+    }
+
+    // Always keep the block we just used
+    while (block_cache.size > block_cache.max_size && block_cache.lru.length > 1) {
+        CacheBlock *old = g_queue_peek_tail(&block_cache.lru);
+        block_cache.evictions++;
+        g_hash_table_remove(block_cache.blocks, &old->key);
+    }
+    G_UNLOCK(cache_lock);
+    return ret;
+}
+
+/* Reading ahead of sequential readers */
+
+/* One worker per device, so devices fill the cache in parallel */
+static gpointer
+readahead_worker (gpointer data)
+{
+    MtpfsContext *ctx = data;
+    ReadaheadRequest *req;
+
+    while ((req = g_async_queue_pop(ctx->readahead_queue)) != &readahead_stop) {
+        gboolean known;
+
+        // Skip objects dropped from the cached tree since the request
+        g_rw_lock_reader_lock(&ctx->tree_lock);
+        known = ctx->files != NULL && g_hash_table_contains(ctx->files, GUINT_TO_POINTER(req->item_id));
+        g_rw_lock_reader_unlock(&ctx->tree_lock);
+        if (known && !g_atomic_int_get(&readahead_stopping)) {
+            DBG_F("readahead(%d, %d)", req->item_id, req->index);
+            block_cache_read(ctx, req->item_id, req->filesize, req->index, 0, NULL, 0);
+        }
+        g_free(req);
+    }
+    return NULL;
+}
+
+/* Drop the queued requests of a handle, nobody reads their blocks anymore */
+static void
+cancel_readahead (FileHandle * fh)
+{
+    GAsyncQueue *queue = fh->ctx->readahead_queue;
+    ReadaheadRequest *req;
+    GQueue keep = G_QUEUE_INIT;
+
+    if (fh->ctx->readahead_thread == NULL)
+        return;
+    g_async_queue_lock(queue);
+    while ((req = g_async_queue_try_pop_unlocked(queue)) != NULL) {
+        if (req != &readahead_stop && req->owner == fh) {
+            g_free(req);
+        } else {
+            g_queue_push_tail(&keep, req);
+        }
+    }
+    while ((req = g_queue_pop_head(&keep)) != NULL)
+        g_async_queue_push_unlocked(queue, req);
+    g_async_queue_unlock(queue);
+}
+
+/* Grow the window while reads are sequential, and queue the blocks past it */
+static void
+schedule_readahead (FileHandle * fh, off_t offset, size_t size)
+{
+    uint32_t max_window, index, last, blocks;
+
+    if (fh->ctx->readahead_thread == NULL)
+        return;
+    // A seek: what was queued for the previous position is of no use
+    if ((uint64_t) offset != fh->next_offset) {
+        if (fh->readahead_end != 0)
+            cancel_readahead(fh);
+        fh->readahead = 0;
+        fh->readahead_end = 0;
+        fh->next_offset = (uint64_t) offset + size;
+        return;
+    }
+    fh->next_offset = (uint64_t) offset + size;
+
+    // Keep prefetched blocks from evicting each other
+    max_window = (uint32_t) MIN(READAHEAD_MAX_BLOCKS, block_cache.max_size / CACHE_BLOCK_SIZE / 2);
+    fh->readahead = MIN(fh->readahead == 0 ? 1 : fh->readahead * 2, max_window);
+
+    blocks = (uint32_t) ((fh->filesize + CACHE_BLOCK_SIZE - 1) / CACHE_BLOCK_SIZE);
+    index = (uint32_t) (fh->next_offset / CACHE_BLOCK_SIZE);
+    last = MIN(index + fh->readahead, blocks);
+    for (index = MAX(index, fh->readahead_end); index < last; ++index) {
+        ReadaheadRequest *req = g_new(ReadaheadRequest, 1);
+        req->item_id = fh->item_id;
+        req->filesize = fh->filesize;
+        req->index = index;
+        req->owner = fh;
+        g_async_queue_push(fh->ctx->readahead_queue, req);
+    }
+    fh->readahead_end = MAX(fh->readahead_end, last);
+}
+
+/* Checking tree representation */
+
+/* SIGUSR1 asks for a full refresh of the cached tree */
+static void
+request_refresh (int sig)
+{
+    refresh_generation++;
+}
+
+static void
+check_refresh (MtpfsContext * ctx)
+{
+    int i;
+
+    if (ctx->refresh_seen != refresh_generation) {
+        DBG("Refresh requested");
+        ctx->refresh_seen = refresh_generation;
+        ctx->files_changed = TRUE;
+        block_cache_clear(ctx);
+        for (i = 0; i < MAX_STORAGE_AREA; ++i) {
+            if (ctx->storageArea[i].storage != NULL)
+                ctx->storageArea[i].folders_changed = TRUE;
+        }
+    }
+}
+
+static void
+index_file (MtpfsContext * ctx, LIBMTP_file_t * file)
+{
+    file->next = NULL;
+    if (file->filename == NULL)
+        file->filename = unnamed_object(file->item_id);
+    g_hash_table_replace(ctx->files, GUINT_TO_POINTER(file->item_id), file);
+    name_index_add(file_children(ctx, file->storage_id, file->parent_id, TRUE), file->filename, file);
+    forget_missing(ctx, file->storage_id, file->parent_id);
+}
+
+/* In lazy mode, any refresh drops the whole cache: directories are
+ * enumerated again when they are next used */
+static void
+check_lazy (MtpfsContext * ctx)
+{
+    gboolean changed = ctx->files_changed;
+    int i;
+
+    for (i = 0; i < MAX_STORAGE_AREA; ++i) {
+        changed |= ctx->storageArea[i].folders_changed;
+    }
+    if (!changed)
+        return;
+
+    DBG("Dropping cached tree");
+    new_files(ctx);
+    ctx->files_changed = FALSE;
+    for (i = 0; i < MAX_STORAGE_AREA; ++i) {
+        if (ctx->storageArea[i].storage != NULL) {
+            new_folders(ctx, i);
+            ctx->storageArea[i].folders_changed = FALSE;
+        }
+    }
+    g_hash_table_remove_all(ctx->populated);
+}
+
+static void
+check_files (MtpfsContext * ctx)
+{
+    DBG_F("check_files()");
+
+    if (lazy) {
+        check_lazy(ctx);
+        return;
+    }
+
+    if (ctx->files_changed) {
+        LIBMTP_file_t *file, *next;
+
+        DBG("Refreshing Filelist");
+        stats_add(STAT_FULL_LISTINGS, 1);
+        new_files(ctx);
+        lock_device(ctx, DEVICE_INTERACTIVE);
+        file = ctx->mtp->get_filelisting_with_callback(ctx->device, NULL, NULL);
+        unlock_device(ctx, STAT_MTP_FILE_LISTING);
+        while (file != NULL) {
+            next = file->next;
+            index_file(ctx, file);
+            file = next;
+        }
+        ctx->files_changed = FALSE;
+        //check_lost_files ();
+        DBG("Refreshing Filelist exiting");
+    }
+}
+
+static void
+check_lost_files (MtpfsContext * ctx)
+{
+    uint32_t last_parent_id = 0xFFFFFFFF;
+    gboolean last_parent_found = FALSE;
+    GHashTableIter iter;
+    LIBMTP_file_t *item;
+
+    DBG_F("check_lost_files()");
+
+    if (ctx->lostfiles != NULL)
+        g_slist_free (ctx->lostfiles);
+
+    ctx->lostfiles = NULL;
+    if (ctx->files == NULL)
+        return;
+    g_hash_table_iter_init(&iter, ctx->files);
+    while (g_hash_table_iter_next(&iter, NULL, (gpointer *) &item)) {
+        gboolean parent_found;
+
+        if (last_parent_id == 0xFFFFFFFF || last_parent_id != item->parent_id) {
+            if (item->parent_id == 0) {
+                parent_found = TRUE;
+            } else {
+                int i;
+                for (i = 0; i < MAX_STORAGE_AREA; ++i) {
+                    if (folder_by_id(ctx, i, item->parent_id) != NULL) {
+                        parent_found = FALSE;
+                    }
+                }
+            }
+            last_parent_id = item->parent_id;
+            last_parent_found = parent_found;
+        } else {
+            parent_found = last_parent_found;
+        }
+        DBG("MTPFS checking for lost files %s, parent %d - %s", item->filename, last_parent_id, ( parent_found ? "FALSE" : "TRUE" ) );
+        if (parent_found == FALSE) {
+            ctx->lostfiles = g_slist_append (ctx->lostfiles, item);
+        }
+    }
+    DBG("MTPFS checking for lost files exit found %d lost tracks", g_slist_length (ctx->lostfiles) );
+}
+
+static void
+check_folders (MtpfsContext * ctx)
+{
+    int i;
+
+    DBG_F("check_folders()");
+
+    if (lazy) {
+        check_lazy(ctx);
+        return;
+    }
+
+    for (i = 0; i < MAX_STORAGE_AREA; ++i) {
+        if (ctx->storageArea[i].folders_changed) {
+            DBG("Refreshing Folderlist %d-%s", i,ctx->storageArea[i].storage->StorageDescription);
+            stats_add(STAT_FOLDER_LISTINGS, 1);
+            new_folders(ctx, i);
+            lock_device(ctx, DEVICE_INTERACTIVE);
+            ctx->storageArea[i].folders = ctx->mtp->get_folder_list_for_storage(ctx->device, ctx->storageArea[i].storage->id);
+            unlock_device(ctx, STAT_MTP_FOLDER_LIST);
+            index_folders(ctx, i, ctx->storageArea[i].folders);
+            ctx->storageArea[i].folders_changed= FALSE;
+        }
+    }
+}
+
+/* Locking tree representation: lookups share the tree, unless they
+ * would refresh it or, in lazy mode, enumerate directories (see
+ * lock_tree_path) */
+
+static gboolean
+tree_stale (MtpfsContext * ctx)
+{
+    int i;
+
+    if (ctx->refresh_seen != refresh_generation || ctx->files_changed)
+        return TRUE;
+    for (i = 0; i < MAX_STORAGE_AREA; ++i) {
+        if (ctx->storageArea[i].folders_changed)
+            return TRUE;
+    }
+    return FALSE;
+}
+
+static void
+lock_tree_write (MtpfsContext * ctx)
+{
+    gint64 start = g_get_monotonic_time();
+
+    g_rw_lock_writer_lock(&ctx->tree_lock);
+    stats_time(STAT_WAIT_TREE_WRITE, start);
+    g_private_set(&tree_writer, GINT_TO_POINTER(TRUE));
+    check_refresh(ctx);
+}
+
+/* Take the tree shared, FALSE if it needs refreshing.  In lazy mode the
+ * caller checks nothing needs listing either. */
+static gboolean
+share_tree (MtpfsContext * ctx)
+{
+    gint64 start = g_get_monotonic_time();
+
+    g_rw_lock_reader_lock(&ctx->tree_lock);
+    stats_time(STAT_WAIT_TREE_READ, start);
+    if (!tree_stale(ctx)) {
+        g_private_set(&tree_writer, NULL);
+        return TRUE;
+    }
+    g_rw_lock_reader_unlock(&ctx->tree_lock);
+    return FALSE;
+}
+
+static void
+lock_tree (MtpfsContext * ctx)
+{
+    if (lazy || !share_tree(ctx))
+        lock_tree_write(ctx);
+}
+
+static void
+unlock_tree (MtpfsContext * ctx)
+{
+    if (g_private_get(&tree_writer) != NULL) {
+        g_rw_lock_writer_unlock(&ctx->tree_lock);
+    } else {
+        g_rw_lock_reader_unlock(&ctx->tree_lock);
+    }
+}
+
+/* Object ids are given per session, those of a tree read from an index
+ * may now be other objects: listings use it while this thread reads the
+ * tree from the device, then swaps it in */
+static gpointer
+revalidate_worker (gpointer data)
+{
+    MtpfsContext *ctx = data;
+    LIBMTP_folder_t *folders[MAX_STORAGE_AREA];
+    LIBMTP_file_t *files, *next;
+    int i;
+
+    DBG("Checking indexed tree against the device");
+    stats_add(STAT_FULL_LISTINGS, 1);
+    lock_device(ctx, DEVICE_BULK);
+    files = ctx->mtp->get_filelisting_with_callback(ctx->device, NULL, NULL);
+    unlock_device(ctx, STAT_MTP_FILE_LISTING);
+    for (i = 0; i < MAX_STORAGE_AREA; ++i) {
+        folders[i] = NULL;
+        if (ctx->storageArea[i].storage == NULL)
+            continue;
+        stats_add(STAT_FOLDER_LISTINGS, 1);
+        lock_device(ctx, DEVICE_BULK);
+        folders[i] = ctx->mtp->get_folder_list_for_storage(ctx->device, ctx->storageArea[i].storage->id);
+        unlock_device(ctx, STAT_MTP_FOLDER_LIST);
+    }
+
+    // Nothing changed the tree meanwhile, changes wait in check_index
+    lock_tree_write(ctx);
+    new_files(ctx);
+    for (; files != NULL; files = next) {
+        next = files->next;
+        index_file(ctx, files);
+    }
+    ctx->files_changed = FALSE;
+    for (i = 0; i < MAX_STORAGE_AREA; ++i) {
+        if (ctx->storageArea[i].storage == NULL)
+            continue;
+        new_folders(ctx, i);
+        ctx->storageArea[i].folders = folders[i];
+        index_folders(ctx, i, folders[i]);
+        ctx->storageArea[i].folders_changed = FALSE;
+    }
+    unlock_tree(ctx);
+
+    g_mutex_lock(&ctx->revalidate_lock);
+    g_atomic_int_set(&ctx->tree_from_index, FALSE);
+    g_cond_broadcast(&ctx->revalidate_cond);
+    g_mutex_unlock(&ctx->revalidate_lock);
+    DBG("Indexed tree replaced");
+    return NULL;
+}
+
+/* Anything that reads or changes objects waits for the tree of the device,
+ * if it is not read yet */
+static void
+check_index (MtpfsContext * ctx)
+{
+    gint64 start;
+
+    if (!g_atomic_int_get(&ctx->tree_from_index))
+        return;
+    start = g_get_monotonic_time();
+    g_mutex_lock(&ctx->revalidate_lock);
+    while (g_atomic_int_get(&ctx->tree_from_index))
+        g_cond_wait(&ctx->revalidate_cond, &ctx->revalidate_lock);
+    g_mutex_unlock(&ctx->revalidate_lock);
+    stats_time(STAT_WAIT_INDEX, start);
+}
+
+/* Updating tree representation in place */
+
+/* In lazy mode, objects of a directory not yet enumerated are not cached */
+static gboolean
+is_populated (MtpfsContext * ctx, uint32_t storage_id, uint32_t parent_id)
+{
+    gint64 key;
+
+    if (!lazy)
+        return TRUE;
+    key = parent_key(storage_id, parent_id);
+    return g_hash_table_contains(ctx->populated, &key);
+}
+
+static void
+cache_add_file (MtpfsContext * ctx, LIBMTP_file_t * file)
+{
+    DBG_F("cache_add_file(%d)", file->item_id);
+
+    if (ctx->files_changed || !is_populated(ctx, file->storage_id, file->parent_id)) {
+        // Full refresh or enumeration pending, it will include this file
+        LIBMTP_destroy_file_t(file);
+        return;
+    }
+    index_file(ctx, file);
+}
+
+static void
+cache_remove_file (MtpfsContext * ctx, uint32_t item_id)
+{
+    LIBMTP_file_t *file;
+    GHashTable *children;
+
+    DBG_F("cache_remove_file(%d)", item_id);
+
+    if (ctx->files_changed)
+        return;
+    file = g_hash_table_lookup(ctx->files, GUINT_TO_POINTER(item_id));
+    if (file == NULL) {
+        DBG("cache_remove_file: %d not cached, refreshing", item_id);
+        ctx->files_changed = TRUE;
+        return;
+    }
+    children = file_children(ctx, file->storage_id, file->parent_id, FALSE);
+    name_index_remove(children, file->filename, file);
+    g_hash_table_remove(ctx->files, GUINT_TO_POINTER(item_id));
+}
+
+static void
+insert_folder (MtpfsContext * ctx, int storageid, uint32_t folder_id, uint32_t parent_id, const gchar * name)
+{
+    LIBMTP_folder_t *folder, *parent, *sibling;
+
+    folder = LIBMTP_new_folder_t();
+    folder->folder_id = folder_id;
+    folder->parent_id = parent_id;
+    folder->storage_id = ctx->storageArea[storageid].storage->id;
+    folder->name = name != NULL ? g_strdup(name) : unnamed_object(folder_id);
+    if (parent_id == 0) {
+        folder->sibling = ctx->storageArea[storageid].folders;
+        ctx->storageArea[storageid].folders = folder;
+    } else {
+        parent = folder_by_id(ctx, storageid, parent_id);
+        if (parent == NULL) {
+            DBG("cache_add_folder: parent %d not cached, refreshing", parent_id);
+            LIBMTP_destroy_folder_t(folder);
+            ctx->storageArea[storageid].folders_changed = TRUE;
+            return;
+        }
+        folder->sibling = parent->child;
+        parent->child = folder;
+    }
+    // A folder of the same folded name may have been resolved before,
+    // paths of other folders are still valid
+    sibling = name_index_lookup(folder_children(ctx, storageid, parent_id, FALSE), folder->name);
+    if (sibling != NULL)
+        forget_resolved_folder(ctx, sibling->folder_id);
+    index_folder(ctx, storageid, folder);
+    forget_missing(ctx, folder->storage_id, parent_id);
+}
+
+static void
+cache_add_folder (MtpfsContext * ctx, int storageid, uint32_t folder_id, uint32_t parent_id, const gchar * name)
+{
+    DBG_F("cache_add_folder(%d, %d, %d, %s)", storageid, folder_id, parent_id, name);
+
+    if (ctx->storageArea[storageid].folders_changed ||
+        !is_populated(ctx, ctx->storageArea[storageid].storage->id, parent_id))
+        return;
+    insert_folder(ctx, storageid, folder_id, parent_id, name);
+}
+
+/* Lazy mode: enumerate a single directory the first time it is used */
+static void
+populate_dir (MtpfsContext * ctx, int storageid, uint32_t parent_id)
+{
+    LIBMTP_file_t *file, *next;
+    uint32_t storage_id;
+    gint64 *key;
+
+    if (is_populated(ctx, ctx->storageArea[storageid].storage->id, parent_id))
+        return;
+    assert(g_private_get(&tree_writer) != NULL);
+
+    DBG("Listing folder %d on %d", parent_id, storageid);
+    stats_add(STAT_DIR_LISTINGS, 1);
+    storage_id = ctx->storageArea[storageid].storage->id;
+    lock_device(ctx, DEVICE_INTERACTIVE);
+    file = ctx->mtp->get_files_and_folders(ctx->device, storage_id,
+                                        parent_id == 0 ? LIBMTP_FILES_AND_FOLDERS_ROOT : parent_id);
+    unlock_device(ctx, STAT_MTP_FILES_AND_FOLDERS);
+    while (file != NULL) {
+        next = file->next;
+        // Some devices report the root as 0xFFFFFFFF
+        file->parent_id = parent_id;
+        if (file->filetype == LIBMTP_FILETYPE_FOLDER) {
+            insert_folder(ctx, storageid, file->item_id, parent_id, file->filename);
+            LIBMTP_destroy_file_t(file);
+        } else {
+            index_file(ctx, file);
+        }
+        file = next;
+    }
+    key = g_new(gint64, 1);
+    *key = parent_key(storage_id, parent_id);
+    g_hash_table_add(ctx->populated, key);
+}
+
+/* Drop the index entries of a folder subtree and of the files it contains */
+static void
+uncache_folder_tree (MtpfsContext * ctx, int storageid, LIBMTP_folder_t * folder)
+{
+    LIBMTP_folder_t *child;
+    GHashTable *children;
+
+    for (child = folder->child; child != NULL; child = child->sibling) {
+        uncache_folder_tree(ctx, storageid, child);
+    }
+    g_hash_table_remove(ctx->storageArea[storageid].folder_index, GUINT_TO_POINTER(folder->folder_id));
+    g_hash_table_remove(ctx->storageArea[storageid].folders_by_id, GUINT_TO_POINTER(folder->folder_id));
+    if (lazy) {
+        gint64 key = parent_key(folder->storage_id, folder->folder_id);
+        g_hash_table_remove(ctx->populated, &key);
+    }
+    if (ctx->files_changed)
+        return;
+    children = file_children(ctx, folder->storage_id, folder->folder_id, FALSE);
+    if (children != NULL) {
+        GHashTableIter iter;
+        NameEntry *entry;
+
+        g_hash_table_iter_init(&iter, children);
+        while (g_hash_table_iter_next(&iter, NULL, (gpointer *) &entry)) {
+            for (; entry != NULL; entry = entry->next) {
+                LIBMTP_file_t *file = entry->object;
+                g_hash_table_remove(ctx->files, GUINT_TO_POINTER(file->item_id));
+            }
+            g_hash_table_iter_remove(&iter);
+        }
+    }
+}
+
+/* Take a folder out of the children of its parent, name is the one it
+ * was indexed under */
+static void
+detach_folder (MtpfsContext * ctx, int storageid, LIBMTP_folder_t * folder, const gchar * name)
+{
+    LIBMTP_folder_t **link;
+
+    if (folder->parent_id == 0) {
+        link = &ctx->storageArea[storageid].folders;
+    } else {
+        LIBMTP_folder_t *parent = folder_by_id(ctx, storageid, folder->parent_id);
+        assert(parent != NULL);
+        link = &parent->child;
+    }
+    while (*link != folder) {
+        link = &(*link)->sibling;
+    }
+    *link = folder->sibling;
+    folder->sibling = NULL;
+    name_index_remove(folder_children(ctx, storageid, folder->parent_id, FALSE), name, folder);
+}
+
+static void
+cache_remove_folder (MtpfsContext * ctx, int storageid, uint32_t folder_id)
+{
+    LIBMTP_folder_t *folder;
+
+    DBG_F("cache_remove_folder(%d, %d)", storageid, folder_id);
+
+    if (ctx->storageArea[storageid].folders_changed)
+        return;
+
+    folder = folder_by_id(ctx, storageid, folder_id);
+    if (folder == NULL) {
+        DBG("cache_remove_folder: %d not cached, refreshing", folder_id);
+        ctx->storageArea[storageid].folders_changed = TRUE;
+        return;
+    }
+    detach_folder(ctx, storageid, folder, folder->name);
+    forget_resolved_folder(ctx, folder_id);
+    uncache_folder_tree(ctx, storageid, folder);
+    LIBMTP_destroy_folder_t(folder);
+}
+
+/* A file moved or renamed on the device, old_name is the one it was
+ * indexed under */
+static void
+cache_move_file (MtpfsContext * ctx, LIBMTP_file_t * file, const gchar * old_name,
+                 uint32_t storage_id, uint32_t parent_id)
+{
+    DBG_F("cache_move_file(%d, %d, %d)", file->item_id, storage_id, parent_id);
+
+    name_index_remove(file_children(ctx, file->storage_id, file->parent_id, FALSE), old_name, file);
+    file->storage_id = storage_id;
+    file->parent_id = parent_id;
+    if (!is_populated(ctx, storage_id, parent_id)) {
+        // Listed again with its new directory
+        g_hash_table_remove(ctx->files, GUINT_TO_POINTER(file->item_id));
+        return;
+    }
+    name_index_add(file_children(ctx, storage_id, parent_id, TRUE), file->filename, file);
+    forget_missing(ctx, storage_id, parent_id);
+}
+
+/* A folder moved or renamed on the device, with its content */
+static void
+cache_move_folder (MtpfsContext * ctx, int storageid, LIBMTP_folder_t * folder, const gchar * old_name,
+                   int to_storageid, uint32_t parent_id)
+{
+    uint32_t storage_id = ctx->storageArea[to_storageid].storage->id;
+    LIBMTP_folder_t *parent;
+
+    DBG_F("cache_move_folder(%d, %d, %d, %d)", storageid, folder->folder_id, to_storageid, parent_id);
+
+    detach_folder(ctx, storageid, folder, old_name);
+    forget_resolved_folder(ctx, folder->folder_id);
+    if (to_storageid != storageid || !is_populated(ctx, storage_id, parent_id)) {
+        uncache_folder_tree(ctx, storageid, folder);
+        if (lazy) {
+            // The content is listed again when next used
+            cache_add_folder(ctx, to_storageid, folder->folder_id, parent_id, folder->name);
+        } else if (to_storageid != storageid) {
+            // Every object below changed storage, only a listing tells them
+            ctx->storageArea[to_storageid].folders_changed = TRUE;
+            ctx->files_changed = TRUE;
+        }
+        LIBMTP_destroy_folder_t(folder);
+        return;
+    }
+    folder->parent_id = parent_id;
+    if (parent_id == 0) {
+        folder->sibling = ctx->storageArea[storageid].folders;
+        ctx->storageArea[storageid].folders = folder;
+    } else {
+        parent = folder_by_id(ctx, storageid, parent_id);
+        assert(parent != NULL);
+        folder->sibling = parent->child;
+        parent->child = folder;
+    }
+    name_index_add(folder_children(ctx, storageid, parent_id, TRUE), folder->name, folder);
+    forget_missing(ctx, storage_id, parent_id);
+}
+
+/* Persisting tree representation across mounts */
+
+static gchar *
+index_path (MtpfsContext * ctx, int storageid)
+{
+    return g_strdup_printf("%s/%s-%08x.idx", index_dir, ctx->device_serial, ctx->storageArea[storageid].storage->id);
+}
+
+static guint32
+index_name (GString * names, const gchar * name)
+{
+    guint32 offset = (guint32) names->len;
+
+    if (name == NULL)
+        name = "";
+    g_string_append_len(names, name, (gssize) strlen(name) + 1);
+    return offset;
+}
+
+/* Parents come before their children, so loading can link them in order */
+static void
+index_folder_tree (GArray * records, GString * names, LIBMTP_folder_t * folder)
+{
+    for (; folder != NULL; folder = folder->sibling) {
+        IndexFolder rec;
+
+        rec.id = folder->folder_id;
+        rec.parent_id = folder->parent_id;
+        rec.name = index_name(names, folder->name);
+        rec.reserved = 0;
+        g_array_append_val(records, rec);
+        index_folder_tree(records, names, folder->child);
+    }
+}
+
+static void
+save_index (MtpfsContext * ctx, int storageid)
+{
+    LIBMTP_devicestorage_t *storage = ctx->storageArea[storageid].storage;
+    GArray *folder_records = g_array_new(FALSE, FALSE, sizeof(IndexFolder));
+    GArray *file_records = g_array_new(FALSE, FALSE, sizeof(IndexFile));
+    GString *names = g_string_new(NULL);
+    GHashTableIter iter;
+    LIBMTP_file_t *file;
+    IndexHeader header;
+    gchar *path, *tmp;
+    FILE *out;
+
+    DBG_F("save_index(%d)", storageid);
+
+    index_folder_tree(folder_records, names, ctx->storageArea[storageid].folders);
+    g_hash_table_iter_init(&iter, ctx->files);
+    while (g_hash_table_iter_next(&iter, NULL, (gpointer *) &file)) {
+        IndexFile rec;
+
+        if (file->storage_id != storage->id)
+            continue;
+        rec.id = file->item_id;
+        rec.parent_id = file->parent_id;
+        rec.name = index_name(names, file->filename);
+        rec.filetype = file->filetype;
+        rec.filesize = file->filesize;
+        rec.modificationdate = file->modificationdate;
+        g_array_append_val(file_records, rec);
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+    header.free_bytes = storage->FreeSpaceInBytes;
+    header.free_objects = storage->FreeSpaceInObjects;
+    header.max_capacity = storage->MaxCapacity;
+    header.storage_id = storage->id;
+    header.nfolders = folder_records->len;
+    header.nfiles = file_records->len;
+    header.names_size = (uint32_t) names->len;
+
+    // Write aside and rename, a crash must not leave a truncated index
+    path = index_path(ctx, storageid);
+    tmp = g_strconcat(path, ".tmp", NULL);
+    out = fopen(tmp, "wb");
+    if (out != NULL) {
+        gboolean ok = fwrite(&header, sizeof(header), 1, out) == 1;
+        ok &= fwrite(folder_records->data, sizeof(IndexFolder), folder_records->len, out) == folder_records->len;
+        ok &= fwrite(file_records->data, sizeof(IndexFile), file_records->len, out) == file_records->len;
+        ok &= fwrite(names->str, 1, names->len, out) == names->len;
+        ok &= fclose(out) == 0;
+        if (!ok || rename(tmp, path) != 0) {
+            DBG("save_index: cannot write %s", path);
+            unlink(tmp);
+        }
+    }
+    g_free(tmp);
+    g_free(path);
+    g_string_free(names, TRUE);
+    g_array_free(folder_records, TRUE);
+    g_array_free(file_records, TRUE);
+}
+
+/* Rebuild the cached tree of a storage from its index, if the storage
+ * looks unchanged since it was written */
+static gboolean
+load_index (MtpfsContext * ctx, int storageid)
+{
+    LIBMTP_devicestorage_t *storage = ctx->storageArea[storageid].storage;
+    const IndexHeader *header;
+    const IndexFolder *folder_records;
+    const IndexFile *file_records;
+    const gchar *names;
+    GHashTable *by_id;
+    struct stat st;
+    gchar *path;
+    void *map;
+    uint32_t i;
+    int fd;
+
+    path = index_path(ctx, storageid);
+    fd = open(path, O_RDONLY);
+    g_free(path);
+    if (fd == -1)
+        return FALSE;
+    if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(IndexHeader)) {
+        close(fd);
+        return FALSE;
+    }
+    map = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return FALSE;
+
+    header = map;
+    folder_records = (const IndexFolder *) (header + 1);
+    file_records = (const IndexFile *) (folder_records + header->nfolders);
+    names = (const gchar *) (file_records + header->nfiles);
+    if (memcmp(header->magic, INDEX_MAGIC, sizeof(header->magic)) != 0 ||
+        header->storage_id != storage->id ||
+        (uint64_t) st.st_size != sizeof(IndexHeader) + (uint64_t) header->nfolders * sizeof(IndexFolder) +
+                                 (uint64_t) header->nfiles * sizeof(IndexFile) + header->names_size ||
+        (header->names_size > 0 && names[header->names_size - 1] != '\0')) {
+        DBG("load_index: invalid index for %d", storageid);
+        munmap(map, (size_t) st.st_size);
+        return FALSE;
+    }
+    // Anything created or deleted on the device shows in its free space
+    if (header->free_bytes != storage->FreeSpaceInBytes ||
+        header->free_objects != storage->FreeSpaceInObjects ||
+        header->max_capacity != storage->MaxCapacity) {
+        DBG("load_index: storage %d changed since last mount", storageid);
+        munmap(map, (size_t) st.st_size);
+        return FALSE;
+    }
+
+    new_folders(ctx, storageid);
+    by_id = g_hash_table_new(g_direct_hash, g_direct_equal);
+    for (i = 0; i < header->nfolders; ++i) {
+        LIBMTP_folder_t *folder, *parent;
+
+        if (folder_records[i].name >= header->names_size)
+            break;
+        folder = LIBMTP_new_folder_t();
+        folder->folder_id = folder_records[i].id;
+        folder->parent_id = folder_records[i].parent_id;
+        folder->storage_id = storage->id;
+        folder->name = g_strdup(names + folder_records[i].name);
+        if (folder->parent_id == 0) {
+            folder->sibling = ctx->storageArea[storageid].folders;
+            ctx->storageArea[storageid].folders = folder;
+        } else {
+            parent = g_hash_table_lookup(by_id, GUINT_TO_POINTER(folder->parent_id));
+            if (parent == NULL) {
+                LIBMTP_destroy_folder_t(folder);
+                break;
+            }
+            folder->sibling = parent->child;
+            parent->child = folder;
+        }
+        g_hash_table_insert(by_id, GUINT_TO_POINTER(folder->folder_id), folder);
+    }
+    g_hash_table_destroy(by_id);
+    if (i < header->nfolders) {
+        DBG("load_index: corrupted folders for %d", storageid);
+        new_folders(ctx, storageid);
+        munmap(map, (size_t) st.st_size);
+        return FALSE;
+    }
+    index_folders(ctx, storageid, ctx->storageArea[storageid].folders);
+
+    for (i = 0; i < header->nfiles; ++i) {
+        LIBMTP_file_t *file;
+
+        if (file_records[i].name >= header->names_size)
+            continue;
+        file = LIBMTP_new_file_t();
+        file->item_id = file_records[i].id;
+        file->parent_id = file_records[i].parent_id;
+        file->storage_id = storage->id;
+        file->filename = g_strdup(names + file_records[i].name);
+        file->filetype = (LIBMTP_filetype_t) file_records[i].filetype;
+        file->filesize = file_records[i].filesize;
+        file->modificationdate = (time_t) file_records[i].modificationdate;
+        index_file(ctx, file);
+    }
+    munmap(map, (size_t) st.st_size);
+    DBG("load_index: %d folders and %d files for %d", header->nfolders, header->nfiles, storageid);
+    return TRUE;
+}
+
+static void
+load_indexes (MtpfsContext * ctx)
+{
+    gboolean all = TRUE;
+    int i;
+
+    if (index_dir == NULL || ctx->device_serial == NULL)
+        return;
+    new_files(ctx);
+    for (i = 0; i < MAX_STORAGE_AREA; ++i) {
+        if (ctx->storageArea[i].storage == NULL)
+            continue;
+        if (load_index(ctx, i)) {
+            ctx->storageArea[i].folders_changed = FALSE;
+        } else {
+            all = FALSE;
+        }
+    }
+    // Files of all storages are refreshed together
+    if (all) {
+        ctx->files_changed = FALSE;
+        ctx->tree_from_index = TRUE;
+    } else {
+        new_files(ctx);
+    }
+}
+
+/* Storage information is only read at mount: fetch it again so the index
+ * records the state the device is left in */
+static void
+save_indexes (MtpfsContext * ctx)
+{
+    LIBMTP_devicestorage_t *storage;
+    int i;
+
+    if (index_dir == NULL || ctx->device_serial == NULL || tree_stale(ctx))
+        return;
+    lock_device(ctx, DEVICE_INTERACTIVE);
+    i = ctx->mtp->get_storage(ctx->device, LIBMTP_STORAGE_SORTBY_NOTSORTED);
+    if (i != 0)
+        dump_mtp_error(ctx->device);
+    unlock_device(ctx, STAT_MTP_GET_STORAGE);
+    if (i != 0)
+        return;
+    i = 0;
+    for (storage = ctx->device->storage; storage != 0 && i < MAX_STORAGE_AREA; storage = storage->next)  {
+        ctx->storageArea[i].storage = storage;
+        save_index(ctx, i);
+        i++;
+    }
+}
+
+/* Finding elements in representation */
+
+static int
+find_storage(MtpfsContext * ctx, const gchar * path)
+{
+    int i;
+    gsize storage_len;
+    gchar * second_slash;
+
+    DBG_F("find_storage(%s)", path);
+
+    // Skip initial '/'
+    if (*path != '/') {
+       DBG("find_storage: internal error: unexpected root");
+       return -1;
+    }
+    ++path;
+
+    // find storage len
+    second_slash = strstr(path, "/");
+    if (second_slash == NULL) {
+        storage_len = strlen(path);
+    } else {
+        assert(second_slash > path);
+        storage_len = (gsize)(second_slash - path);
+    }
+
+    for (i = 0; i < MAX_STORAGE_AREA; ++i) {
+        if (ctx->storageArea[i].storage != NULL) {
+            if ((storage_len == strlen(ctx->storageArea[i].storage->StorageDescription)) &&
+                (strncmp(ctx->storageArea[i].storage->StorageDescription, path, storage_len) == 0)) {
+                DBG("find_storage:%s found as %d", ctx->storageArea[i].storage->StorageDescription, i);
+                return i;
+            }
+        }
+    }
+    DBG("find_storage: %s not found", path - 1);
+    return -1;
+}
+
+/* Lazy mode: whether looking path up only walks directories listed
+ * already, and path itself too for listing it */
+static gboolean
+path_listed (MtpfsContext * ctx, const gchar * path, gboolean listing)
+{
+    LIBMTP_folder_t *folder;
+    uint32_t storage_id, parent_id = 0;
+    gchar **fields;
+    gboolean ret = TRUE;
+    int storageid, i;
+
+    storageid = find_storage(ctx, path);
+    if (storageid < 0)
+        return TRUE;
+    storage_id = ctx->storageArea[storageid].storage->id;
+    // The first field is the storage
+    fields = g_strsplit(path + 1, "/", -1);
+    for (i = 1; fields[i] != NULL; ++i) {
+        if (fields[i][0] == '\0')
+            continue;
+        if (!is_populated(ctx, storage_id, parent_id)) {
+            ret = FALSE;
+            break;
+        }
+        folder = name_index_lookup(folder_children(ctx, storageid, parent_id, FALSE), fields[i]);
+        if (folder == NULL) {
+            // A file, or nothing, the listed parent tells
+            listing = FALSE;
+            break;
+        }
+        parent_id = folder->folder_id;
+    }
+    if (ret && listing)
+        ret = is_populated(ctx, storage_id, parent_id);
+    g_strfreev(fields);
+    return ret;
+}
+
+/* Lock the tree to look path up, or list it.  Lazy mode shares the tree
+ * too when no directory needs listing on the way. */
+static void
+lock_tree_path (MtpfsContext * ctx, const gchar * path, gboolean listing)
+{
+    if (!lazy) {
+        lock_tree(ctx);
+        return;
+    }
+    if (share_tree(ctx)) {
+        if (path_listed(ctx, path, listing))
+            return;
+        g_rw_lock_reader_unlock(&ctx->tree_lock);
+    }
+    lock_tree_write(ctx);
+}
+
+/* Same for a name in a folder known by its id */
+static void
+lock_tree_folder (MtpfsContext * ctx, int storageid, uint32_t parent_id)
+{
+    if (!lazy) {
+        lock_tree(ctx);
+        return;
+    }
+    if (share_tree(ctx)) {
+        if (is_populated(ctx, ctx->storageArea[storageid].storage->id, parent_id))
+            return;
+        g_rw_lock_reader_unlock(&ctx->tree_lock);
+    }
+    lock_tree_write(ctx);
+}
+
+static LIBMTP_folder_t *
+find_folder (MtpfsContext * ctx, int storageid, uint32_t parent_id, const gchar * name)
+{
+    check_folders(ctx);
+    populate_dir(ctx, storageid, parent_id);
+    return name_index_lookup(folder_children(ctx, storageid, parent_id, FALSE), name);
+}
+
+static LIBMTP_file_t *
+find_file (MtpfsContext * ctx, int storageid, uint32_t parent_id, const gchar * name)
+{
+    check_files(ctx);
+    populate_dir(ctx, storageid, parent_id);
+    return name_index_lookup(file_children(ctx, ctx->storageArea[storageid].storage->id, parent_id, FALSE), name);
+}
+
+static uint32_t
+lookup_folder_id (MtpfsContext * ctx, int storageid, const gchar * path)
+{
+    const gchar *name;
+    uint32_t ret = 0;
+    gpointer cached;
+    gboolean found;
+
+    DBG_F("lookup_folder_id(%d, %s)", storageid, path);
+
+    if (storageid < 0) {
+        DBG_F("lookup_folder_id: Unknown storage");
+        return 0xFFFFFFFF;
+    }
+    if (path[0] != '/') {
+        DBG("lookup_folder_id: Internal error: unexpected root")
+        return 0xFFFFFFFF;
+    }
+
+    // Refreshing the folders forgets resolved paths
+    check_folders(ctx);
+    G_LOCK(resolved_lock);
+    found = g_hash_table_lookup_extended(ctx->resolved, path, NULL, &cached);
+    G_UNLOCK(resolved_lock);
+    if (found)
+        return GPOINTER_TO_UINT(cached);
+
+    // One component at a time, the parent is usually resolved already
+    name = strrchr(path, '/');
+    if (name != path) {
+        gchar *parent = g_strndup(path, (gsize) (name - path));
+
+        ret = lookup_folder_id(ctx, storageid, parent);
+        g_free(parent);
+        // Empty components, as in trailing slashes, are skipped
+        if (ret != 0xFFFFFFFF && name[1] != '\0') {
+            LIBMTP_folder_t *folder = find_folder(ctx, storageid, ret, name + 1);
+            ret = folder != NULL ? folder->folder_id : 0xFFFFFFFF;
+        }
+        if (ret == 0xFFFFFFFF) {
+            DBG("lookup_folder_id %s: not found", path);
+            return ret;
+        }
+    }
+
+    DBG("lookup_folder_id %s: found %i", path, ret);
+    G_LOCK(resolved_lock);
+    g_hash_table_replace(ctx->resolved, g_strdup(path), GUINT_TO_POINTER(ret));
+    G_UNLOCK(resolved_lock);
+    return ret;
+}
+
+static uint32_t
+parse_path (MtpfsContext * ctx, const gchar * path)
+{
+    uint32_t res;
+
+    DBG_F("parse_path(%s)", path);
+
+    // Check lost+found
+    if (strncmp("/lost+found", path, 11) == 0) {
+        GSList *item;
+        gchar *filename  = g_path_get_basename (path);
+
+        res = 0xFFFFFFFF;
+        for (item = ctx->lostfiles; item != NULL; item = g_slist_next (item) ) {
+            LIBMTP_file_t *file = (LIBMTP_file_t *) item->data;
+
+            if (strcmp( file->filename, filename) == 0) {
+                res = file->item_id;
+                break;
+            }
+        }
+        g_free (filename);
+        return res;
+    }
+
+    // Check device
+    int storageid = find_storage(ctx, path);
+    if (storageid < 0) {
+        res = 0xFFFFFFFF;
+        goto end;
+    }
+    if (g_strrstr(path + 1, "/") == NULL) {
+        DBG("parse_path: Storage dir");
+        res = 0;
+        goto end;
+    }
+
+    gchar *directory = g_path_get_dirname(path);
+    gchar *filename = g_path_get_basename(path);
+    uint32_t folder_id = lookup_folder_id(ctx, storageid, directory);
+    DBG("parent id:%d:%s", folder_id, directory);
+    res = 0xFFFFFFFF;
+    if (folder_id != 0xFFFFFFFF) {
+        LIBMTP_file_t *file = find_file(ctx, storageid, folder_id, filename);
+        if (file != NULL) {
+            DBG("found:%d:%s", file->item_id, file->filename);
+            res = file->item_id;
+        } else {
+            LIBMTP_folder_t *folder = find_folder(ctx, storageid, folder_id, filename);
+            if (folder != NULL)
+                res = folder->folder_id;
+        }
+    }
+    g_free (filename);
+    g_free (directory);
+end:
+    DBG("parse_path exiting:%s - %d",path,res);
+    return res;
+}
+
+/* Find the file type based on extension */
+static LIBMTP_filetype_t
+find_filetype (const gchar * filename)
+{
+    DBG("find_filetype");
+    gchar **fields;
+    fields = g_strsplit (filename, ".", -1);
+    gchar *ptype;
+    ptype = g_strdup (fields[g_strv_length (fields) - 1]);
+    g_strfreev (fields);
+    LIBMTP_filetype_t filetype;
+
+    // This need to be kept constantly updated as new file types arrive.
+    if (!g_ascii_strncasecmp (ptype, "wav",3)) {
+        filetype = LIBMTP_FILETYPE_WAV;
+    } else if (!g_ascii_strncasecmp (ptype, "mp3",3)) {
+        filetype = LIBMTP_FILETYPE_MP3;
+    } else if (!g_ascii_strncasecmp (ptype, "wma",3)) {
+        filetype = LIBMTP_FILETYPE_WMA;
+    } else if (!g_ascii_strncasecmp (ptype, "ogg",3)) {
+        filetype = LIBMTP_FILETYPE_OGG;
+    } else if (!g_ascii_strncasecmp (ptype, "aa",2)) {
         filetype = LIBMTP_FILETYPE_AUDIBLE;
     } else if (!g_ascii_strncasecmp (ptype, "mp4",3)) {
         filetype = LIBMTP_FILETYPE_MP4;
@@ -455,741 +2304,4170 @@ find_filetype (const gchar * filename)
     } else if (!g_ascii_strncasecmp (ptype, "jpx",3)) {
         filetype = LIBMTP_FILETYPE_JPX;
     } else {
-        DBG("Sorry, file type \"%s\" is not yet supported", ptype);
-        DBG("Tagging as unknown file type.");
-        filetype = LIBMTP_FILETYPE_UNKNOWN;
+        DBG("Sorry, file type \"%s\" is not yet supported", ptype);
+        DBG("Tagging as unknown file type.");
+        filetype = LIBMTP_FILETYPE_UNKNOWN;
+    }
+    g_free (ptype);
+    return filetype;
+}
+
+/* Staging files, used for uploads and when ranges cannot be read from the
+ * device.  Small ones live in memory, and all of them share a budget: new
+ * downloads wait for others to be released rather than filling RAM or /tmp. */
+
+static void
+staging_return (uint64_t size)
+{
+    g_mutex_lock(&staging_lock);
+    staging_used -= size;
+    g_cond_broadcast(&staging_cond);
+    g_mutex_unlock(&staging_lock);
+}
+
+static void
+staging_release (FileHandle * fh)
+{
+    staging_return(fh->staged);
+    fh->staged = 0;
+}
+
+/* Drop a reference to a shared copy, see attach_stage */
+static void
+detach_stage (SharedStage * stage)
+{
+    g_mutex_lock(&shared_lock);
+    if (--stage->refs > 0) {
+        g_mutex_unlock(&shared_lock);
+        return;
+    }
+    if (g_hash_table_lookup(stage->ctx->shared_stages, GUINT_TO_POINTER(stage->item_id)) == stage)
+        g_hash_table_remove(stage->ctx->shared_stages, GUINT_TO_POINTER(stage->item_id));
+    g_mutex_unlock(&shared_lock);
+
+    if (stage->fd != -1)
+        close(stage->fd);
+    staging_return(stage->staged);
+    g_free(stage);
+}
+
+/* Account for data written to a staging file, never waits */
+static void
+staging_grow (FileHandle * fh, uint64_t size)
+{
+    if (size <= fh->staged)
+        return;
+    g_mutex_lock(&staging_lock);
+    staging_used += size - fh->staged;
+    g_mutex_unlock(&staging_lock);
+    fh->staged = size;
+}
+
+static int
+new_staging_file (FileHandle * fh, uint64_t size)
+{
+    FILE *filetmp;
+    int fd = -1;
+
+    if (size > 0) {
+        gint64 deadline = g_get_monotonic_time() + STAGING_WAIT * G_TIME_SPAN_SECOND;
+
+        gint64 start = g_get_monotonic_time();
+
+        g_mutex_lock(&staging_lock);
+        // Alone, or after waiting long enough, a file may exceed the budget
+        while (staging_used > 0 && staging_used + size > staging_budget) {
+            if (!g_cond_wait_until(&staging_cond, &staging_lock, deadline)) {
+                DBG("new_staging_file: budget still exhausted, going over it");
+                break;
+            }
+        }
+        staging_used += size;
+        g_mutex_unlock(&staging_lock);
+        stats_time(STAT_WAIT_STAGING, start);
+        fh->staged = size;
+    }
+
+#ifdef HAVE_MEMFD_CREATE
+    if (size > 0 && size <= STAGING_MEMORY_MAX)
+        fd = memfd_create("mtpfs", MFD_CLOEXEC);
+#endif
+    if (fd == -1 && (filetmp = tmpfile ()) != NULL) {
+        fd = dup(fileno(filetmp));
+        fclose(filetmp);
+    }
+    fh->fd = fd;
+    if (fd == -1) {
+        staging_release(fh);
+        return -1;
+    }
+    return 0;
+}
+
+/* Describe a new file for its upload, NULL if its storage or its folder is
+ * unknown */
+static LIBMTP_file_t *
+new_upload_file (MtpfsContext * ctx, const char *path, uint64_t filesize)
+{
+    //find parent id
+    gchar *filename = g_strdup("");
+    gchar **fields;
+    gchar *directory;
+    directory = (gchar *) g_malloc (strlen (path));
+    directory = strcpy (directory, "/");
+    fields = g_strsplit (path, "/", -1);
+    int i;
+    uint32_t parent_id = 0;
+    int storageid;
+    storageid = find_storage(ctx, path);
+    if (storageid < 0) {
+        g_strfreev (fields);
+        g_free (filename);
+        g_free (directory);
+        return NULL;
+    }
+    for (i = 0; fields[i] != NULL; i++) {
+        if (strlen (fields[i]) > 0) {
+            if (fields[i + 1] == NULL) {
+                gchar *tmp = g_strndup (directory, strlen (directory) - 1);
+                parent_id = lookup_folder_id (ctx, storageid, tmp);
+                g_free (tmp);
+                // The folder went away meanwhile, the root is not it
+                if (parent_id == 0xFFFFFFFF) {
+                    g_strfreev (fields);
+                    g_free (filename);
+                    g_free (directory);
+                    return NULL;
+                }
+                g_free (filename);
+                filename = g_strdup (fields[i]);
+            } else {
+                directory = strcat (directory, fields[i]);
+                directory = strcat (directory, "/");
+            }
+        }
+    }
+    DBG("%s:%s:%d", filename, directory, parent_id);
+
+    // Setup file
+    LIBMTP_filetype_t filetype;
+    filetype = find_filetype (filename);
+    LIBMTP_file_t *genfile;
+    genfile = LIBMTP_new_file_t ();
+    genfile->filesize = filesize;
+    genfile->filetype = filetype;
+    genfile->filename = g_strdup (filename);
+    genfile->parent_id = (uint32_t) parent_id;
+    genfile->storage_id = ctx->storageArea[storageid].storage->id;
+    genfile->modificationdate = time(NULL);
+
+    // Cleanup
+    g_strfreev (fields);
+    g_free (filename);
+    g_free (directory);
+    return genfile;
+}
+
+/* The size of a new file is set, the device gets it on release.  A
+ * streamed file loses the bytes sent past it right away, so that growing
+ * it again reads zeros there. */
+static int
+declare_size (MtpfsContext * ctx, FileHandle * fh, const char *path, uint64_t size)
+{
+    int ret;
+
+    if (ftruncate(fh->fd, (off_t) size) != 0)
+        return -errno;
+    if (!fh->streaming) {
+        staging_grow(fh, size);
+        return 0;
+    }
+    fh->filesize = size;
+    if (size < fh->sent + fh->chunk_len)
+        fh->chunk_len = size > fh->sent ? (uint32_t) (size - fh->sent) : 0;
+    if (fh->streamed == NULL || size >= fh->sent || fh->stream_error != 0)
+        return 0;
+    lock_device(ctx, DEVICE_BULK);
+    ret = ctx->mtp->truncate_object(ctx->device, fh->streamed->item_id, size);
+    if (ret != 0)
+        dump_mtp_error(ctx->device);
+    unlock_device(ctx, STAT_MTP_EDIT_OBJECT);
+    if (ret != 0) {
+        fh->stream_error = -EIO;
+        return -EIO;
+    }
+    fh->sent = size;
+    return 0;
+}
+
+static void
+free_handle (FileHandle * fh)
+{
+    cancel_readahead(fh);
+    if (fh->fd != -1)
+        close(fh->fd);
+    if (fh->staged > 0)
+        staging_release(fh);
+    if (fh->shared != NULL)
+        detach_stage(fh->shared);
+    if (fh->dirty != NULL)
+        g_array_free(fh->dirty, TRUE);
+    if (fh->streamed != NULL)
+        LIBMTP_destroy_file_t(fh->streamed);
+    g_free(fh->chunk);
+    g_mutex_clear(&fh->lock);
+    g_free(fh);
+}
+
+/* Android edit extensions: create the file empty, then send its content
+ * a chunk at a time so that other requests reach the device meanwhile */
+static int
+send_chunked (MtpfsContext * ctx, int fd, LIBMTP_file_t * genfile)
+{
+    uint64_t size = genfile->filesize;
+    unsigned char *data;
+    uint64_t offset;
+    gboolean editing;
+    ssize_t len = 0;
+    int ret;
+
+    genfile->filesize = 0;
+    lock_device(ctx, DEVICE_BULK);
+    ret = ctx->mtp->send_file_from_file_descriptor(ctx->device, fd, genfile, NULL, NULL);
+    if (ret != 0)
+        dump_mtp_error(ctx->device);
+    unlock_device(ctx, STAT_MTP_SEND_FILE);
+    genfile->filesize = size;
+    if (ret != 0)
+        return ret;
+
+    lock_device(ctx, DEVICE_BULK);
+    ret = ctx->mtp->begin_edit_object(ctx->device, genfile->item_id);
+    if (ret != 0)
+        dump_mtp_error(ctx->device);
+    unlock_device(ctx, STAT_MTP_EDIT_OBJECT);
+    editing = ret == 0;
+
+    data = g_malloc(STAGE_CHUNK_SIZE);
+    for (offset = 0; ret == 0 && offset < size; offset += (uint64_t) len) {
+        len = pread(fd, data, (size_t) MIN((uint64_t) STAGE_CHUNK_SIZE, size - offset), (off_t) offset);
+        if (len <= 0) {
+            ret = -1;
+            break;
+        }
+        lock_device(ctx, DEVICE_BULK);
+        ret = ctx->mtp->send_partial_object(ctx->device, genfile->item_id, offset, data, (unsigned int) len);
+        if (ret != 0)
+            dump_mtp_error(ctx->device);
+        unlock_device(ctx, STAT_MTP_SEND_PARTIAL);
+        if (ret == 0)
+            stats_add(STAT_BYTES_UPLOADED, (guint64) len);
+    }
+    g_free(data);
+
+    lock_device(ctx, DEVICE_BULK);
+    if (editing && ctx->mtp->end_edit_object(ctx->device, genfile->item_id) != 0) {
+        dump_mtp_error(ctx->device);
+        ret = -1;
+    }
+    // Leave no truncated file behind
+    if (ret != 0 && ctx->mtp->delete_object(ctx->device, genfile->item_id) != 0)
+        dump_mtp_error(ctx->device);
+    unlock_device(ctx, STAT_MTP_EDIT_OBJECT);
+    return ret;
+}
+
+/* Upload the staged content of a new file, the tree must not be locked */
+static int
+send_staged (MtpfsContext * ctx, const char *path, int fd, LIBMTP_file_t ** genfile)
+{
+    struct stat st;
+    int ret;
+
+    lock_tree(ctx);
+    fstat(fd, &st);
+    assert(st.st_size >= 0);
+    *genfile = new_upload_file(ctx, path, (uint64_t) st.st_size);
+    unlock_tree(ctx);
+    if (*genfile == NULL)
+        return -ENOENT;
+
+    if (ctx->edit_objects && (*genfile)->filesize > STAGE_CHUNK_SIZE) {
+        ret = send_chunked(ctx, fd, *genfile);
+        DBG("Sent %s in chunks - %d", path, ret);
+        return ret;
+    }
+    // A single SendObject, nothing else reaches the device until it ends
+    lock_device(ctx, DEVICE_BULK);
+    ret = ctx->mtp->send_file_from_file_descriptor (ctx->device, fd, *genfile, NULL, NULL);
+    if (ret != 0)
+        dump_mtp_error(ctx->device);
+    unlock_device(ctx, STAT_MTP_SEND_FILE);
+    if (ret == 0)
+        stats_add(STAT_BYTES_UPLOADED, (*genfile)->filesize);
+    DBG("Sent %s - %d",path,ret);
+    return ret;
+}
+
+/* Record the outcome of the upload of a new file in the tree */
+static void
+end_new_file (MtpfsContext * ctx, const char *path, LIBMTP_file_t * genfile, int ret,
+              gboolean mine)
+{
+    lock_tree_write(ctx);
+    if (genfile != NULL && ret == 0) {
+        // A streamed file may have been listed while written
+        if (g_hash_table_contains(ctx->files, GUINT_TO_POINTER(genfile->item_id)))
+            cache_remove_file(ctx, genfile->item_id);
+        // Devices may reuse the id of a deleted object
+        block_cache_invalidate(ctx, genfile->item_id);
+        // Patch filelist, genfile now belongs to the cache
+        cache_add_file(ctx, genfile);
+    } else if (genfile != NULL) {
+        LIBMTP_destroy_file_t (genfile);
+        ctx->files_changed = TRUE;
+    }
+    if (mine) {
+        G_LOCK(myfiles_lock);
+        g_hash_table_remove(ctx->myfiles, path);
+        G_UNLOCK(myfiles_lock);
+    }
+    unlock_tree(ctx);
+}
+
+/* Write-back: wait for the queue to have room for another file.  The
+ * tree must not be locked, the uploads need it; releases running at the
+ * same time may still go a few files over. */
+static void
+wait_queue_room (MtpfsContext * ctx)
+{
+    gint64 start = 0;
+
+    g_mutex_lock(&ctx->writeback_lock);
+    while (g_queue_get_length(&ctx->writeback) >= WRITEBACK_MAX_FILES) {
+        if (start == 0)
+            start = g_get_monotonic_time();
+        g_cond_wait(&ctx->writeback_cond, &ctx->writeback_lock);
+    }
+    g_mutex_unlock(&ctx->writeback_lock);
+    if (start != 0)
+        stats_time(STAT_WAIT_WRITEBACK, start);
+}
+
+/* Failed uploads are kept until reported, or for WRITEBACK_FAILED_KEEP
+ * seconds when nothing asks for them */
+static void
+forget_failed (MtpfsContext * ctx, guint now)
+{
+    GHashTableIter iter;
+    gpointer failed_at;
+
+    g_hash_table_iter_init(&iter, ctx->failed);
+    while (g_hash_table_iter_next(&iter, NULL, &failed_at)) {
+        if (now - GPOINTER_TO_UINT(failed_at) > WRITEBACK_FAILED_KEEP)
+            g_hash_table_iter_remove(&iter);
+    }
+}
+
+/* Write-back: hand the staged content of a new file over to the upload
+ * thread.  The path moves from myfiles to pending under the tree lock, so
+ * that getattr sees it all along. */
+static void
+queue_upload (MtpfsContext * ctx, const char *path, FileHandle * fh)
+{
+    PendingUpload *pending = g_new0(PendingUpload, 1);
+    struct stat st;
+
+    fstat(fh->fd, &st);
+    assert(st.st_size >= 0);
+    pending->path = g_strdup(path);
+    pending->fd = fh->fd;
+    pending->staged = fh->staged;
+    pending->size = (uint64_t) st.st_size;
+    pending->mtime = st.st_mtime;
+    fh->fd = -1;
+    fh->staged = 0;
+
+    g_mutex_lock(&ctx->writeback_lock);
+    g_hash_table_remove(ctx->failed, path);
+    g_hash_table_insert(ctx->pending, pending->path, pending);
+    g_queue_push_tail(&ctx->writeback, pending);
+    g_cond_broadcast(&ctx->writeback_cond);
+    g_mutex_unlock(&ctx->writeback_lock);
+    G_LOCK(myfiles_lock);
+    g_hash_table_remove(ctx->myfiles, path);
+    G_UNLOCK(myfiles_lock);
+    stats_add(STAT_UPLOADS_QUEUED, 1);
+    DBG("Queued %s", path);
+}
+
+static gpointer
+writeback_worker (gpointer data)
+{
+    MtpfsContext *ctx = data;
+    PendingUpload *pending;
+    LIBMTP_file_t *genfile;
+    int ret;
+
+    for (;;) {
+        g_mutex_lock(&ctx->writeback_lock);
+        while (g_queue_is_empty(&ctx->writeback) && !ctx->writeback_stopping)
+            g_cond_wait(&ctx->writeback_cond, &ctx->writeback_lock);
+        pending = g_queue_peek_head(&ctx->writeback);
+        g_mutex_unlock(&ctx->writeback_lock);
+        if (pending == NULL)
+            break;
+
+        ret = send_staged(ctx, pending->path, pending->fd, &genfile);
+        end_new_file(ctx, pending->path, genfile, ret, FALSE);
+
+        g_mutex_lock(&ctx->writeback_lock);
+        g_queue_pop_head(&ctx->writeback);
+        g_hash_table_remove(ctx->pending, pending->path);
+        if (ret != 0) {
+            guint now = (guint) (g_get_monotonic_time() / G_TIME_SPAN_SECOND);
+
+            forget_failed(ctx, now);
+            g_hash_table_replace(ctx->failed, g_strdup(pending->path), GUINT_TO_POINTER(now));
+        }
+        g_cond_broadcast(&ctx->writeback_cond);
+        g_mutex_unlock(&ctx->writeback_lock);
+        // The file was already closed, nothing else would tell it is gone
+        if (ret != 0) {
+            syslog(LOG_ERR, "Upload of %s failed, its content is lost", pending->path);
+            stats_add(STAT_UPLOADS_FAILED, 1);
+        }
+
+        close(pending->fd);
+        staging_return(pending->staged);
+        g_free(pending->path);
+        g_free(pending);
+    }
+    return NULL;
+}
+
+static void
+destroy_context (MtpfsContext * ctx)
+{
+    DBG("destroy_context(%s)", ctx->name != NULL ? ctx->name : "/");
+
+    if (ctx->revalidate_thread != NULL) {
+        g_thread_join(ctx->revalidate_thread);
+        ctx->revalidate_thread = NULL;
+    }
+    if (ctx->readahead_thread != NULL) {
+        ReadaheadRequest *req;
+
+        // The queued requests are dropped, the worker stops next
+        g_async_queue_lock(ctx->readahead_queue);
+        while ((req = g_async_queue_try_pop_unlocked(ctx->readahead_queue)) != NULL)
+            g_free(req);
+        g_async_queue_push_unlocked(ctx->readahead_queue, &readahead_stop);
+        g_async_queue_unlock(ctx->readahead_queue);
+        g_thread_join(ctx->readahead_thread);
+        ctx->readahead_thread = NULL;
+        g_async_queue_unref(ctx->readahead_queue);
+        ctx->readahead_queue = NULL;
+    }
+    // Unmounting waits for the queued uploads
+    if (ctx->writeback_thread != NULL) {
+        g_mutex_lock(&ctx->writeback_lock);
+        ctx->writeback_stopping = TRUE;
+        g_cond_broadcast(&ctx->writeback_cond);
+        g_mutex_unlock(&ctx->writeback_lock);
+        g_thread_join(ctx->writeback_thread);
+        ctx->writeback_thread = NULL;
+    }
+
+    lock_tree_write(ctx);
+
+    save_indexes(ctx);
+    free_files(ctx);
+    int i;
+    for (i = 0; i < MAX_STORAGE_AREA; ++i) {
+        if (ctx->storageArea[i].folder_index) g_hash_table_destroy(ctx->storageArea[i].folder_index);
+        if (ctx->storageArea[i].folders_by_id) g_hash_table_destroy(ctx->storageArea[i].folders_by_id);
+        if (ctx->storageArea[i].folders) LIBMTP_destroy_folder_t(ctx->storageArea[i].folders);
+    }
+    lock_device(ctx, DEVICE_INTERACTIVE);
+    if (ctx->device) ctx->mtp->release_device (ctx->device);
+    unlock_device(ctx, STAT_MTP_RELEASE_DEVICE);
+    return_unlock();
+}
+
+static void
+mtpfs_destroy (void *data)
+{
+    MtpfsContext *ctx;
+
+    DBG("mtpfs_destroy()");
+
+    g_atomic_int_set(&readahead_stopping, TRUE);
+    for (ctx = data; ctx != NULL; ctx = ctx->next) {
+        destroy_context(ctx);
+    }
+    DBG("Block cache: %" G_GUINT64_FORMAT " hits, %" G_GUINT64_FORMAT " misses, %" G_GUINT64_FORMAT " evictions",
+        block_cache.hits, block_cache.misses, block_cache.evictions);
+    G_LOCK(cache_lock);
+    g_hash_table_destroy(block_cache.blocks);
+    G_UNLOCK(cache_lock);
+}
+
+/* Attributes shared by getattr and readdir, so a listing carries
+ * everything a following stat would ask for.  The kernel keeps them for
+ * every caller, entries belong to the user who mounted the device. */
+static void
+new_stat (struct stat *st)
+{
+    memset (st, 0, sizeof (struct stat));
+    st->st_uid = owner_uid;
+    st->st_gid = owner_gid;
+}
+
+static void
+dir_stat (ino_t inode, struct stat *st)
+{
+    new_stat (st);
+    st->st_ino = inode;
+    st->st_mode = S_IFDIR | 0777;
+    st->st_nlink = 2;
+}
+
+static void
+file_stat (LIBMTP_file_t * file, struct stat *st)
+{
+    new_stat (st);
+    st->st_ino = OBJECT_INODE(file->item_id);
+    assert(file->filesize <= INT64_MAX);
+    st->st_size = (int64_t) file->filesize;
+    st->st_blocks = (file->filesize / 512) +
+        (file->filesize % 512 > 0 ? 1 : 0);
+    st->st_nlink = 1;
+    st->st_mode = S_IFREG | 0777;
+    st->st_mtime = file->modificationdate;
+    st->st_ctime = file->modificationdate;
+    st->st_atime = file->modificationdate;
+}
+
+/* Object ids are only unique on a device, as are the inodes made of them */
+static ino_t
+device_inode (MtpfsContext * ctx, ino_t inode)
+{
+    if (ctx->name == NULL)
+        return inode;
+    if (inode == ROOT_INODE)
+        return DEVICE_DIR_INODE(ctx->index);
+    return DEVICE_INODE(ctx->index, inode);
+}
+
+static void
+stats_stat (struct stat *st)
+{
+    // Its size is only known once opened, read it with direct_io
+    new_stat (st);
+    st->st_ino = STATS_FILE_INODE;
+    st->st_mode = S_IFREG | 0444;
+    st->st_mtime = time(NULL);
+}
+
+/* Write-back: files queued for upload are shown with their content */
+static void
+pending_stat (PendingUpload * pending, struct stat *st)
+{
+    new_stat (st);
+    st->st_ino = NEW_FILE_INODE(g_str_hash(pending->path));
+    assert(pending->size <= INT64_MAX);
+    st->st_size = (int64_t) pending->size;
+    st->st_blocks = (pending->size / 512) + (pending->size % 512 > 0 ? 1 : 0);
+    st->st_nlink = 1;
+    st->st_mode = S_IFREG | 0777;
+    st->st_mtime = pending->mtime;
+    st->st_ctime = pending->mtime;
+    st->st_atime = pending->mtime;
+}
+
+static gboolean
+find_pending (MtpfsContext * ctx, const gchar * path, struct stat *st)
+{
+    PendingUpload *pending;
+
+    if (ctx->pending == NULL)
+        return FALSE;
+    g_mutex_lock(&ctx->writeback_lock);
+    pending = g_hash_table_lookup(ctx->pending, path);
+    if (pending != NULL)
+        pending_stat(pending, st);
+    g_mutex_unlock(&ctx->writeback_lock);
+    return pending != NULL;
+}
+
+/* List the queued files of a directory, unless already on the device */
+static void
+list_pending (MtpfsContext * ctx, const gchar * path, GHashTable * files,
+              void *buf, DirFiller filler)
+{
+    GHashTableIter iter;
+    PendingUpload *pending;
+    gsize len = strlen(path);
+    struct stat st;
+
+    if (ctx->pending == NULL)
+        return;
+    g_mutex_lock(&ctx->writeback_lock);
+    g_hash_table_iter_init(&iter, ctx->pending);
+    while (g_hash_table_iter_next(&iter, NULL, (gpointer *) &pending)) {
+        const gchar *name = strrchr(pending->path, '/');
+
+        if ((gsize) (name - pending->path) != len || strncmp(pending->path, path, len) != 0 ||
+            name_index_lookup(files, name + 1) != NULL)
+            continue;
+        pending_stat(pending, &st);
+        if (filler (buf, name + 1, &st, 0))
+            break;
+    }
+    g_mutex_unlock(&ctx->writeback_lock);
+}
+
+/* Whether a queued file is path itself, or in the directory path, or
+ * anywhere below it if below is set */
+static gboolean
+pending_affects (const gchar * file, const gchar * path, gboolean below)
+{
+    const gchar *name = strrchr(file, '/');
+    gsize len = strlen(path);
+
+    if (strcmp(file, path) == 0)
+        return TRUE;
+    if (strcmp(path, "/") == 0)
+        return below || name == file;
+    if (strncmp(file, path, len) != 0 || file[len] != '/')
+        return FALSE;
+    return below || (gsize) (name - file) == len;
+}
+
+static gboolean
+any_affected (GHashTable * table, const gchar * path, gboolean below, gboolean forget)
+{
+    GHashTableIter iter;
+    const gchar *file;
+    gboolean found = FALSE;
+
+    g_hash_table_iter_init(&iter, table);
+    while (g_hash_table_iter_next(&iter, (gpointer *) &file, NULL)) {
+        if (pending_affects(file, path, below)) {
+            found = TRUE;
+            if (!forget)
+                break;
+            g_hash_table_iter_remove(&iter);
+        }
+    }
+    return found;
+}
+
+static int
+wait_uploads (MtpfsContext * ctx, const gchar * path, gboolean below, gboolean report)
+{
+    gint64 start = 0;
+    int ret = 0;
+
+    if (ctx->pending == NULL)
+        return 0;
+    g_mutex_lock(&ctx->writeback_lock);
+    while (any_affected(ctx->pending, path, below, FALSE)) {
+        if (start == 0)
+            start = g_get_monotonic_time();
+        g_cond_wait(&ctx->writeback_cond, &ctx->writeback_lock);
+    }
+    if (any_affected(ctx->failed, path, below, report))
+        ret = -EIO;
+    g_mutex_unlock(&ctx->writeback_lock);
+    if (start != 0)
+        stats_time(STAT_WAIT_WRITEBACK, start);
+    return ret;
+}
+
+/* Wait for the uploads of path or of the files of the directory path.
+ * Returns -EIO if one of them failed, the failure is then forgotten when
+ * report is set.  Never called with the tree locked, the uploads need it. */
+static int
+wait_pending (MtpfsContext * ctx, const gchar * path, gboolean report)
+{
+    return wait_uploads(ctx, path, FALSE, report);
+}
+
+/* Wait for the uploads of path and of all the files below it, before it
+ * is renamed or removed: they are uploaded to the path they were closed at */
+static void
+wait_pending_below (MtpfsContext * ctx, const gchar * path)
+{
+    wait_uploads(ctx, path, TRUE, FALSE);
+}
+
+/* Entries are given the attributes getattr would return, but readdir only
+ * passes their inode and type on to the kernel: ls -l still looks each of
+ * them up, in a folder found by id (see ll_lookup).  Built against FUSE 3,
+ * ll_readdirplus hands them over with the listing instead. */
+static int
+mtpfs_readdir (MtpfsContext * ctx, const gchar * path, void *buf, DirFiller filler,
+               off_t offset, struct fuse_file_info *fi)
+{
+    struct stat st;
+
+    DBG("mtpfs_readdir(%s, %p, %p, %lli, %p)", path, buf, filler, offset, fi);
+    lock_tree_path(ctx, path, TRUE);
+
+    // Add common entries
+    filler (buf, ".", NULL, 0);
+    filler (buf, "..", NULL, 0);
+
+    // The root does not list it, so scanners and backups do not read it
+    if (strcmp(path, STATS_DIR) == 0) {
+        stats_stat (&st);
+        filler (buf, STATS_FILE + strlen(STATS_DIR) + 1, &st, 0);
+        return_unlock(0);
+    }
+
+    // If in root directory
+    if (strcmp(path,"/") == 0) {
+        if (ctx->lostfiles != NULL) {
+            dir_stat (LOST_FOUND_INODE, &st);
+            filler (buf, "lost+found", &st, 0);
+        }
+        LIBMTP_devicestorage_t *storage;
+        for (storage = ctx->device->storage; storage != 0; storage = storage->next) {
+            dir_stat (STORAGE_INODE(storage->id), &st);
+            filler (buf, storage->StorageDescription, &st, 0);
+        }
+        return_unlock(0);
+    }
+
+    // Are we looking at lost+found dir?
+    if (strncmp (path, "/lost+found",11) == 0) {
+        check_files (ctx);
+        GSList *item;
+
+        for (item = ctx->lostfiles; item != NULL; item = g_slist_next (item) ) {
+            LIBMTP_file_t *file = (LIBMTP_file_t *) item->data;
+
+            file_stat (file, &st);
+            if (filler (buf, file->filename, &st, 0))
+                break;
+        }
+        return_unlock(0);
+    }
+
+    // Get storage area
+    int storageid = -1;
+    storageid=find_storage(ctx, path);
+    if (storageid < 0)
+        return_unlock(-ENOENT);
+    // Get folder listing.
+    uint32_t folder_id = lookup_folder_id (ctx, storageid, path);
+    if (folder_id == 0xFFFFFFFF)
+        return_unlock(-ENOENT);
+
+    DBG("Checking folders for %d on %d", folder_id, storageid);
+    GHashTableIter iter;
+    GHashTable *children;
+    check_folders(ctx);
+    populate_dir(ctx, storageid, folder_id);
+    children = folder_children(ctx, storageid, folder_id, FALSE);
+    if (children != NULL) {
+        NameEntry *entry;
+
+        g_hash_table_iter_init(&iter, children);
+        while (g_hash_table_iter_next(&iter, NULL, (gpointer *) &entry)) {
+            for (; entry != NULL; entry = entry->next) {
+                LIBMTP_folder_t *folder = entry->object;
+
+                DBG("found folder: %s, id %d", folder->name, folder->folder_id);
+                dir_stat (OBJECT_INODE(folder->folder_id), &st);
+                if (filler (buf, entry->name, &st, 0))
+                    return_unlock(0);
+            }
+        }
+    }
+    DBG("Checking folders end");
+    DBG("Checking files");
+    // Find files
+    check_files(ctx);
+    children = file_children(ctx, ctx->storageArea[storageid].storage->id, folder_id, FALSE);
+    if (children != NULL) {
+        NameEntry *entry;
+
+        g_hash_table_iter_init(&iter, children);
+        while (g_hash_table_iter_next(&iter, NULL, (gpointer *) &entry)) {
+            for (; entry != NULL; entry = entry->next) {
+                file_stat (entry->object, &st);
+                if (filler (buf, entry->name, &st, 0))
+                    return_unlock(0);
+            }
+        }
+    }
+    list_pending(ctx, path, children, buf, filler);
+    DBG("readdir exit");
+    return_unlock(0);
+}
+
+/* Files not uploaded yet: queued in write-back mode, or still open */
+static gboolean
+find_new_file (MtpfsContext * ctx, const gchar * path, struct stat *stbuf)
+{
+    gboolean is_new;
+
+    if (find_pending(ctx, path, stbuf))
+        return TRUE;
+    G_LOCK(myfiles_lock);
+    is_new = g_hash_table_contains(ctx->myfiles, path);
+    G_UNLOCK(myfiles_lock);
+    if (is_new) {
+        stbuf->st_ino = NEW_FILE_INODE(g_str_hash(path));
+        stbuf->st_mode = S_IFREG | 0777;
+        stbuf->st_size = 0;
+        stbuf->st_blocks = 2;
+        stbuf->st_mtime = time(NULL);
+    }
+    return is_new;
+}
+
+/* Look name up in a folder, the last step of resolving a path */
+static int
+stat_child (MtpfsContext * ctx, int storageid, uint32_t parent_id, const gchar * name,
+            struct stat *stbuf)
+{
+    uint32_t storage_id = ctx->storageArea[storageid].storage->id;
+
+    // A pending refresh forgets the missing names first
+    check_files(ctx);
+    if (is_missing(ctx, storage_id, parent_id, name)) {
+        DBG("stat_child: known missing (%s in %u)", name, parent_id);
+        stats_add(STAT_NEGATIVE_HITS, 1);
+        return -ENOENT;
+    }
+
+    LIBMTP_folder_t *folder = find_folder(ctx, storageid, parent_id, name);
+    if (folder != NULL) {
+        dir_stat (OBJECT_INODE(folder->folder_id), stbuf);
+        return 0;
+    }
+    LIBMTP_file_t *file = find_file(ctx, storageid, parent_id, name);
+    if (file != NULL) {
+        DBG("time:%s",ctime(&(file->modificationdate)));
+        file_stat (file, stbuf);
+        return 0;
+    }
+
+    DBG("stat_child: not found (%s in %u)", name, parent_id);
+    remember_missing(ctx, storage_id, parent_id, name);
+    return -ENOENT;
+}
+
+static int
+mtpfs_getattr_real (MtpfsContext * ctx, const gchar * path, struct stat *stbuf)
+{
+    DBG_F("mtpfs_getattr_real(%s, %p)", path, stbuf);
+
+    if (path == NULL) return -ENOENT;
+    new_stat (stbuf);
+
+    if (strcmp (path, "/") == 0) {
+        dir_stat (ROOT_INODE, stbuf);
+        return 0;
+    }
+    if (strcmp (path, STATS_DIR) == 0) {
+        stbuf->st_ino = STATS_DIR_INODE;
+        stbuf->st_mode = S_IFDIR | 0555;
+        stbuf->st_nlink = 2;
+        return 0;
+    }
+    if (strcmp (path, STATS_FILE) == 0) {
+        stats_stat (stbuf);
+        return 0;
+    }
+
+    // Check cached files first (stuff that hasn't been written to dev yet)
+    if (find_new_file(ctx, path, stbuf))
+        return 0;
+
+    // Special case directory 'Playlists', 'lost+found'
+    // Special case root directory items
+    int storageid;
+    storageid=find_storage(ctx, path);
+
+    if (g_strrstr(path+1,"/") == NULL) {
+        if (storageid >= 0) {
+            stbuf->st_ino = STORAGE_INODE(ctx->storageArea[storageid].storage->id);
+        } else if (strcmp (path, "/lost+found") == 0) {
+            stbuf->st_ino = LOST_FOUND_INODE;
+        } else {
+            // Probes like /autorun.inf or /.Trash, nothing can be created there
+            return -ENOENT;
+        }
+        stbuf->st_mode = S_IFDIR | 0777;
+        stbuf->st_nlink = 2;
+        return 0;
+    }
+
+    if (strncasecmp (path, "/lost+found",11) == 0) {
+        GSList *item;
+        uint32_t item_id = parse_path (ctx, path);
+        if (item_id == 0xFFFFFFFF) {
+            DBG("mtpfs_getattr_real: not found (%s)", path);
+            return -ENOENT;
+        }
+        for (item = ctx->lostfiles; item != NULL; item = g_slist_next (item)) {
+            LIBMTP_file_t *file = (LIBMTP_file_t *) item->data;
+
+            if (item_id == file->item_id) {
+                file_stat (file, stbuf);
+                return 0;
+            }
+        }
+
+        return -ENOENT;
+    }
+
+    // Resolve the parent folder, then look for the last component in it
+    const gchar *name = strrchr(path, '/') + 1;
+    gchar *directory = g_strndup(path, (gsize) (name - 1 - path));
+    uint32_t parent_id = lookup_folder_id (ctx, storageid, directory);
+    g_free(directory);
+    if (parent_id == 0xFFFFFFFF) {
+        DBG("mtpfs_getattr_real: no parent (%s)", path);
+        return -ENOENT;
+    }
+    return stat_child(ctx, storageid, parent_id, name, stbuf);
+}
+
+static int
+mtpfs_getattr (MtpfsContext * ctx, const gchar * path, struct stat *stbuf)
+{
+    DBG("mtpfs_getattr(%s, %p)", path, stbuf);
+    lock_tree_path(ctx, path, FALSE);
+
+    int ret = mtpfs_getattr_real (ctx, path, stbuf);
+    stbuf->st_ino = device_inode(ctx, stbuf->st_ino);
+
+    DBG("getattr exit");
+    return_unlock(ret);
+}
+
+/* Lookup of path, whose parent is a folder the kernel looked up already:
+ * only the last component is resolved */
+static int
+mtpfs_lookup (MtpfsContext * ctx, const gchar * path, int storageid, uint32_t parent_id,
+              struct stat *stbuf)
+{
+    int ret;
+
+    DBG("mtpfs_lookup(%s, %d, %u)", path, storageid, parent_id);
+    new_stat (stbuf);
+    if (find_new_file(ctx, path, stbuf)) {
+        stbuf->st_ino = device_inode(ctx, stbuf->st_ino);
+        return 0;
+    }
+    lock_tree_folder(ctx, storageid, parent_id);
+    ret = stat_child(ctx, storageid, parent_id, strrchr(path, '/') + 1, stbuf);
+    stbuf->st_ino = device_inode(ctx, stbuf->st_ino);
+    return_unlock(ret);
+}
+
+/* Attributes of a folder or file by its id, without resolving its path.
+ * The storage itself is folder 0.  -ENOENT when it is not in the tree,
+ * e.g. after a refresh in lazy mode: the caller looks its path up. */
+static int
+mtpfs_getattr_id (MtpfsContext * ctx, int storageid, uint32_t object_id, gboolean folder,
+                  struct stat *stbuf)
+{
+    LIBMTP_file_t *file;
+    int ret = 0;
+
+    DBG("mtpfs_getattr_id(%d, %u, %d)", storageid, object_id, folder);
+    // Nothing is listed, lazy mode shares the tree too
+    if (!share_tree(ctx))
+        lock_tree_write(ctx);
+    check_files(ctx);
+    check_folders(ctx);
+    if (folder && object_id == 0) {
+        dir_stat (STORAGE_INODE(ctx->storageArea[storageid].storage->id), stbuf);
+    } else if (folder) {
+        if (folder_by_id(ctx, storageid, object_id) != NULL)
+            dir_stat (OBJECT_INODE(object_id), stbuf);
+        else
+            ret = -ENOENT;
+    } else {
+        file = g_hash_table_lookup(ctx->files, GUINT_TO_POINTER(object_id));
+        if (file != NULL)
+            file_stat (file, stbuf);
+        else
+            ret = -ENOENT;
+    }
+    stbuf->st_ino = device_inode(ctx, stbuf->st_ino);
+    return_unlock(ret);
+}
+
+static int
+mtpfs_mknod (MtpfsContext * ctx, const gchar * path, mode_t mode, dev_t dev)
+{
+    DBG("mtpfs_mknod(%s, %u, %llu)", path, mode, dev);
+    // A failed upload is forgotten when the file is created again
+    wait_pending(ctx, path, TRUE);
+    check_index(ctx);
+    lock_tree(ctx);
+
+    uint32_t item_id = parse_path (ctx, path);
+    if (item_id != 0xFFFFFFFF)
+        return_unlock(-EEXIST);
+    int ret = 0;
+    G_LOCK(myfiles_lock);
+    if (g_hash_table_contains(ctx->myfiles, path)) {
+        ret = -EEXIST;
+    } else {
+        g_hash_table_insert(ctx->myfiles, g_strdup(path), NULL);
+        DBG("NEW FILE");
+    }
+    G_UNLOCK(myfiles_lock);
+    return_unlock(ret);
+}
+
+/* Download in chunks, letting other requests reach the device in between */
+static int
+stage_chunks (MtpfsContext * ctx, FileHandle * fh)
+{
+    uint64_t offset;
+    unsigned char *data;
+    unsigned int len;
+    int ret;
+
+    for (offset = 0; offset < fh->filesize; offset += len) {
+        data = NULL;
+        len = 0;
+        lock_device(ctx, DEVICE_BULK);
+        ret = ctx->mtp->get_partial_object(ctx->device, fh->item_id, offset,
+                                      (uint32_t) MIN(STAGE_CHUNK_SIZE, fh->filesize - offset), &data, &len);
+        if (ret != 0)
+            dump_mtp_error(ctx->device);
+        unlock_device(ctx, STAT_MTP_PARTIAL_OBJECT);
+        if (ret != 0 || len == 0 || pwrite(fh->fd, data, len, (off_t) offset) != (ssize_t) len) {
+            free(data);
+            return -1;
+        }
+        stats_add(STAT_BYTES_DOWNLOADED, len);
+        free(data);
+    }
+    return 0;
+}
+
+/* Download the whole object into fh->fd */
+static int
+download_file (MtpfsContext * ctx, FileHandle * fh, gboolean chunked)
+{
+    DBG_F("download_file(%d, %d)", fh->item_id, chunked);
+
+    if (chunked) {
+        if (stage_chunks(ctx, fh) == 0)
+            return 0;
+        // e.g. offsets past 4GB without GetPartialObject64
+        DBG("download_file: chunked download of %d failed, retrying whole", fh->item_id);
+        if (ftruncate(fh->fd, 0) != 0)
+            return -1;
+    }
+    lock_device(ctx, DEVICE_BULK);
+    int ret = ctx->mtp->get_file_to_file_descriptor (ctx->device, fh->item_id, fh->fd, NULL, NULL);
+    if (ret != 0)
+        dump_mtp_error(ctx->device);
+    unlock_device(ctx, STAT_MTP_GET_FILE);
+    if (ret != 0)
+        return -1;
+    stats_add(STAT_BYTES_DOWNLOADED, fh->filesize);
+    return 0;
+}
+
+static int
+stage_file (MtpfsContext * ctx, FileHandle * fh, gboolean chunked)
+{
+    if (new_staging_file(fh, fh->filesize) != 0)
+        return -1;
+    if (download_file(ctx, fh, chunked) != 0) {
+        close(fh->fd);
+        fh->fd = -1;
+        staging_release(fh);
+        return -1;
+    }
+    return 0;
+}
+
+/* Content cache: whole objects kept on disk across opens and mounts.  The
+ * name holds the size and date of the object, a modified object misses. */
+
+static void
+free_content_entry (ContentEntry * entry)
+{
+    g_free(entry->name);
+    g_free(entry);
+}
+
+static gchar *
+content_name (MtpfsContext * ctx, LIBMTP_file_t * file)
+{
+    return g_strdup_printf("%s-%u-%" G_GUINT64_FORMAT "-%" G_GINT64_FORMAT, ctx->device_serial,
+                           file->item_id, file->filesize, (gint64) file->modificationdate);
+}
+
+static void
+content_cache_drop (GList * link)
+{
+    ContentEntry *entry = link->data;
+    gchar *path = g_build_filename(content_cache.dir, entry->name, NULL);
+
+    unlink(path);
+    g_free(path);
+    content_cache.size -= entry->size;
+    g_hash_table_remove(content_cache.entries, entry->name);
+    g_queue_delete_link(&content_cache.lru, link);
+    free_content_entry(entry);
+}
+
+static void
+content_cache_add (ContentEntry * entry)
+{
+    GList *old = g_hash_table_lookup(content_cache.entries, entry->name);
+
+    if (old != NULL) {
+        ContentEntry *previous = old->data;
+        content_cache.size -= previous->size;
+        g_hash_table_remove(content_cache.entries, previous->name);
+        g_queue_delete_link(&content_cache.lru, old);
+        free_content_entry(previous);
+    }
+    g_queue_push_head(&content_cache.lru, entry);
+    g_hash_table_insert(content_cache.entries, entry->name, g_queue_peek_head_link(&content_cache.lru));
+    content_cache.size += entry->size;
+
+    // Open files keep their content until closed, even once unlinked
+    while (content_cache.size > content_cache.max_size && content_cache.lru.length > 1)
+        content_cache_drop(g_queue_peek_tail_link(&content_cache.lru));
+}
+
+static gint
+content_entry_older (gconstpointer a, gconstpointer b)
+{
+    const ContentEntry *ea = *(ContentEntry * const *) a;
+    const ContentEntry *eb = *(ContentEntry * const *) b;
+
+    return (ea->used > eb->used) - (ea->used < eb->used);
+}
+
+static void
+init_content_cache (guint64 max_size)
+{
+    GPtrArray *found;
+    const gchar *name;
+    GDir *dir;
+    guint i;
+
+    content_cache.entries = g_hash_table_new(g_str_hash, g_str_equal);
+    g_queue_init(&content_cache.lru);
+    content_cache.size = 0;
+    content_cache.max_size = max_size;
+    content_cache.dir = g_build_filename(g_get_user_cache_dir(), "mtpfs", "content", NULL);
+    if (g_mkdir_with_parents(content_cache.dir, 0700) != 0 ||
+        (dir = g_dir_open(content_cache.dir, 0, NULL)) == NULL) {
+        g_free(content_cache.dir);
+        content_cache.dir = NULL;
+        return;
+    }
+
+    // Entries left by previous mounts, ordered by last use
+    found = g_ptr_array_new();
+    while ((name = g_dir_read_name(dir)) != NULL) {
+        gchar *path = g_build_filename(content_cache.dir, name, NULL);
+        struct stat st;
+
+        if (g_str_has_suffix(name, ".part")) {
+            unlink(path);
+        } else if (stat(path, &st) == 0 && S_ISREG(st.st_mode)) {
+            ContentEntry *entry = g_new(ContentEntry, 1);
+            entry->name = g_strdup(name);
+            entry->size = (uint64_t) st.st_size;
+            entry->used = st.st_mtime;
+            g_ptr_array_add(found, entry);
+        }
+        g_free(path);
+    }
+    g_dir_close(dir);
+    g_ptr_array_sort(found, content_entry_older);
+    for (i = 0; i < found->len; ++i)
+        content_cache_add(g_ptr_array_index(found, i));
+    g_ptr_array_free(found, TRUE);
+}
+
+/* Open the cached content of an object, returns a read-only descriptor
+ * or -1 on a miss */
+static int
+content_cache_open (const gchar * name)
+{
+    gchar *path = g_build_filename(content_cache.dir, name, NULL);
+    GList *link;
+    int fd = -1;
+
+    G_LOCK(content_lock);
+    link = g_hash_table_lookup(content_cache.entries, name);
+    if (link != NULL) {
+        fd = open(path, O_RDONLY);
+        if (fd == -1) {
+            content_cache_drop(link);
+        } else {
+            // The date of the file records its last use
+            ((ContentEntry *) link->data)->used = time(NULL);
+            utime(path, NULL);
+            g_queue_unlink(&content_cache.lru, link);
+            g_queue_push_head_link(&content_cache.lru, link);
+        }
+    }
+    G_UNLOCK(content_lock);
+    g_free(path);
+    if (fd != -1) {
+        DBG("content_cache_open: hit %s", name);
+        stats_add(STAT_CONTENT_HITS, 1);
+    }
+    return fd;
+}
+
+/* Download an object into the cache, leaving fh->fd read-only on the
+ * cached copy.  Called by attach_stage, so that concurrent misses of an
+ * object download it once. */
+static int
+content_cache_fill (MtpfsContext * ctx, FileHandle * fh, const gchar * name)
+{
+    gchar *path = g_build_filename(content_cache.dir, name, NULL);
+    gchar *part;
+    int fd = -1;
+
+    DBG("content_cache_fill: miss %s", name);
+    stats_add(STAT_CONTENT_MISSES, 1);
+    // Never truncating a file that another download is still writing
+    part = g_strconcat(path, ".XXXXXX.part", NULL);
+    fh->fd = g_mkstemp_full(part, O_RDWR, 0600);
+    if (fh->fd != -1) {
+        if (download_file(ctx, fh, FALSE) == 0 && rename(part, path) == 0)
+            fd = open(path, O_RDONLY);
+        close(fh->fd);
+        unlink(part);
+    }
+    fh->fd = fd;
+    if (fd != -1) {
+        ContentEntry *entry = g_new(ContentEntry, 1);
+        entry->name = g_strdup(name);
+        entry->size = fh->filesize;
+        entry->used = time(NULL);
+        G_LOCK(content_lock);
+        content_cache_add(entry);
+        G_UNLOCK(content_lock);
+    }
+    g_free(part);
+    g_free(path);
+    return fd != -1 ? 0 : -1;
+}
+
+/* Drop the cached contents of a deleted object */
+static void
+content_cache_forget (MtpfsContext * ctx, uint32_t item_id)
+{
+    gchar *prefix;
+    GList *link, *next;
+
+    if (content_cache.dir == NULL || ctx->device_serial == NULL)
+        return;
+    prefix = g_strdup_printf("%s-%u-", ctx->device_serial, item_id);
+    G_LOCK(content_lock);
+    for (link = content_cache.lru.head; link != NULL; link = next) {
+        next = link->next;
+        if (g_str_has_prefix(((ContentEntry *) link->data)->name, prefix))
+            content_cache_drop(link);
+    }
+    G_UNLOCK(content_lock);
+    g_free(prefix);
+}
+
+/* Handles reading the same object share one staged copy: the first one
+ * downloads it, the others wait for that download instead of their own.
+ * With a cache name, the copy is the one filling the content cache. */
+
+static int
+attach_stage (MtpfsContext * ctx, FileHandle * fh, gboolean chunked, const gchar * cache_name)
+{
+    SharedStage *stage;
+    int ret;
+
+    g_mutex_lock(&shared_lock);
+    stage = g_hash_table_lookup(ctx->shared_stages, GUINT_TO_POINTER(fh->item_id));
+    if (stage != NULL && stage->filesize == fh->filesize) {
+        DBG("attach_stage: sharing the copy of %d", fh->item_id);
+        stats_add(STAT_SHARED_STAGES, 1);
+        stage->refs++;
+        while (!stage->done)
+            g_cond_wait(&shared_cond, &shared_lock);
+        g_mutex_unlock(&shared_lock);
+        if (stage->fd != -1)
+            fh->fd = dup(stage->fd);
+        if (fh->fd == -1) {
+            detach_stage(stage);
+            return -1;
+        }
+        fh->shared = stage;
+        return 0;
+    }
+    // An older copy of a modified object keeps serving its handles
+    stage = g_new0(SharedStage, 1);
+    stage->ctx = ctx;
+    stage->item_id = fh->item_id;
+    stage->filesize = fh->filesize;
+    stage->fd = -1;
+    stage->refs = 1;
+    g_hash_table_replace(ctx->shared_stages, GUINT_TO_POINTER(fh->item_id), stage);
+    g_mutex_unlock(&shared_lock);
+
+    ret = -1;
+    if (cache_name != NULL)
+        ret = content_cache_fill(ctx, fh, cache_name);
+    if (ret != 0)
+        ret = stage_file(ctx, fh, chunked);
+    if (ret == 0) {
+        stage->fd = dup(fh->fd);
+        if (stage->fd == -1) {
+            close(fh->fd);
+            fh->fd = -1;
+            staging_release(fh);
+            ret = -1;
+        } else {
+            // The budget goes back once the last handle is released
+            stage->staged = fh->staged;
+            fh->staged = 0;
+            fh->shared = stage;
+        }
+    }
+
+    g_mutex_lock(&shared_lock);
+    stage->done = TRUE;
+    // Waiters see fd == -1 and fail like this opener
+    if (ret != 0 && g_hash_table_lookup(ctx->shared_stages, GUINT_TO_POINTER(stage->item_id)) == stage)
+        g_hash_table_remove(ctx->shared_stages, GUINT_TO_POINTER(stage->item_id));
+    g_cond_broadcast(&shared_cond);
+    g_mutex_unlock(&shared_lock);
+    if (ret != 0)
+        detach_stage(stage);
+    return ret;
+}
+
+/* Stop sharing the copy of a deleted or replaced object */
+static void
+forget_stage (MtpfsContext * ctx, uint32_t item_id)
+{
+    g_mutex_lock(&shared_lock);
+    g_hash_table_remove(ctx->shared_stages, GUINT_TO_POINTER(item_id));
+    g_mutex_unlock(&shared_lock);
+}
+
+/* Read a range straight from the device with GetPartialObject */
+static int
+read_device (MtpfsContext * ctx, FileHandle * fh, gchar * buf, size_t size, off_t offset)
+{
+    unsigned char *data = NULL;
+    unsigned int len = 0;
+    int ret;
+
+    lock_device(ctx, DEVICE_INTERACTIVE);
+    ret = ctx->mtp->get_partial_object(ctx->device, fh->item_id, (uint64_t) offset, (uint32_t) size, &data, &len);
+    if (ret != 0)
+        dump_mtp_error(ctx->device);
+    unlock_device(ctx, STAT_MTP_PARTIAL_OBJECT);
+    if (ret != 0) {
+        free(data);
+        return -EIO;
+    }
+    stats_add(STAT_BYTES_DOWNLOADED, len);
+    len = MIN(len, size);
+    memcpy(buf, data, len);
+    free(data);
+    return (int) len;
+}
+
+/* Stage an object whose ranges cannot all be read from the device.  Only
+ * GetObject reaches them, a single call that cannot be split: fh->lock is
+ * released meanwhile so that its other reads and its release do not wait
+ * behind it, and other handles share the copy. */
+static int
+stage_unreachable (MtpfsContext * ctx, FileHandle * fh)
+{
+    FileHandle staged;
+    int ret;
+
+    memset(&staged, 0, sizeof(staged));
+    staged.ctx = ctx;
+    staged.item_id = fh->item_id;
+    staged.filesize = fh->filesize;
+    staged.fd = -1;
+    g_mutex_unlock(&fh->lock);
+    ret = attach_stage(ctx, &staged, FALSE, NULL);
+    g_mutex_lock(&fh->lock);
+    if (ret != 0)
+        return -1;
+    if (fh->fd == -1) {
+        fh->fd = staged.fd;
+        fh->shared = staged.shared;
+        fh->staged = staged.staged;
+    } else {
+        // Another read of the handle got there first
+        close(staged.fd);
+        detach_stage(staged.shared);
+        staging_return(staged.staged);
+    }
+    return 0;
+}
+
+/* Read a range through the block cache */
+static int
+read_cached (MtpfsContext * ctx, FileHandle * fh, gchar * buf, size_t size, off_t offset)
+{
+    size_t done = 0;
+
+    while (done < size) {
+        uint64_t pos = (uint64_t) offset + done;
+        int len;
+
+        len = block_cache_read(ctx, fh->item_id, fh->filesize, (uint32_t) (pos / CACHE_BLOCK_SIZE),
+                               (uint32_t) (pos % CACHE_BLOCK_SIZE), buf + done, size - done);
+        if (len < 0)
+            return done > 0 ? (int) done : -EIO;
+        if (len == 0)
+            break;
+        done += (size_t) len;
+    }
+    return (int) done;
+}
+
+static int
+read_partial (MtpfsContext * ctx, FileHandle * fh, gchar * buf, size_t size, off_t offset)
+{
+    int ret;
+
+    DBG_F("read_partial(%d, %zu, %lli)", fh->item_id, size, (long long) offset);
+
+    if ((uint64_t) offset >= fh->filesize)
+        return 0;
+    size = MIN(size, fh->filesize - (uint64_t) offset);
+    if (block_cache.max_size > 0) {
+        ret = read_cached(ctx, fh, buf, size, offset);
+    } else {
+        ret = read_device(ctx, fh, buf, size, offset);
+    }
+    // Without GetPartialObject64, offsets past 4GB cannot be reached
+    if (ret == -EIO && (uint64_t) offset + size > 0xFFFFFFFF) {
+        DBG("read_partial: falling back to staging %d", fh->item_id);
+        if (stage_unreachable(ctx, fh) != 0)
+            return -EIO;
+        ret = pread(fh->fd, buf, size, offset);
+        if (ret == -1)
+            ret = -errno;
+    }
+    return ret;
+}
+
+/* Snapshot the statistics in a staging file for this handle */
+static int
+open_stats (MtpfsContext * ctx, struct fuse_file_info *fi)
+{
+    FileHandle *fh;
+    GString *text;
+    ssize_t written;
+
+    if ((fi->flags & O_ACCMODE) != O_RDONLY)
+        return -EACCES;
+    fh = g_new0(FileHandle, 1);
+    fh->ctx = ctx;
+    fh->fd = -1;
+    g_mutex_init(&fh->lock);
+    if (new_staging_file(fh, 0) != 0) {
+        free_handle(fh);
+        return -ENOMEM;
+    }
+    text = stats_snapshot();
+    written = pwrite(fh->fd, text->str, text->len, 0);
+    g_string_free(text, TRUE);
+    if (written < 0) {
+        free_handle(fh);
+        return -EIO;
+    }
+    fh->filesize = (uint64_t) written;
+    fi->direct_io = 1;
+    fi->fh = (uint64_t) (uintptr_t) fh;
+    return 0;
+}
+
+/* After a failed transfer, check the object against the listing of its
+ * folder: drop it from the tree if it is gone, update it if it changed.
+ * Returns whether the device still has it. */
+static gboolean
+recheck_file (MtpfsContext * ctx, uint32_t item_id)
+{
+    LIBMTP_file_t *file, *listed, *next, *found = NULL;
+    uint32_t storage_id, parent_id;
+    gboolean changed, present;
+
+    lock_tree(ctx);
+    file = g_hash_table_lookup(ctx->files, GUINT_TO_POINTER(item_id));
+    if (file == NULL)
+        return_unlock(FALSE);
+    storage_id = file->storage_id;
+    parent_id = file->parent_id;
+    unlock_tree(ctx);
+
+    lock_device(ctx, DEVICE_INTERACTIVE);
+    listed = ctx->mtp->get_files_and_folders(ctx->device, storage_id,
+                                             parent_id == 0 ? LIBMTP_FILES_AND_FOLDERS_ROOT : parent_id);
+    unlock_device(ctx, STAT_MTP_FILES_AND_FOLDERS);
+    for (; listed != NULL; listed = next) {
+        next = listed->next;
+        if (found == NULL && listed->item_id == item_id) {
+            found = listed;
+            found->next = NULL;
+            // Some devices report the root as 0xFFFFFFFF
+            found->parent_id = parent_id;
+        } else {
+            LIBMTP_destroy_file_t(listed);
+        }
+    }
+    present = found != NULL;
+    DBG("recheck_file(%d): %s", item_id, present ? "still there" : "gone");
+
+    lock_tree_write(ctx);
+    file = g_hash_table_lookup(ctx->files, GUINT_TO_POINTER(item_id));
+    changed = file != NULL &&
+        (found == NULL || found->filesize != file->filesize ||
+         found->modificationdate != file->modificationdate ||
+         g_strcmp0(found->filename, file->filename) != 0);
+    if (changed) {
+        cache_remove_file(ctx, item_id);
+        block_cache_invalidate(ctx, item_id);
+        content_cache_forget(ctx, item_id);
+        forget_stage(ctx, item_id);
+        // The tree now owns it
+        if (present)
+            cache_add_file(ctx, found);
+    } else if (present) {
+        LIBMTP_destroy_file_t(found);
+    }
+    unlock_tree(ctx);
+    return present;
+}
+
+static int
+mtpfs_open (MtpfsContext * ctx, const gchar * path, struct fuse_file_info *fi)
+{
+    uint32_t item_id;
+    gboolean staged = FALSE;
+    gboolean chunked = FALSE;
+    gboolean shared = FALSE;
+    gchar *cache_name = NULL;
+    int ret = 0;
+
+    DBG("mtpfs_open(%s, %p)", path, fi);
+    if (strcmp(path, STATS_FILE) == 0)
+        return open_stats(ctx, fi);
+    // A queued file is opened once on the device
+    wait_pending(ctx, path, FALSE);
+    check_index(ctx);
+    lock_tree_path(ctx, path, FALSE);
+
+    item_id = parse_path (ctx, path);
+    if (item_id == 0) {
+        DBG("Trying to open root");
+        return_unlock(-EPERM);
+    }
+
+    if (fi->flags == O_RDONLY) {
+        DBG("read");
+    } else if (fi->flags == O_WRONLY) {
+        DBG("write");
+    } else if (fi->flags == O_RDWR) {
+        DBG("rdwrite");
+    }
+
+    FileHandle *fh = g_new(FileHandle, 1);
+    fh->ctx = ctx;
+    fh->item_id = item_id;
+    fh->filesize = 0;
+    fh->fd = -1;
+    fh->staged = 0;
+    fh->next_offset = 0;
+    fh->readahead = 0;
+    fh->readahead_end = 0;
+    fh->shared = NULL;
+    fh->dirty = NULL;
+    fh->resized = FALSE;
+    fh->streaming = FALSE;
+    fh->streamed = NULL;
+    fh->chunk = NULL;
+    fh->chunk_len = 0;
+    fh->sent = 0;
+    fh->stream_error = 0;
+    g_mutex_init(&fh->lock);
+
+    G_LOCK(myfiles_lock);
+    if (g_hash_table_lookup(ctx->myfiles, path) != NULL) {
+        ret = -EBUSY;
+    } else if (item_id == 0xFFFFFFFF) {
+        if (!g_hash_table_contains(ctx->myfiles, path)) {
+            ret = -ENOENT;
+        } else {
+            // The size of a new file is unknown, it is accounted as written
+            if (new_staging_file(fh, 0) != 0) {
+                ret = -ENOENT;
+            } else {
+                // Write-back queues whole files instead, readers need
+                // the staged content
+                if (ctx->edit_objects && !write_back && (fi->flags & O_ACCMODE) == O_WRONLY) {
+                    fh->streaming = TRUE;
+                    fh->chunk = g_malloc(STAGE_CHUNK_SIZE);
+                    fh->dirty = g_array_new(FALSE, FALSE, sizeof(DirtyRange));
+                }
+                g_hash_table_replace(ctx->myfiles, g_strdup(path), fh);
+            }
+        }
+    } else {
+        LIBMTP_file_t *file = g_hash_table_lookup(ctx->files, GUINT_TO_POINTER(item_id));
+
+        if (file != NULL)
+            fh->filesize = file->filesize;
+        if (content_cache.dir != NULL && ctx->device_serial != NULL && file != NULL &&
+            (fi->flags & O_ACCMODE) == O_RDONLY)
+            cache_name = content_name(ctx, file);
+        if (ctx->partial_read && file != NULL && (fi->flags & O_ACCMODE) == O_RDONLY) {
+            // Ranges are fetched by mtpfs_read
+        } else {
+            staged = TRUE;
+            chunked = ctx->partial_read && file != NULL;
+            shared = file != NULL && (fi->flags & O_ACCMODE) == O_RDONLY;
+        }
+        // Written ranges are sent back on release
+        if (file != NULL && (fi->flags & O_ACCMODE) != O_RDONLY)
+            fh->dirty = g_array_new(FALSE, FALSE, sizeof(DirtyRange));
+    }
+    G_UNLOCK(myfiles_lock);
+    unlock_tree(ctx);
+
+    // Downloading does not need the tree
+    if (ret == 0 && cache_name != NULL) {
+        fh->fd = content_cache_open(cache_name);
+        if (fh->fd != -1) {
+            staged = FALSE;
+        } else if (!staged || fh->filesize > content_cache.max_size / 4) {
+            // Partial reads only transfer what is read, a whole copy to
+            // fill the cache would not.  Big objects would flush it.
+            g_free(cache_name);
+            cache_name = NULL;
+        }
+    }
+    if (ret == 0 && staged &&
+        (shared ? attach_stage(ctx, fh, chunked, cache_name) : stage_file(ctx, fh, chunked)) != 0) {
+        // Our view of the object may be out of date, not that of the tree
+        ret = recheck_file(ctx, item_id) ? -EIO : -ENOENT;
+    }
+    g_free(cache_name);
+    if (ret != 0) {
+        free_handle(fh);
+        return ret;
+    }
+    fi->fh = (uint64_t) (uintptr_t) fh;
+    return 0;
+}
+
+static int
+mtpfs_read (MtpfsContext * ctx, const gchar * path, gchar * buf, size_t size, off_t offset,
+            struct fuse_file_info *fi)
+{
+    int ret;
+
+    DBG("mtpfs_read(%s, %p, %zu, %llu, %p)", path, buf, size, offset, fi);
+
+    FileHandle *fh = FILE_HANDLE(fi);
+    g_mutex_lock(&fh->lock);
+    if (fh->fd != -1) {
+        ret = pread (fh->fd, buf, size, offset);
+        if (ret == -1)
+            ret = -errno;
+    } else {
+        ret = read_partial (ctx, fh, buf, size, offset);
+        if (ret > 0 && fh->fd == -1)
+            schedule_readahead (fh, offset, (size_t) ret);
+    }
+    g_mutex_unlock(&fh->lock);
+    if (ret > 0)
+        stats_add(STAT_BYTES_READ, (guint64) ret);
+
+    return ret;
+}
+
+/* Record a write to an existing file, merging it with the ranges it
+ * overlaps or comes close to.  The staging file of a streamed file has
+ * holes where the bytes were sent, its ranges are only merged when they
+ * touch. */
+static void
+mark_dirty (FileHandle * fh, uint64_t start, uint64_t end)
+{
+    uint64_t gap = fh->streaming ? 0 : DIRTY_MERGE_GAP;
+    DirtyRange *range, merged;
+    guint i = 0;
+
+    while (i < fh->dirty->len && g_array_index(fh->dirty, DirtyRange, i).end + gap < start)
+        ++i;
+    while (i < fh->dirty->len && g_array_index(fh->dirty, DirtyRange, i).start <= end + gap) {
+        range = &g_array_index(fh->dirty, DirtyRange, i);
+        start = MIN(start, range->start);
+        end = MAX(end, range->end);
+        g_array_remove_index(fh->dirty, i);
+    }
+    merged.start = start;
+    merged.end = end;
+    g_array_insert_val(fh->dirty, i, merged);
+}
+
+static gboolean
+overlaps_dirty (FileHandle * fh, uint64_t start, uint64_t end)
+{
+    guint i;
+
+    for (i = 0; i < fh->dirty->len; ++i) {
+        DirtyRange *range = &g_array_index(fh->dirty, DirtyRange, i);
+
+        if (range->start < end && start < range->end)
+            return TRUE;
+    }
+    return FALSE;
+}
+
+/* New files opened write-only on devices with the Android edit extensions
+ * are sent while written: the first full chunk creates the object, empty,
+ * then each chunk written in order is sent once full, the device only
+ * held for that chunk.  Other writes are staged and sent on release. */
+
+static int
+stream_chunk (FileHandle * fh, const char *path)
+{
+    MtpfsContext *ctx = fh->ctx;
+    LIBMTP_file_t *genfile;
+    int ret;
+
+    if (fh->streamed == NULL) {
+        lock_tree(ctx);
+        genfile = new_upload_file(ctx, path, 0);
+        unlock_tree(ctx);
+        if (genfile == NULL)
+            return -ENOENT;
+        lock_device(ctx, DEVICE_BULK);
+        ret = ctx->mtp->send_file_from_file_descriptor(ctx->device, fh->fd, genfile, NULL, NULL);
+        if (ret != 0) {
+            dump_mtp_error(ctx->device);
+        } else if ((ret = ctx->mtp->begin_edit_object(ctx->device, genfile->item_id)) != 0) {
+            dump_mtp_error(ctx->device);
+            if (ctx->mtp->delete_object(ctx->device, genfile->item_id) != 0)
+                dump_mtp_error(ctx->device);
+        }
+        unlock_device(ctx, STAT_MTP_SEND_FILE);
+        if (ret != 0) {
+            LIBMTP_destroy_file_t(genfile);
+            return -EIO;
+        }
+        DBG("Streaming %s as %d", path, genfile->item_id);
+        fh->streamed = genfile;
+        fh->item_id = genfile->item_id;
+    }
+
+    lock_device(ctx, DEVICE_BULK);
+    ret = ctx->mtp->send_partial_object(ctx->device, fh->item_id, fh->sent, fh->chunk, fh->chunk_len);
+    if (ret != 0)
+        dump_mtp_error(ctx->device);
+    unlock_device(ctx, STAT_MTP_SEND_PARTIAL);
+    if (ret != 0)
+        return -EIO;
+    stats_add(STAT_BYTES_UPLOADED, fh->chunk_len);
+    fh->sent += fh->chunk_len;
+    fh->chunk_len = 0;
+    return 0;
+}
+
+/* Bytes written right after the chunk fill it.  The others are staged, as
+ * are bytes appended over staged ones: the last write of a range must be
+ * the one sent, and staged ranges are sent last.  The chunk is kept up to
+ * date with the staged bytes it covers. */
+static int
+stream_write (FileHandle * fh, const char *path, const gchar * buf, size_t size, off_t offset)
+{
+    uint64_t start = (uint64_t) offset;
+    uint64_t chunk_end = fh->sent + fh->chunk_len;
+    size_t done, len;
+    ssize_t written;
+    int ret;
+
+    if (fh->stream_error != 0)
+        return fh->stream_error;
+    if (start != chunk_end || overlaps_dirty(fh, start, start + size)) {
+        written = pwrite(fh->fd, buf, size, offset);
+        if (written < 0)
+            return -errno;
+        staging_grow(fh, start + (uint64_t) written);
+        mark_dirty(fh, start, start + (uint64_t) written);
+        if (start < chunk_end && start + (uint64_t) written > fh->sent) {
+            uint64_t from = MAX(start, fh->sent);
+            uint64_t to = MIN(start + (uint64_t) written, chunk_end);
+
+            memcpy(fh->chunk + (from - fh->sent), buf + (from - start), (size_t) (to - from));
+        }
+        fh->filesize = MAX(fh->filesize, start + (uint64_t) written);
+        return (int) written;
+    }
+
+    for (done = 0; done < size; done += len) {
+        len = MIN(size - done, STAGE_CHUNK_SIZE - fh->chunk_len);
+        memcpy(fh->chunk + fh->chunk_len, buf + done, len);
+        fh->chunk_len += (uint32_t) len;
+        if (fh->chunk_len == STAGE_CHUNK_SIZE && (ret = stream_chunk(fh, path)) != 0) {
+            fh->stream_error = ret;
+            return ret;
+        }
+    }
+    fh->filesize = MAX(fh->filesize, start + size);
+    return (int) size;
+}
+
+static int
+mtpfs_write (const gchar * path, const gchar * buf, size_t size, off_t offset,
+             struct fuse_file_info *fi)
+{
+    int ret;
+
+    DBG("mtpfs_write(%s, %p, %zu, %llu, %p)", path, buf, size, offset, fi);
+
+    FileHandle *fh = FILE_HANDLE(fi);
+
+    g_mutex_lock(&fh->lock);
+    if (fh->streaming) {
+        ret = stream_write(fh, path, buf, size, offset);
+    } else if (fh->fd != -1) {
+        ret = pwrite (fh->fd, buf, size, offset);
+        if (ret > 0)
+            staging_grow(fh, (uint64_t) offset + ret);
+        if (ret > 0 && fh->dirty != NULL)
+            mark_dirty(fh, (uint64_t) offset, (uint64_t) offset + ret);
+    } else {
+        ret = -EBADF;
     }
-    g_free (ptype);
-    return filetype;
+    g_mutex_unlock(&fh->lock);
+
+    if (ret > 0)
+        stats_add(STAT_BYTES_WRITTEN, (guint64) ret);
+
+    return ret;
+}
+
+/* Delete a file and whatever is cached of it, the tree is locked for writing */
+static int
+delete_file (MtpfsContext * ctx, uint32_t item_id)
+{
+    int ret;
+
+    lock_device(ctx, DEVICE_INTERACTIVE);
+    ret = ctx->mtp->delete_object (ctx->device, item_id);
+    if (ret != 0)
+        LIBMTP_Dump_Errorstack (ctx->device);
+    unlock_device(ctx, STAT_MTP_DELETE_OBJECT);
+    if (ret != 0) {
+        ctx->files_changed = TRUE;
+    } else {
+        cache_remove_file (ctx, item_id);
+        block_cache_invalidate (ctx, item_id);
+        content_cache_forget (ctx, item_id);
+        forget_stage (ctx, item_id);
+    }
+    return ret;
+}
+
+/* Existing files changed on the device: what is cached of them is stale */
+static void
+end_edit (MtpfsContext * ctx, uint32_t item_id, uint64_t size)
+{
+    LIBMTP_file_t *file;
+
+    lock_tree_write(ctx);
+    file = g_hash_table_lookup(ctx->files, GUINT_TO_POINTER(item_id));
+    if (file != NULL) {
+        file->filesize = size;
+        file->modificationdate = time(NULL);
+    }
+    block_cache_invalidate(ctx, item_id);
+    content_cache_forget(ctx, item_id);
+    forget_stage(ctx, item_id);
+    unlock_tree(ctx);
+}
+
+static int
+truncate_object (MtpfsContext * ctx, uint32_t item_id, uint64_t size)
+{
+    int ret;
+
+    lock_device(ctx, DEVICE_INTERACTIVE);
+    ret = ctx->mtp->begin_edit_object(ctx->device, item_id);
+    if (ret == 0) {
+        ret = ctx->mtp->truncate_object(ctx->device, item_id, size);
+        if (ctx->mtp->end_edit_object(ctx->device, item_id) != 0)
+            ret = -1;
+    }
+    if (ret != 0)
+        dump_mtp_error(ctx->device);
+    unlock_device(ctx, STAT_MTP_EDIT_OBJECT);
+    if (ret != 0)
+        return -EIO;
+    end_edit(ctx, item_id, size);
+    return 0;
+}
+
+/* Send the written ranges of an object being edited, up to size */
+static int
+send_dirty (MtpfsContext * ctx, FileHandle * fh, uint64_t size)
+{
+    unsigned char *data;
+    DirtyRange *range;
+    uint64_t offset, end;
+    ssize_t len;
+    guint i;
+    int ret = 0;
+
+    // A chunk at a time, so that other requests reach the device
+    data = g_malloc(STAGE_CHUNK_SIZE);
+    for (i = 0; ret == 0 && i < fh->dirty->len; ++i) {
+        range = &g_array_index(fh->dirty, DirtyRange, i);
+        end = MIN(range->end, size);
+        for (offset = range->start; ret == 0 && offset < end; offset += (uint64_t) len) {
+            len = pread(fh->fd, data, (size_t) MIN((uint64_t) STAGE_CHUNK_SIZE, end - offset), (off_t) offset);
+            if (len <= 0) {
+                ret = -1;
+                break;
+            }
+            lock_device(ctx, DEVICE_BULK);
+            ret = ctx->mtp->send_partial_object(ctx->device, fh->item_id, offset, data, (unsigned int) len);
+            if (ret != 0)
+                dump_mtp_error(ctx->device);
+            unlock_device(ctx, STAT_MTP_SEND_PARTIAL);
+            if (ret == 0)
+                stats_add(STAT_BYTES_UPLOADED, (guint64) len);
+        }
+    }
+    g_free(data);
+    return ret;
+}
+
+/* Android edit extensions: send the written ranges only */
+static int
+send_ranges (MtpfsContext * ctx, FileHandle * fh, uint64_t size)
+{
+    int ret;
+
+    lock_device(ctx, DEVICE_BULK);
+    ret = ctx->mtp->begin_edit_object(ctx->device, fh->item_id);
+    if (ret != 0) {
+        dump_mtp_error(ctx->device);
+        unlock_device(ctx, STAT_MTP_EDIT_OBJECT);
+        return -1;
+    }
+    if (size != fh->filesize)
+        ret = ctx->mtp->truncate_object(ctx->device, fh->item_id, size);
+    if (ret != 0)
+        dump_mtp_error(ctx->device);
+    unlock_device(ctx, STAT_MTP_EDIT_OBJECT);
+
+    if (ret == 0)
+        ret = send_dirty(ctx, fh, size);
+
+    lock_device(ctx, DEVICE_BULK);
+    if (ctx->mtp->end_edit_object(ctx->device, fh->item_id) != 0) {
+        dump_mtp_error(ctx->device);
+        ret = -1;
+    }
+    unlock_device(ctx, STAT_MTP_EDIT_OBJECT);
+    return ret;
+}
+
+/* Without them, upload the whole file as a new object, then delete the
+ * old one so that nothing is lost if the upload fails.  This is a single
+ * SendObject: interactive requests only get the device once it is over. */
+static int
+replace_object (MtpfsContext * ctx, FileHandle * fh, uint64_t size)
+{
+    LIBMTP_file_t *file, *genfile;
+    int ret;
+
+    lock_tree(ctx);
+    file = g_hash_table_lookup(ctx->files, GUINT_TO_POINTER(fh->item_id));
+    if (file == NULL) {
+        unlock_tree(ctx);
+        return -ENOENT;
+    }
+    genfile = LIBMTP_new_file_t();
+    genfile->filename = g_strdup(file->filename);
+    genfile->filetype = file->filetype;
+    genfile->parent_id = file->parent_id;
+    genfile->storage_id = file->storage_id;
+    genfile->filesize = size;
+    genfile->modificationdate = time(NULL);
+    unlock_tree(ctx);
+
+    // The download left the offset at the end
+    lseek(fh->fd, 0, SEEK_SET);
+    lock_device(ctx, DEVICE_BULK);
+    ret = ctx->mtp->send_file_from_file_descriptor(ctx->device, fh->fd, genfile, NULL, NULL);
+    if (ret != 0)
+        dump_mtp_error(ctx->device);
+    unlock_device(ctx, STAT_MTP_SEND_FILE);
+    if (ret != 0) {
+        LIBMTP_destroy_file_t(genfile);
+        return -EIO;
+    }
+    stats_add(STAT_BYTES_UPLOADED, size);
+
+    lock_tree_write(ctx);
+    // Otherwise both are listed after the refresh delete_file asks for
+    if (delete_file(ctx, fh->item_id) != 0)
+        DBG("replace_object: %d not deleted", fh->item_id);
+    block_cache_invalidate(ctx, genfile->item_id);
+    cache_add_file(ctx, genfile);
+    unlock_tree(ctx);
+    return 0;
+}
+
+/* Truncate without the edit extensions: stage what is kept of the file,
+ * then upload it in place of the object */
+static int
+truncate_replace (MtpfsContext * ctx, uint32_t item_id, uint64_t size)
+{
+    LIBMTP_file_t *file;
+    FileHandle *fh;
+    int ret;
+
+    fh = g_new0(FileHandle, 1);
+    fh->ctx = ctx;
+    fh->item_id = item_id;
+    fh->fd = -1;
+    g_mutex_init(&fh->lock);
+    lock_tree(ctx);
+    file = g_hash_table_lookup(ctx->files, GUINT_TO_POINTER(item_id));
+    if (file != NULL)
+        fh->filesize = file->filesize;
+    unlock_tree(ctx);
+    if (file == NULL) {
+        free_handle(fh);
+        return -ENOENT;
+    }
+
+    if (size == 0) {
+        // Nothing to download, as for O_TRUNC
+        ret = new_staging_file(fh, 0);
+    } else {
+        // Partial reads only fetch what is kept
+        if (ctx->partial_read)
+            fh->filesize = MIN(size, fh->filesize);
+        ret = stage_file(ctx, fh, ctx->partial_read);
+    }
+    if (ret == 0 && ftruncate(fh->fd, (off_t) size) != 0)
+        ret = -1;
+    if (ret != 0) {
+        free_handle(fh);
+        return -EIO;
+    }
+    staging_grow(fh, size);
+    stats_add(STAT_EDITS_REPLACED, 1);
+    ret = replace_object(ctx, fh, size);
+    free_handle(fh);
+    return ret;
+}
+
+/* Send what was written to an existing file */
+static int
+commit_changes (MtpfsContext * ctx, FileHandle * fh)
+{
+    struct stat st;
+
+    if (fstat(fh->fd, &st) != 0)
+        return -EIO;
+    assert(st.st_size >= 0);
+    if (ctx->edit_objects) {
+        if (send_ranges(ctx, fh, (uint64_t) st.st_size) == 0) {
+            end_edit(ctx, fh->item_id, (uint64_t) st.st_size);
+            stats_add(STAT_EDITS_PARTIAL, 1);
+            return 0;
+        }
+        // The whole content makes up for a partial edit
+        DBG("commit_changes: editing %d failed, replacing it", fh->item_id);
+    }
+    stats_add(STAT_EDITS_REPLACED, 1);
+    return replace_object(ctx, fh, (uint64_t) st.st_size);
+}
+
+/* Release of a streamed file: send the rest of it, the staged ranges and
+ * its final size.  The object is deleted if anything failed, nothing is
+ * left half written.  Small files were never created, they are sent
+ * whole from the staging file. */
+static int
+stream_finish (MtpfsContext * ctx, FileHandle * fh, const char *path, LIBMTP_file_t ** genfile)
+{
+    int ret = fh->stream_error;
+
+    if (ret == 0 && fh->streamed == NULL) {
+        if (fh->chunk_len > 0 &&
+            pwrite(fh->fd, fh->chunk, fh->chunk_len, (off_t) fh->sent) != (ssize_t) fh->chunk_len)
+            return -EIO;
+        if (ftruncate(fh->fd, (off_t) fh->filesize) != 0)
+            return -EIO;
+        staging_grow(fh, fh->filesize);
+        return send_staged(ctx, path, fh->fd, genfile);
+    }
+    if (fh->streamed == NULL)
+        return ret;
+
+    if (ret == 0 && fh->chunk_len > 0)
+        ret = stream_chunk(fh, path);
+    if (ret == 0 && fh->filesize != fh->sent) {
+        lock_device(ctx, DEVICE_BULK);
+        ret = ctx->mtp->truncate_object(ctx->device, fh->item_id, fh->filesize);
+        if (ret != 0)
+            dump_mtp_error(ctx->device);
+        unlock_device(ctx, STAT_MTP_EDIT_OBJECT);
+    }
+    if (ret == 0)
+        ret = send_dirty(ctx, fh, fh->filesize);
+
+    lock_device(ctx, DEVICE_BULK);
+    if (ctx->mtp->end_edit_object(ctx->device, fh->item_id) != 0) {
+        dump_mtp_error(ctx->device);
+        ret = -1;
+    }
+    if (ret != 0 && ctx->mtp->delete_object(ctx->device, fh->item_id) != 0)
+        dump_mtp_error(ctx->device);
+    unlock_device(ctx, STAT_MTP_EDIT_OBJECT);
+    DBG("Streamed %s - %d", path, ret);
+
+    // The handle no longer owns it
+    *genfile = fh->streamed;
+    fh->streamed = NULL;
+    (*genfile)->filesize = fh->filesize;
+    (*genfile)->modificationdate = time(NULL);
+    return ret != 0 ? -EIO : 0;
+}
+
+static int
+mtpfs_release (MtpfsContext * ctx, const char *path, struct fuse_file_info *fi)
+{
+    DBG("mtpfs_release(%s, %p)", path, fi);
+
+    FileHandle *fh = FILE_HANDLE(fi);
+    LIBMTP_file_t *genfile = NULL;
+    gboolean is_new;
+    int ret = 0;
+
+    if (write_back) {
+        G_LOCK(myfiles_lock);
+        is_new = g_hash_table_contains(ctx->myfiles, path);
+        G_UNLOCK(myfiles_lock);
+        if (is_new)
+            wait_queue_room(ctx);
+    }
+    lock_tree(ctx);
+    G_LOCK(myfiles_lock);
+    is_new = g_hash_table_contains(ctx->myfiles, path);
+    G_UNLOCK(myfiles_lock);
+    if (is_new && write_back) {
+        queue_upload(ctx, path, fh);
+        unlock_tree(ctx);
+        free_handle(fh);
+        return 0;
+    }
+    unlock_tree(ctx);
+    if (is_new && fh->streaming)
+        ret = stream_finish(ctx, fh, path, &genfile);
+    else if (is_new)
+        ret = send_staged(ctx, path, fh->fd, &genfile);
+    else if (fh->dirty != NULL && (fh->dirty->len > 0 || fh->resized))
+        ret = commit_changes(ctx, fh);
+
+    if (is_new)
+        end_new_file(ctx, path, genfile, ret, TRUE);
+    free_handle(fh);
+    return ret;
+}
+
+static int
+mtpfs_truncate (MtpfsContext * ctx, const gchar * path, off_t size)
+{
+    FileHandle *fh;
+
+    DBG("mtpfs_truncate(%s, %lli)", path, (long long) size);
+    check_index(ctx);
+    lock_tree(ctx);
+
+    // Release drops the handle from myfiles under the tree lock
+    G_LOCK(myfiles_lock);
+    fh = g_hash_table_lookup(ctx->myfiles, path);
+    G_UNLOCK(myfiles_lock);
+    if (fh == NULL) {
+        // Existing files are truncated in place, as for O_TRUNC, or
+        // replaced by their truncated copy
+        uint32_t item_id = parse_path(ctx, path);
+
+        unlock_tree(ctx);
+        if (item_id == 0 || item_id == 0xFFFFFFFF)
+            return -ENOENT;
+        if (!ctx->edit_objects)
+            return truncate_replace(ctx, item_id, (uint64_t) size);
+        return truncate_object(ctx, item_id, (uint64_t) size);
+    }
+
+    g_mutex_lock(&fh->lock);
+    int ret = declare_size(ctx, fh, path, (uint64_t) size);
+    g_mutex_unlock(&fh->lock);
+
+    return_unlock(ret);
+}
+
+static int
+mtpfs_ftruncate (MtpfsContext * ctx, const gchar * path, off_t size, struct fuse_file_info *fi)
+{
+    FileHandle *fh = FILE_HANDLE(fi);
+
+    DBG("mtpfs_ftruncate(%s, %lli, %p)", path, (long long) size, fi);
+    lock_tree(ctx);
+
+    G_LOCK(myfiles_lock);
+    gboolean is_new = g_hash_table_contains(ctx->myfiles, path);
+    G_UNLOCK(myfiles_lock);
+    if (!is_new && fh->dirty == NULL)
+        return_unlock(-ENOSYS);
+
+    int ret = 0;
+    g_mutex_lock(&fh->lock);
+    if (is_new) {
+        ret = declare_size(ctx, fh, path, (uint64_t) size);
+    } else if (ftruncate(fh->fd, size) != 0) {
+        ret = -errno;
+    } else {
+        // Sent on release, like the writes
+        staging_grow(fh, (uint64_t) size);
+        fh->resized = TRUE;
+    }
+    g_mutex_unlock(&fh->lock);
+
+    return_unlock(ret);
+}
+
+#if FUSE_VERSION >= 29
+static int
+mtpfs_fallocate (MtpfsContext * ctx, const gchar * path, int mode, off_t offset, off_t length,
+                 struct fuse_file_info *fi)
+{
+    FileHandle *fh = FILE_HANDLE(fi);
+
+    DBG("mtpfs_fallocate(%s, %d, %lli, %lli, %p)", path, mode, (long long) offset, (long long) length, fi);
+    lock_tree(ctx);
+
+    G_LOCK(myfiles_lock);
+    gboolean is_new = g_hash_table_contains(ctx->myfiles, path);
+    G_UNLOCK(myfiles_lock);
+    if (mode != 0 || !is_new)
+        return_unlock(-EOPNOTSUPP);
+
+    // Only ever grows the file
+    struct stat st;
+    int ret = 0;
+    g_mutex_lock(&fh->lock);
+    if (fh->streaming ? fh->filesize < (uint64_t) (offset + length) :
+        fstat(fh->fd, &st) == 0 && st.st_size < offset + length)
+        ret = declare_size(ctx, fh, path, (uint64_t) (offset + length));
+    g_mutex_unlock(&fh->lock);
+
+    return_unlock(ret);
+}
+#endif
+
+static int
+mtpfs_unlink (MtpfsContext * ctx, const gchar * path)
+{
+    int ret;
+
+    DBG("mtpfs_unlink(%s)", path);
+    wait_pending(ctx, path, FALSE);
+    check_index(ctx);
+    lock_tree_write(ctx);
+
+    uint32_t item_id = parse_path (ctx, path);
+    if (item_id == 0 || item_id == 0xFFFFFFFF)
+        return_unlock(-ENOENT);
+    ret = delete_file (ctx, item_id);
+
+    return_unlock(ret);
+}
+
+static int
+mtpfs_mkdir_real (MtpfsContext * ctx, const char *path, mode_t mode)
+{
+    DBG_F("mtpfs_mkdir_real(%s, %u)", path, mode);
+
+    if (g_str_has_prefix (path, "/.Trash") == TRUE)
+      return -EPERM;
+
+    int ret = 0;
+    uint32_t item_id = parse_path (ctx, path);
+    int storageid = find_storage(ctx, path);
+    if ((item_id == 0xFFFFFFFF) && !g_hash_table_contains(ctx->myfiles, path)) {
+        // Split path and find parent_id
+        gchar *filename = g_strdup("");
+        gchar **fields;
+        gchar *directory;
+
+        directory = (gchar *) g_malloc (strlen (path));
+        directory = strcpy (directory, "/");
+        fields = g_strsplit (path, "/", -1);
+        int i;
+        uint32_t parent_id = 0;
+        for (i = 0; fields[i] != NULL; i++) {
+            if (strlen (fields[i]) > 0) {
+                if (fields[i + 1] == NULL) {
+                    gchar *tmp = g_strndup (directory, strlen (directory) - 1);
+                    parent_id = lookup_folder_id (ctx, storageid, tmp);
+                    g_free (tmp);
+                    if (parent_id == 0xFFFFFFFF) {
+                        DBG("parent not found");
+                        ret = -ENOENT;
+                        goto clean;
+                    }
+                    g_free (filename);
+                    filename = g_strdup (fields[i]);
+                } else {
+                    directory = strcat (directory, fields[i]);
+                    directory = strcat (directory, "/");
+                }
+            }
+        }
+        DBG("%s:%s:%d", filename, directory, parent_id);
+        lock_device(ctx, DEVICE_INTERACTIVE);
+        item_id = ctx->mtp->create_folder (ctx->device, filename, parent_id, ctx->storageArea[storageid].storage->id);
+        unlock_device(ctx, STAT_MTP_CREATE_FOLDER);
+        if (item_id == 0) {
+            ret = -EEXIST;
+        } else {
+            cache_add_folder (ctx, storageid, item_id, parent_id, filename);
+            ret = 0;
+        }
+clean:
+        g_strfreev (fields);
+        g_free (directory);
+        g_free (filename);
+    } else {
+        ret = -EEXIST;
+    }
+    return ret;
+}
+
+static int
+mtpfs_mkdir (MtpfsContext * ctx, const char *path, mode_t mode)
+{
+    DBG("mtpfs_mkdir(%s, %u)", path, mode);
+    check_index(ctx);
+    lock_tree_write(ctx);
+
+    int ret = mtpfs_mkdir_real (ctx, path, mode);
+
+    return_unlock(ret);
+}
+
+static int
+mtpfs_rmdir (MtpfsContext * ctx, const char *path)
+{
+    DBG("mtpfs_rmdir(%s)", path);
+    wait_pending_below(ctx, path);
+    check_index(ctx);
+    lock_tree_write(ctx);
+
+    int ret = 0;
+    uint32_t folder_id = 0xFFFFFFFF;
+    if (strcmp (path, "/") == 0) {
+        return_unlock(0);
+    }
+    int storageid=find_storage(ctx, path);
+    folder_id = lookup_folder_id (ctx, storageid, path);
+    if (folder_id == 0 || folder_id == 0xFFFFFFFF)
+        return_unlock(-ENOENT);
+
+    lock_device(ctx, DEVICE_INTERACTIVE);
+    ret = ctx->mtp->delete_object(ctx->device, folder_id);
+    if (ret != 0)
+        dump_mtp_error(ctx->device);
+    unlock_device(ctx, STAT_MTP_DELETE_OBJECT);
+    if (ret != 0) {
+        ctx->storageArea[storageid].folders_changed=TRUE;
+        ret = -EIO;
+    } else {
+        cache_remove_folder(ctx, storageid, folder_id);
+    }
+    return_unlock(ret);
 }
 
+/* Where a path is, or would be, in the tree: the folder holding it and
+ * what has its name there, if anything */
+typedef struct
+{
+    int storageid;
+    uint32_t parent_id;
+    gchar *name;
+    LIBMTP_file_t *file;
+    LIBMTP_folder_t *folder;
+} TreeEntry;
+
 static int
-mtpfs_release (const char *path, struct fuse_file_info *fi)
+find_entry (MtpfsContext * ctx, const char *path, TreeEntry * entry)
 {
-    DBG("mtpfs_release(%s, %p)", path, fi);
-    G_LOCK(device_lock);
+    gchar *directory;
+
+    entry->storageid = find_storage(ctx, path);
+    if (entry->storageid < 0)
+        return -ENOENT;
+    // Storage areas stay where they are
+    if (g_strrstr(path + 1, "/") == NULL)
+        return -EACCES;
+    directory = g_path_get_dirname(path);
+    entry->parent_id = lookup_folder_id(ctx, entry->storageid, directory);
+    g_free(directory);
+    if (entry->parent_id == 0xFFFFFFFF)
+        return -ENOENT;
+    entry->name = g_path_get_basename(path);
+    entry->file = find_file(ctx, entry->storageid, entry->parent_id, entry->name);
+    if (entry->file == NULL)
+        entry->folder = find_folder(ctx, entry->storageid, entry->parent_id, entry->name);
+    return 0;
+}
+
+/* Whether a folder holds nothing, it is listed first in lazy mode */
+static gboolean
+folder_empty (MtpfsContext * ctx, int storageid, LIBMTP_folder_t * folder)
+{
+    GHashTable *files;
+
+    populate_dir(ctx, storageid, folder->folder_id);
+    files = file_children(ctx, ctx->storageArea[storageid].storage->id, folder->folder_id, FALSE);
+    return folder->child == NULL && (files == NULL || g_hash_table_size(files) == 0);
+}
+
+/* Give an object another name in its folder, on the device and in the tree */
+static int
+rename_in_place (MtpfsContext * ctx, int storageid, LIBMTP_file_t * file, LIBMTP_folder_t * folder,
+                 const gchar * name)
+{
+    gchar *old_name = g_strdup(file != NULL ? file->filename : folder->name);
+    int ret;
+
+    lock_device(ctx, DEVICE_INTERACTIVE);
+    if (file != NULL)
+        ret = ctx->mtp->set_file_name(ctx->device, file, name);
+    else
+        ret = ctx->mtp->set_folder_name(ctx->device, folder, name);
+    if (ret != 0)
+        dump_mtp_error(ctx->device);
+    unlock_device(ctx, STAT_MTP_SET_NAME);
+    if (ret == 0 && file != NULL)
+        cache_move_file(ctx, file, old_name, file->storage_id, file->parent_id);
+    else if (ret == 0)
+        cache_move_folder(ctx, storageid, folder, old_name, storageid, folder->parent_id);
+    g_free(old_name);
+    return ret;
+}
 
-    assert(fi->fh <= INT_MAX);
+/* Remove the object a rename replaced, once the rename succeeded */
+static void
+delete_replaced (MtpfsContext * ctx, TreeEntry * to)
+{
+    int ret;
+
+    if (to->file != NULL) {
+        delete_file(ctx, to->file->item_id);
+        return;
+    }
+    lock_device(ctx, DEVICE_INTERACTIVE);
+    ret = ctx->mtp->delete_object(ctx->device, to->folder->folder_id);
+    if (ret != 0)
+        dump_mtp_error(ctx->device);
+    unlock_device(ctx, STAT_MTP_DELETE_OBJECT);
+    if (ret != 0)
+        ctx->storageArea[to->storageid].folders_changed = TRUE;
+    else
+        cache_remove_folder(ctx, to->storageid, to->folder->folder_id);
+}
 
+/* Move and rename an object on the device, returns -EXDEV when it is left
+ * untouched so that the caller can copy it instead.  An object of the new
+ * name is renamed aside first and only deleted once the rename is done,
+ * it gets its name back otherwise. */
+static int
+rename_entry (MtpfsContext * ctx, TreeEntry * from, TreeEntry * to)
+{
+    uint32_t item_id = from->file != NULL ? from->file->item_id : from->folder->folder_id;
+    uint32_t storage_id = ctx->storageArea[to->storageid].storage->id;
+    gboolean moved = from->storageid != to->storageid || from->parent_id != to->parent_id;
+    gboolean same = from->file == to->file && from->folder == to->folder;
+    gboolean replacing = !same && (to->file != NULL || to->folder != NULL);
+    gchar *replaced_name = NULL;
     int ret = 0;
-    if (g_hash_table_contains(myfiles, path)) {
-        //find parent id
-        gchar *filename = g_strdup("");
-        gchar **fields;
-        gchar *directory;
-        directory = (gchar *) g_malloc (strlen (path));
-        directory = strcpy (directory, "/");
-        fields = g_strsplit (path, "/", -1);
-        int i;
-        uint32_t parent_id = 0;
-        int storageid;
-        storageid = find_storage(path);
-        for (i = 0; fields[i] != NULL; i++) {
-            if (strlen (fields[i]) > 0) {
-                if (fields[i + 1] == NULL) {
-                    gchar *tmp = g_strndup (directory, strlen (directory) - 1);
-                    parent_id = lookup_folder_id (storageArea[storageid].folders, tmp);
-                    g_free (tmp);
-                    if (parent_id == 0xFFFFFFF)
-                        parent_id = 0;
-                    g_free (filename);
-                    filename = g_strdup (fields[i]);
-                } else {
-                    directory = strcat (directory, fields[i]);
-                    directory = strcat (directory, "/");
-                }
-            }
+
+    // Changing the case of a name finds the object itself
+    if (same && strcmp(from->name, to->name) == 0)
+        return 0;
+    if (!same && to->folder != NULL && from->folder == NULL)
+        return -EISDIR;
+    if (!same && to->file != NULL && from->folder != NULL)
+        return -ENOTDIR;
+    if (from->folder != NULL && from->storageid == to->storageid &&
+        folder_below(ctx, to->storageid, to->parent_id, item_id))
+        return -EINVAL;
+    // An empty folder is replaced, as rename(2) does
+    if (!same && to->folder != NULL && !folder_empty(ctx, to->storageid, to->folder))
+        return -ENOTEMPTY;
+    if (moved && !ctx->move_objects)
+        return -EXDEV;
+
+    if (replacing) {
+        gchar *aside = g_strdup_printf(".mtpfs-replaced-%u",
+                                       to->file != NULL ? to->file->item_id : to->folder->folder_id);
+
+        DBG("rename: setting %s aside", to->name);
+        replaced_name = g_strdup(to->file != NULL ? to->file->filename : to->folder->name);
+        ret = rename_in_place(ctx, to->storageid, to->file, to->folder, aside);
+        g_free(aside);
+        if (ret != 0) {
+            g_free(replaced_name);
+            return -EIO;
         }
-        DBG("%s:%s:%d", filename, directory, parent_id);
+    }
+    if (moved) {
+        lock_device(ctx, DEVICE_INTERACTIVE);
+        ret = ctx->mtp->move_object(ctx->device, item_id, storage_id, to->parent_id);
+        if (ret != 0)
+            dump_mtp_error(ctx->device);
+        unlock_device(ctx, STAT_MTP_MOVE_OBJECT);
+        if (ret != 0)
+            ret = -EXDEV;
+    }
+    if (ret == 0 && strcmp(from->name, to->name) != 0) {
+        lock_device(ctx, DEVICE_INTERACTIVE);
+        if (from->file != NULL)
+            ret = ctx->mtp->set_file_name(ctx->device, from->file, to->name);
+        else
+            ret = ctx->mtp->set_folder_name(ctx->device, from->folder, to->name);
+        if (ret != 0)
+            dump_mtp_error(ctx->device);
+        unlock_device(ctx, STAT_MTP_SET_NAME);
+        // Moved under its old name otherwise
+        ret = ret != 0 ? (moved ? -EIO : -EXDEV) : 0;
+    }
+    if (ret != -EXDEV) {
+        if (from->file != NULL)
+            cache_move_file(ctx, from->file, from->name, storage_id, to->parent_id);
+        else
+            cache_move_folder(ctx, from->storageid, from->folder, from->name, to->storageid, to->parent_id);
+    }
 
-        struct stat st;
-        uint64_t filesize;
-        fstat((int)fi->fh, &st);
-        assert(st.st_size >= 0);
-        filesize = (uint64_t) st.st_size;
-
-        // Setup file
-        LIBMTP_filetype_t filetype;
-        filetype = find_filetype (filename);
-        LIBMTP_file_t *genfile;
-        genfile = LIBMTP_new_file_t ();
-        genfile->filesize = filesize;
-        genfile->filetype = filetype;
-        genfile->filename = g_strdup (filename);
-        genfile->parent_id = (uint32_t) parent_id;
-        genfile->storage_id = storageArea[storageid].storage->id;
-
-        ret = LIBMTP_Send_File_From_File_Descriptor (device, (int)fi->fh,
-                                                     genfile, NULL, NULL);
-        LIBMTP_destroy_file_t (genfile);
+    if (replacing) {
         if (ret == 0) {
-            DBG("Sent %s",path);
+            delete_replaced(ctx, to);
+        } else if (rename_in_place(ctx, to->storageid, to->file, to->folder, replaced_name) != 0) {
+            syslog(LOG_ERR, "Renaming onto %s failed, it was left aside", to->name);
+        }
+        g_free(replaced_name);
+    }
+    return ret;
+}
+
+/* Files and folders, within a device, with MTP's own operations */
+static int
+mtpfs_rename (MtpfsContext * ctx, const char *oldname, const char *newname)
+{
+    TreeEntry from, to;
+    int ret;
+
+    DBG("mtpfs_rename(%s, %s)", oldname, newname);
+    // Lost files are copied out, not moved
+    if (strncmp(oldname, "/lost+found", 11) == 0 || strncmp(newname, "/lost+found", 11) == 0)
+        return -EXDEV;
+    wait_pending_below(ctx, oldname);
+    wait_pending_below(ctx, newname);
+    check_index(ctx);
+    lock_tree_write(ctx);
+
+    memset(&from, 0, sizeof(from));
+    memset(&to, 0, sizeof(to));
+    ret = find_entry(ctx, oldname, &from);
+    if (ret == 0 && from.file == NULL && from.folder == NULL)
+        ret = -ENOENT;
+    if (ret == 0)
+        ret = find_entry(ctx, newname, &to);
+    if (ret == 0)
+        ret = rename_entry(ctx, &from, &to);
+    g_free(from.name);
+    g_free(to.name);
+    return_unlock(ret);
+}
+
+/* Copy a file on the device, the copy must not exist yet.  The tree is
+ * only locked to find the copy among the listed files and to add it. */
+static int
+copy_entry (MtpfsContext * ctx, uint32_t item_id, const gchar * filename, TreeEntry * to)
+{
+    uint32_t storage_id = ctx->storageArea[to->storageid].storage->id;
+    LIBMTP_file_t *file, *next, *created = NULL, *named = NULL;
+    guint uncached = 0;
+    int ret;
+
+    lock_device(ctx, DEVICE_INTERACTIVE);
+    ret = ctx->mtp->copy_object(ctx->device, item_id, storage_id, to->parent_id);
+    if (ret != 0)
+        dump_mtp_error(ctx->device);
+    unlock_device(ctx, STAT_MTP_COPY_OBJECT);
+    if (ret != 0)
+        return -EIO;
+
+    lock_device(ctx, DEVICE_INTERACTIVE);
+    file = ctx->mtp->get_files_and_folders(ctx->device, storage_id,
+                                           to->parent_id == 0 ? LIBMTP_FILES_AND_FOLDERS_ROOT : to->parent_id);
+    unlock_device(ctx, STAT_MTP_FILES_AND_FOLDERS);
+
+    // MTP does not tell the id of the copy, whose name depends on the
+    // device: it is the file of the destination not cached yet.  Should
+    // others have come meanwhile, it is the one of the original name.
+    lock_tree(ctx);
+    for (; file != NULL; file = next) {
+        next = file->next;
+        file->next = NULL;
+        if (file->filetype == LIBMTP_FILETYPE_FOLDER ||
+            g_hash_table_contains(ctx->files, GUINT_TO_POINTER(file->item_id))) {
+            LIBMTP_destroy_file_t(file);
+            continue;
+        }
+        uncached++;
+        if (named == NULL && file->filename != NULL && strcmp(file->filename, filename) == 0) {
+            named = file;
+        } else if (created == NULL) {
+            created = file;
         } else {
-            DBG("Problem sending %s - %d",path,ret);
+            LIBMTP_destroy_file_t(file);
         }
-        // Cleanup
-        g_strfreev (fields);
-        g_free (filename);
-        g_free (directory);
-        // Refresh filelist
-        files_changed = TRUE;
-        g_hash_table_remove(myfiles, path);
     }
-    close((int)fi->fh);
-    G_UNLOCK(device_lock);
+    unlock_tree(ctx);
+    if (created == NULL || uncached > 1) {
+        if (created != NULL)
+            LIBMTP_destroy_file_t(created);
+        created = named;
+    }
+    if (created == NULL) {
+        DBG("copy: copy of %s not found in %d", filename, to->parent_id);
+        lock_tree_write(ctx);
+        ctx->files_changed = TRUE;
+        unlock_tree(ctx);
+        return -EIO;
+    }
+
+    // Some devices report the root as 0xFFFFFFFF
+    created->parent_id = to->parent_id;
+    if (created->filename == NULL || strcmp(created->filename, to->name) != 0) {
+        lock_device(ctx, DEVICE_INTERACTIVE);
+        ret = ctx->mtp->set_file_name(ctx->device, created, to->name);
+        if (ret != 0)
+            dump_mtp_error(ctx->device);
+        unlock_device(ctx, STAT_MTP_SET_NAME);
+        // Copied under the name the device gave it otherwise
+        if (ret != 0)
+            ret = -EIO;
+    }
+    lock_tree_write(ctx);
+    // Devices may reuse the id of a deleted object
+    block_cache_invalidate(ctx, created->item_id);
+    cache_add_file(ctx, created);
+    unlock_tree(ctx);
     return ret;
 }
 
-static void
-mtpfs_destroy ()
+/* Server-side copy, FUSE 2 has no copy_file_range: setting COPY_XATTR on
+ * a file copies it within the device, without transferring its content */
+static int
+mtpfs_copy (MtpfsContext * ctx, const char *path, const char *copy)
 {
-    DBG("mtpfs_destroy()");
-    G_LOCK(device_lock);
+    TreeEntry from, to;
+    uint32_t item_id = 0;
+    gchar *filename = NULL;
+    int ret;
 
-    if (files) free_files(files);
-    int i;
-    for (i = 0; i < MAX_STORAGE_AREA; ++i) {
-        if (storageArea[i].folders) LIBMTP_destroy_folder_t(storageArea[i].folders);
+    DBG("mtpfs_copy(%s, %s)", path, copy);
+    if (!ctx->copy_objects)
+        return -ENOTSUP;
+    wait_pending(ctx, path, FALSE);
+    wait_pending(ctx, copy, FALSE);
+    check_index(ctx);
+    lock_tree_write(ctx);
+
+    memset(&from, 0, sizeof(from));
+    memset(&to, 0, sizeof(to));
+    ret = find_entry(ctx, path, &from);
+    if (ret == 0 && from.file == NULL)
+        ret = from.folder != NULL ? -EISDIR : -ENOENT;
+    if (ret == 0)
+        ret = find_entry(ctx, copy, &to);
+    if (ret == 0 && (to.file != NULL || to.folder != NULL))
+        ret = -EEXIST;
+    if (ret == 0) {
+        item_id = from.file->item_id;
+        filename = g_strdup(from.file->filename);
     }
-    if (device) LIBMTP_Release_Device (device);
-    return_unlock();
+    unlock_tree(ctx);
+
+    // Lookups and other requests go on while the device copies
+    if (ret == 0)
+        ret = copy_entry(ctx, item_id, filename, &to);
+    g_free(filename);
+    g_free(from.name);
+    g_free(to.name);
+    return ret;
 }
 
 static int
-mtpfs_readdir (const gchar * path, void *buf, fuse_fill_dir_t filler,
-               off_t offset, struct fuse_file_info *fi)
+mtpfs_statvfs (MtpfsContext * ctx, const char *path, struct statvfs *stbuf)
 {
-    LIBMTP_folder_t *folder;
+    int storage_id = -1;
 
-    DBG("mtpfs_readdir(%s, %p, %p, %lli, %p)", path, buf, filler, offset, fi);
-    G_LOCK(device_lock);
+    DBG("mtpfs_statvfs(%s, %p)", path, stbuf);
 
-    // Add common entries
-    filler (buf, ".", NULL, 0);
-    filler (buf, "..", NULL, 0);
+    stbuf->f_bsize = 1024;
 
-    // If in root directory
-    if (strcmp(path,"/") == 0) {
-        if (lostfiles != NULL) {
-            filler (buf, "lost+found", NULL, 0);
+    storage_id = find_storage(ctx, path);
+    if (storage_id == -1) {
+        stbuf->f_blocks = 0;
+        stbuf->f_bfree = 0;
+        stbuf->f_ffree = 0;
+        for (storage_id = 0; storage_id < MAX_STORAGE_AREA; ++storage_id) {
+            if (ctx->storageArea[storage_id].storage != NULL) {
+                stbuf->f_blocks += ctx->storageArea[storage_id].storage->MaxCapacity / 1024;
+                stbuf->f_bfree  += ctx->storageArea[storage_id].storage->FreeSpaceInBytes /1024;
+                stbuf->f_ffree  += ctx->storageArea[storage_id].storage->FreeSpaceInObjects;
+            }
         }
-        LIBMTP_devicestorage_t *storage;
-        for (storage = device->storage; storage != 0; storage = storage->next) {
-            struct stat st;
-            memset (&st, 0, sizeof (st));
-            st.st_nlink = 2;
-            st.st_ino = storage->id;
-            st.st_mode = S_IFREG | 0555;
-            filler (buf, storage->StorageDescription, &st, 0);
+    } else {
+        stbuf->f_blocks = ctx->storageArea[storage_id].storage->MaxCapacity / 1024;
+        stbuf->f_bfree  = ctx->storageArea[storage_id].storage->FreeSpaceInBytes / 1024;
+        stbuf->f_ffree  = ctx->storageArea[storage_id].storage->FreeSpaceInObjects;
+    }
+    stbuf->f_bavail = stbuf->f_bfree;
+    return 0;
+}
+
+/* Write-back: report the uploads of the file, or of the files closed in
+ * the directory, once over.  A new file is only queued when released,
+ * after its own flush.  fsync forgets a failure it reported, flush runs
+ * on every close, of readers too, and leaves it for fsync to report. */
+static int
+mtpfs_fsync (MtpfsContext * ctx, const char *path, int datasync, struct fuse_file_info *fi)
+{
+    DBG("mtpfs_fsync(%s, %d, %p)", path, datasync, fi);
+    return wait_pending(ctx, path, TRUE);
+}
+
+static int
+mtpfs_flush (MtpfsContext * ctx, const char *path, struct fuse_file_info *fi)
+{
+    DBG("mtpfs_flush(%s, %p)", path, fi);
+    return wait_pending(ctx, path, FALSE);
+}
+
+static void
+mtpfs_init (void *data, struct fuse_conn_info *conn)
+{
+    MtpfsContext *ctx;
+
+    DBG("mtpfs_init");
+#if FUSE_USE_VERSION >= 30
+    // Every listing carries the attributes, not only the first of a directory
+    if (conn->capable & FUSE_CAP_READDIRPLUS) {
+        conn->want |= FUSE_CAP_READDIRPLUS;
+        conn->want &= ~FUSE_CAP_READDIRPLUS_AUTO;
+    }
+#endif
+    // Threads do not survive daemonizing, start them here
+    for (ctx = data; ctx != NULL; ctx = ctx->next) {
+        if (ctx->partial_read && block_cache.max_size >= 2 * CACHE_BLOCK_SIZE) {
+            ctx->readahead_queue = g_async_queue_new();
+            ctx->readahead_thread = g_thread_new("readahead", readahead_worker, ctx);
         }
-        return_unlock(0);
+        if (write_back)
+            ctx->writeback_thread = g_thread_new("writeback", writeback_worker, ctx);
+        if (ctx->tree_from_index)
+            ctx->revalidate_thread = g_thread_new("revalidate", revalidate_worker, ctx);
     }
+    DBG("Ready");
+}
 
-    // Are we looking at lost+found dir?
-    if (strncmp (path, "/lost+found",11) == 0) {
-        check_files ();
-        GSList *item;
+/* Several devices: each one is a subdirectory of the root, operations go
+ * to the context named by the first component of their path */
 
-        for (item = lostfiles; item != NULL; item = g_slist_next (item) ) {
-            LIBMTP_file_t *file = (LIBMTP_file_t *) item->data;
+static gboolean
+is_stats_path (const gchar * path)
+{
+    gsize len = strlen(STATS_DIR);
 
-            struct stat st;
-            memset (&st, 0, sizeof (st));
-            st.st_ino = file->item_id;
-            st.st_mode = S_IFREG | 0444;
-            if (filler (buf, (file->filename == NULL ? "<mtpfs null>" : file->filename), &st, 0))
-                break;
+    return strncmp(path, STATS_DIR, len) == 0 && (path[len] == '\0' || path[len] == '/');
+}
+
+/* The context of a path, which is made relative to the device.  NULL for
+ * the root and unknown devices. */
+static MtpfsContext *
+route (const gchar ** path)
+{
+    MtpfsContext *ctx = contexts;
+    const gchar *name = *path + 1, *rest;
+    gsize len;
+
+    // Statistics are global, the first context answers for them
+    if (ctx->name == NULL || is_stats_path(*path))
+        return ctx;
+    rest = strchr(name, '/');
+    len = rest != NULL ? (gsize) (rest - name) : strlen(name);
+    for (; ctx != NULL; ctx = ctx->next) {
+        if (strlen(ctx->name) == len && strncmp(ctx->name, name, len) == 0) {
+            *path = rest != NULL ? rest : "/";
+            return ctx;
         }
-        return_unlock(0);
     }
+    return NULL;
+}
 
-    // Get storage area
-    int storageid = -1;
-    storageid=find_storage(path);
-    // Get folder listing.
-    uint32_t folder_id = 0;
-    if (strcmp (path, "/") != 0) {
-        check_folders();
-        folder_id = lookup_folder_id (storageArea[storageid].folders, path);
+typedef struct
+{
+    void *buf;
+    DirFiller filler;
+    MtpfsContext *ctx;
+} DeviceDir;
+
+static int
+device_filler (void *data, const char *name, const struct stat *st, off_t off)
+{
+    DeviceDir *dir = data;
+    struct stat copy;
+
+    if (st != NULL) {
+        copy = *st;
+        copy.st_ino = device_inode(dir->ctx, st->st_ino);
+        st = &copy;
     }
+    return dir->filler(dir->buf, name, st, off);
+}
 
-    DBG("Checking folders for %d on %d", folder_id, storageid);
-    check_folders();
-    if (folder_id == 0) {
-        DBG("Root of storage area");
-        folder=storageArea[storageid].folders;
-    } else {
-        folder = LIBMTP_Find_Folder (storageArea[storageid].folders, folder_id);
-        if (folder == NULL) return_unlock(0);
-        folder = folder->child;
+static int
+root_readdir (void *buf, DirFiller filler)
+{
+    MtpfsContext *ctx;
+    struct stat st;
+
+    filler (buf, ".", NULL, 0);
+    filler (buf, "..", NULL, 0);
+    for (ctx = contexts; ctx != NULL; ctx = ctx->next) {
+        dir_stat (DEVICE_DIR_INODE(ctx->index), &st);
+        if (filler (buf, ctx->name, &st, 0))
+            break;
     }
+    return 0;
+}
 
-    while (folder != NULL) {
-        if (folder->parent_id == folder_id) {
-            if (folder_id == 0 && (folder->storage_id != storageArea[storageid].storage->id)) {
-                goto next_1;
-            }
-            DBG("found folder: %s, id %d", folder->name, folder->folder_id);
-            struct stat st;
-            memset (&st, 0, sizeof (st));
-            st.st_ino = folder->folder_id;
-            st.st_mode = S_IFDIR | 0777;
-            if (filler (buf, folder->name, &st, 0))
-                break;
-        }
-next_1:
-        folder = folder->sibling;
+static int
+root_statvfs (struct statvfs *stbuf)
+{
+    MtpfsContext *ctx;
+    struct statvfs device;
+
+    memset(stbuf, 0, sizeof(struct statvfs));
+    stbuf->f_bsize = 1024;
+    for (ctx = contexts; ctx != NULL; ctx = ctx->next) {
+        mtpfs_statvfs(ctx, "/", &device);
+        stbuf->f_blocks += device.f_blocks;
+        stbuf->f_bfree += device.f_bfree;
+        stbuf->f_ffree += device.f_ffree;
     }
-    DBG("Checking folders end");
-    LIBMTP_destroy_folder_t (folder);
-    DBG("Checking files");
-    // Find files
-    LIBMTP_file_t *file;
-    check_files();
-    file = files;
-    while (file != NULL) {
-        if (file->parent_id == folder_id) {
-            if (folder_id == 0 && (file->storage_id != storageArea[storageid].storage->id)) {
-                goto next_2;
-            }
-            struct stat st;
-            memset (&st, 0, sizeof (st));
-            st.st_ino = file->item_id;
-            st.st_mode = S_IFREG | 0444;
-            if (filler (buf, (file->filename == NULL ? "<mtpfs null>" : file->filename), &st, 0))
-                break;
-        }
-next_2:
-        file = file->next;
+    stbuf->f_bavail = stbuf->f_bfree;
+    return 0;
+}
+
+/* Operations as seen by FUSE, timed for the statistics */
+#define TIMED(timer, call)     do { gint64 start = g_get_monotonic_time(); \
+                                    int ret = call; stats_time(timer, start); return ret; } while(0)
+
+static int
+timed_release (const char *path, struct fuse_file_info *fi)
+{
+    MtpfsContext *ctx = route(&path);
+
+    if (ctx == NULL)
+        return -ENOENT;
+    TIMED(STAT_OP_RELEASE, mtpfs_release(ctx, path, fi));
+}
+
+static int
+timed_readdir (const gchar * path, void *buf, DirFiller filler, off_t offset,
+               struct fuse_file_info *fi)
+{
+    MtpfsContext *ctx = route(&path);
+    DeviceDir dir = { buf, filler, ctx };
+
+    if (ctx == NULL)
+        return strcmp(path, "/") == 0 ? root_readdir(buf, filler) : -ENOENT;
+    if (ctx->name != NULL) {
+        buf = &dir;
+        filler = device_filler;
     }
-    DBG("readdir exit");
-    return_unlock(0);
+    TIMED(STAT_OP_READDIR, mtpfs_readdir(ctx, path, buf, filler, offset, fi));
+}
+
+static int
+route_getattr (const gchar * path, struct stat *stbuf)
+{
+    MtpfsContext *ctx = route(&path);
+
+    if (ctx == NULL && strcmp(path, "/") == 0) {
+        dir_stat(ROOT_INODE, stbuf);
+        return 0;
+    }
+    if (ctx == NULL)
+        return -ENOENT;
+    return mtpfs_getattr(ctx, path, stbuf);
+}
+
+static int
+timed_open (const gchar * path, struct fuse_file_info *fi)
+{
+    MtpfsContext *ctx = route(&path);
+
+    if (ctx == NULL)
+        return -ENOENT;
+    TIMED(STAT_OP_OPEN, mtpfs_open(ctx, path, fi));
+}
+
+static int
+timed_mknod (const gchar * path, mode_t mode, dev_t dev)
+{
+    MtpfsContext *ctx = route(&path);
+
+    // Devices are not created
+    if (ctx == NULL)
+        return -EACCES;
+    TIMED(STAT_OP_MKNOD, mtpfs_mknod(ctx, path, mode, dev));
+}
+
+static int
+timed_read (const gchar * path, gchar * buf, size_t size, off_t offset,
+            struct fuse_file_info *fi)
+{
+    MtpfsContext *ctx = route(&path);
+
+    if (ctx == NULL)
+        return -ENOENT;
+    TIMED(STAT_OP_READ, mtpfs_read(ctx, path, buf, size, offset, fi));
+}
+
+static int
+timed_write (const gchar * path, const gchar * buf, size_t size, off_t offset,
+             struct fuse_file_info *fi)
+{
+    TIMED(STAT_OP_WRITE, mtpfs_write(path, buf, size, offset, fi));
+}
+
+static int
+timed_truncate (const gchar * path, off_t size)
+{
+    MtpfsContext *ctx = route(&path);
+
+    if (ctx == NULL)
+        return -ENOENT;
+    TIMED(STAT_OP_TRUNCATE, mtpfs_truncate(ctx, path, size));
+}
+
+static int
+timed_ftruncate (const gchar * path, off_t size, struct fuse_file_info *fi)
+{
+    MtpfsContext *ctx = route(&path);
+
+    if (ctx == NULL)
+        return -ENOENT;
+    TIMED(STAT_OP_FTRUNCATE, mtpfs_ftruncate(ctx, path, size, fi));
+}
+
+#if FUSE_VERSION >= 29
+static int
+timed_fallocate (const gchar * path, int mode, off_t offset, off_t length,
+                 struct fuse_file_info *fi)
+{
+    MtpfsContext *ctx = route(&path);
+
+    if (ctx == NULL)
+        return -ENOENT;
+    TIMED(STAT_OP_FALLOCATE, mtpfs_fallocate(ctx, path, mode, offset, length, fi));
+}
+#endif
+
+static int
+timed_unlink (const gchar * path)
+{
+    MtpfsContext *ctx = route(&path);
+
+    if (ctx == NULL)
+        return -ENOENT;
+    TIMED(STAT_OP_UNLINK, mtpfs_unlink(ctx, path));
+}
+
+static int
+timed_mkdir (const char *path, mode_t mode)
+{
+    MtpfsContext *ctx = route(&path);
+
+    if (ctx == NULL)
+        return -EACCES;
+    TIMED(STAT_OP_MKDIR, mtpfs_mkdir(ctx, path, mode));
+}
+
+static int
+timed_rmdir (const char *path)
+{
+    MtpfsContext *ctx = route(&path);
+
+    if (ctx == NULL)
+        return -ENOENT;
+    TIMED(STAT_OP_RMDIR, mtpfs_rmdir(ctx, path));
 }
 
 static int
-mtpfs_getattr_real (const gchar * path, struct stat *stbuf)
+timed_rename (const char *oldname, const char *newname)
 {
-    int ret = 0;
+    MtpfsContext *ctx = route(&oldname);
 
-    DBG_F("mtpfs_getattr_real(%s, %p)", path, stbuf);
+    if (ctx == NULL)
+        return -ENOENT;
+    if (route(&newname) != ctx)
+        return -EXDEV;
+    TIMED(STAT_OP_RENAME, mtpfs_rename(ctx, oldname, newname));
+}
 
-    if (path == NULL) return_unlock(-ENOENT);
-    memset (stbuf, 0, sizeof (struct stat));
+static int
+timed_fsync (const char *path, int datasync, struct fuse_file_info *fi)
+{
+    MtpfsContext *ctx = route(&path);
 
-    // Set uid/gid of file
-    struct fuse_context *fc;
-    fc = fuse_get_context();
-    stbuf->st_uid = fc->uid;
-    stbuf->st_gid = fc->gid;
-    if (strcmp (path, "/") == 0) {
-        stbuf->st_mode = S_IFDIR | 0777;
-        stbuf->st_nlink = 2;
-        return_unlock(0);
-    }
+    if (ctx == NULL)
+        return 0;
+    TIMED(STAT_OP_FSYNC, mtpfs_fsync(ctx, path, datasync, fi));
+}
 
-    // Check cached files first (stuff that hasn't been written to dev yet)
-    if (g_hash_table_contains(myfiles, path)) {
-        stbuf->st_mode = S_IFREG | 0777;
-        stbuf->st_size = 0;
-        stbuf->st_blocks = 2;
-        stbuf->st_mtime = time(NULL);
-        return_unlock(0);
-    }
+static int
+timed_flush (const char *path, struct fuse_file_info *fi)
+{
+    MtpfsContext *ctx = route(&path);
 
-    // Special case directory 'Playlists', 'lost+found'
-    // Special case root directory items
-    if (g_strrstr(path+1,"/") == NULL) {
-        stbuf->st_mode = S_IFDIR | 0777;
-        stbuf->st_nlink = 2;
-        return_unlock(0);
-    }
+    if (ctx == NULL)
+        return 0;
+    TIMED(STAT_OP_FLUSH, mtpfs_flush(ctx, path, fi));
+}
 
-    int storageid;
-    storageid=find_storage(path);
+static int
+timed_fsyncdir (const char *path, int datasync, struct fuse_file_info *fi)
+{
+    MtpfsContext *ctx = route(&path);
 
-    if (strncasecmp (path, "/lost+found",11) == 0) {
-        GSList *item;
-        uint32_t item_id = parse_path (path);
-        if (item_id == 0xFFFFFFFF) {
-            DBG("mtpfs_getattr_real: not found (%s)", path);
-            return_unlock(-ENOENT);
-        }
-        for (item = lostfiles; item != NULL; item = g_slist_next (item)) {
-            LIBMTP_file_t *file = (LIBMTP_file_t *) item->data;
+    if (ctx == NULL)
+        return 0;
+    TIMED(STAT_OP_FSYNC, mtpfs_fsync(ctx, path, datasync, fi));
+}
 
-            if (item_id == file->item_id) {
-                stbuf->st_ino = item_id;
-                assert(file->filesize <= INT64_MAX);
-                stbuf->st_size = (int64_t) file->filesize;
-                stbuf->st_blocks = (file->filesize / 512) +
-                    (file->filesize % 512 > 0 ? 1 : 0);
-                stbuf->st_nlink = 1;
-                stbuf->st_mode = S_IFREG | 0777;
-                stbuf->st_mtime = file->modificationdate;
-                return_unlock(0);
-            }
-        }
+static int
+timed_setxattr (const char *path, const char *name, const char *value, size_t size, int flags)
+{
+    MtpfsContext *ctx;
+    gchar *given, *copy, *directory;
+    const gchar *target;
+    gint64 start;
+    int ret;
 
-        return_unlock(-ENOENT);
+    if (strcmp(name, COPY_XATTR) != 0)
+        return -ENOTSUP;
+    // A relative path names a copy in the directory of the file
+    given = g_strndup(value, size);
+    if (*given == '/') {
+        copy = given;
+    } else {
+        directory = g_path_get_dirname(path);
+        copy = g_build_filename(directory, given, NULL);
+        g_free(directory);
+        g_free(given);
     }
-
-    uint32_t item_id = 0xFFFFFFF;
-    check_folders();
-    item_id = lookup_folder_id (storageArea[storageid].folders, path);
-    if (item_id != 0xFFFFFFFF) {
-        // Must be a folder
-        stbuf->st_ino = item_id;
-        stbuf->st_mode = S_IFDIR | 0777;
-        stbuf->st_nlink = 2;
+    target = copy;
+    ctx = route(&path);
+    if (ctx == NULL) {
+        ret = -ENOENT;
+    } else if (route(&target) != ctx) {
+        ret = -EXDEV;
     } else {
-        // Must be a file
-        item_id = parse_path (path);
-        DBG("id:path=%d:%s", item_id, path);
-        if (item_id == 0xFFFFFFFF) {
-            DBG("mtpfs_getattr_real: not found (%s)", path);
-            return_unlock(-ENOENT);
-        }
-        check_files();
-        LIBMTP_file_t *file;
-        file = files;
-        gboolean found = FALSE;
-        while (file != NULL) {
-            if (file->item_id == item_id) {
-                stbuf->st_ino = item_id;
-                assert(file->filesize <= INT64_MAX);
-                stbuf->st_size = (int64_t) file->filesize;
-                stbuf->st_blocks = (file->filesize / 512) +
-                    (file->filesize % 512 > 0 ? 1 : 0);
-                stbuf->st_nlink = 1;
-                stbuf->st_mode = S_IFREG | 0777;
-                DBG("time:%s",ctime(&(file->modificationdate)));
-                stbuf->st_mtime = file->modificationdate;
-                stbuf->st_ctime = file->modificationdate;
-                stbuf->st_atime = file->modificationdate;
-                found = TRUE;
-            }
-            file = file->next;
-        }
-        if (!found) {
-            ret = -ENOENT;
-        }
+        start = g_get_monotonic_time();
+        ret = mtpfs_copy(ctx, path, target);
+        stats_time(STAT_OP_SETXATTR, start);
     }
-
+    g_free(copy);
     return ret;
 }
 
 static int
-mtpfs_getattr (const gchar * path, struct stat *stbuf)
+timed_statvfs (const char *path, struct statvfs *stbuf)
 {
-    DBG("mtpfs_getattr(%s, %p)", path, stbuf);
-    G_LOCK(device_lock);
+    MtpfsContext *ctx = route(&path);
 
-    int ret = mtpfs_getattr_real (path, stbuf);
+    if (ctx == NULL)
+        return strcmp(path, "/") == 0 ? root_statvfs(stbuf) : -ENOENT;
+    TIMED(STAT_OP_STATFS, mtpfs_statvfs(ctx, path, stbuf));
+}
 
-    DBG("getattr exit");
-    return_unlock(ret);
+/* Low-level API: the kernel walks paths one component at a time and
+ * keeps what it looked up, the operations name the nodes it was given */
+
+static guint
+node_name_hash (gconstpointer data)
+{
+    const Node *node = data;
+
+    return g_direct_hash(node->parent) ^ g_str_hash(node->name);
 }
 
-static int
-mtpfs_mknod (const gchar * path, mode_t mode, dev_t dev)
+static gboolean
+node_name_equal (gconstpointer a, gconstpointer b)
 {
-    DBG("mtpfs_mknod(%s, %u, %llu)", path, mode, dev);
-    G_LOCK(device_lock);
+    const Node *x = a, *y = b;
 
-    if (g_hash_table_contains(myfiles, path))
-        return_unlock(-EEXIST);
-    uint32_t item_id = parse_path (path);
-    if (item_id != 0xFFFFFFFF)
-        return_unlock(-EEXIST);
-    g_hash_table_insert(myfiles, g_strdup(path), NULL);
-    DBG("NEW FILE");
-    return_unlock(0);
+    return x->parent == y->parent && strcmp(x->name, y->name) == 0;
 }
 
-static int
-mtpfs_open (const gchar * path, struct fuse_file_info *fi)
+static void
+init_nodes (void)
 {
-    uint32_t item_id;
+    Node *root = g_new0(Node, 1);
+
+    nodes = g_hash_table_new(g_int64_hash, g_int64_equal);
+    node_names = g_hash_table_new(node_name_hash, node_name_equal);
+    // Never forgotten
+    root->ino = FUSE_ROOT_ID;
+    root->inode = ROOT_INODE;
+    root->name = g_strdup("");
+    root->nlookup = 1;
+    root->storageid = -1;
+    g_hash_table_insert(nodes, &root->ino, root);
+}
 
-    DBG("mtpfs_open(%s, %p)", path, fi);
-    G_LOCK(device_lock);
+static Node *
+find_node (uint64_t ino)
+{
+    return g_hash_table_lookup(nodes, &ino);
+}
 
-    item_id = parse_path (path);
-    if ((item_id == 0xFFFFFFFF) && (!(g_hash_table_contains(myfiles, path)))) {
-        return_unlock(-ENOENT);
+/* The node is no longer found under its name, it keeps it for its path */
+static void
+unlink_node (Node * node)
+{
+    if (node->linked)
+        g_hash_table_remove(node_names, node);
+    node->linked = FALSE;
+}
+
+/* Free a node the kernel forgot, and the parents only it kept */
+static void
+drop_node (Node * node)
+{
+    Node *parent;
+
+    while (node->parent != NULL && node->nlookup == 0 && node->children == 0) {
+        parent = node->parent;
+        unlink_node(node);
+        g_hash_table_remove(nodes, &node->ino);
+        parent->children--;
+        g_free(node->name);
+        g_free(node);
+        node = parent;
     }
-    if (item_id == 0) {
-        DBG("Trying to open root");
-        return_unlock(-EPERM);
+}
+
+/* Find node under name in parent, instead of a node found there before */
+static void
+link_node (Node * node, Node * parent, const gchar * name)
+{
+    Node *other, *old = node->parent;
+
+    unlink_node(node);
+    g_free(node->name);
+    node->name = g_strdup(name);
+    if (old != parent) {
+        node->parent = parent;
+        parent->children++;
     }
-    if (g_hash_table_lookup(myfiles, path) != NULL) {
-        return_unlock(-EBUSY);
+    other = g_hash_table_lookup(node_names, node);
+    if (other != NULL)
+        unlink_node(other);
+    g_hash_table_add(node_names, node);
+    node->linked = TRUE;
+    if (old != NULL && old != parent) {
+        old->children--;
+        drop_node(old);
     }
+}
 
-    if (fi->flags == O_RDONLY) {
-        DBG("read");
-    } else if (fi->flags == O_WRONLY) {
-        DBG("write");
-    } else if (fi->flags == O_RDWR) {
-        DBG("rdwrite");
+/* What a new node is, from its inode: folders and files of the tree are
+ * then found by id instead of by path */
+static void
+identify_node (Node * node, MtpfsContext * ctx, const struct stat *st)
+{
+    uint64_t inode = LOCAL_INODE((uint64_t) st->st_ino);
+    int i;
+
+    node->ctx = ctx;
+    node->by_id = FALSE;
+    node->folder = FALSE;
+    node->storageid = -1;
+    node->object_id = 0;
+    if (ctx == NULL)
+        return;
+    if (inode == OBJECT_INODE((uint32_t) inode)) {
+        // Only folders of a storage area are found by id, files anywhere
+        node->folder = S_ISDIR(st->st_mode);
+        node->storageid = node->folder ? node->parent->storageid : -1;
+        node->object_id = (uint32_t) inode;
+        node->by_id = !node->folder || node->storageid >= 0;
+    } else if (inode == STORAGE_INODE((uint32_t) inode)) {
+        for (i = 0; i < MAX_STORAGE_AREA; ++i) {
+            if (ctx->storageArea[i].storage != NULL &&
+                ctx->storageArea[i].storage->id == (uint32_t) inode)
+                node->storageid = i;
+        }
+        node->folder = TRUE;
+        node->by_id = node->storageid >= 0;
     }
+}
 
-    FILE *filetmp = tmpfile ();
-    int tmpfile_fd = fileno (filetmp);
-    if (tmpfile_fd != -1) {
-        if (item_id == 0xFFFFFFFF) {
-            g_hash_table_replace(myfiles, g_strdup(path), (void*)1);
-            fi->fh = (unsigned long long) tmpfile_fd;
+/* Count a lookup of name in parent, found with the attributes st on the
+ * device ctx, and return the node id given to the kernel: the inode of
+ * the entry.  An object found under another name was moved, its node
+ * follows it.  New files only have a hash of their path, one already
+ * taken gets a spare node id. */
+static uint64_t
+remember_node (fuse_ino_t parent_ino, const gchar * name, MtpfsContext * ctx,
+               const struct stat *st)
+{
+    Node key, *parent, *node;
+    uint64_t inode = st->st_ino;
+
+    g_mutex_lock(&nodes_lock);
+    parent = find_node(parent_ino);
+    key.parent = parent;
+    key.name = (gchar *) name;
+    node = g_hash_table_lookup(node_names, &key);
+    if (node != NULL && node->inode != inode) {
+        // Replaced, the old node lasts until forgotten
+        unlink_node(node);
+        node = NULL;
+    }
+    if (node == NULL) {
+        node = find_node(inode);
+        if (node != NULL && node->by_id) {
+            // Moved, by a rename or on the device
+            link_node(node, parent, name);
         } else {
-            int ret = LIBMTP_Get_File_To_File_Descriptor (device, item_id, tmpfile_fd, NULL, NULL);
-            if (ret == 0) {
-                fi->fh = (unsigned long long)tmpfile_fd;
-            } else {
-                return_unlock(-ENOENT);
-            }
+            node = g_new0(Node, 1);
+            node->ino = find_node(inode) != NULL ? SPARE_INODE(++spare_inodes) : inode;
+            node->inode = inode;
+            link_node(node, parent, name);
+            g_hash_table_insert(nodes, &node->ino, node);
         }
-    } else {
-        return_unlock(-ENOENT);
+        identify_node(node, ctx, st);
     }
+    node->nlookup++;
+    g_mutex_unlock(&nodes_lock);
+    return node->ino;
+}
 
-    return_unlock(0);
+static void
+forget_node (uint64_t ino, uint64_t nlookup)
+{
+    Node *node;
+
+    g_mutex_lock(&nodes_lock);
+    node = find_node(ino);
+    if (node != NULL) {
+        node->nlookup -= MIN(nlookup, node->nlookup);
+        drop_node(node);
+    }
+    g_mutex_unlock(&nodes_lock);
+}
+
+/* Path of a node within the mount point, with name appended if given */
+static gchar *
+node_path (Node * node, const gchar * name)
+{
+    GPtrArray *names = g_ptr_array_new();
+    GString *path = g_string_new(NULL);
+    guint i;
+
+    for (; node->parent != NULL; node = node->parent)
+        g_ptr_array_add(names, node->name);
+    for (i = names->len; i > 0; i--) {
+        g_string_append_c(path, '/');
+        g_string_append(path, g_ptr_array_index(names, i - 1));
+    }
+    if (name != NULL) {
+        g_string_append_c(path, '/');
+        g_string_append(path, name);
+    }
+    if (path->len == 0)
+        g_string_append_c(path, '/');
+    g_ptr_array_free(names, TRUE);
+    return g_string_free(path, FALSE);
+}
+
+static void
+get_node (fuse_ino_t ino, const gchar * name, NodeInfo * info)
+{
+    Node *node;
+
+    memset(info, 0, sizeof(NodeInfo));
+    g_mutex_lock(&nodes_lock);
+    node = find_node(ino);
+    if (node != NULL) {
+        info->path = node_path(node, name);
+        info->ino = node->ino;
+        info->parent_ino = node->parent != NULL ? node->parent->ino : node->ino;
+        info->ctx = node->ctx;
+        info->by_id = node->by_id;
+        info->folder = node->folder;
+        info->storageid = node->storageid;
+        info->object_id = node->object_id;
+    }
+    g_mutex_unlock(&nodes_lock);
 }
 
+/* Attributes of a node, by id when it is an object of the tree */
 static int
-mtpfs_read (const gchar * path, gchar * buf, size_t size, off_t offset,
-            struct fuse_file_info *fi)
+node_getattr (NodeInfo * info, struct stat *stbuf)
 {
-    int ret;
+    int ret = -ENOENT;
+
+    if (info->path == NULL)
+        return -ENOENT;
+    if (info->by_id)
+        ret = mtpfs_getattr_id(info->ctx, info->storageid, info->object_id, info->folder, stbuf);
+    if (ret == -ENOENT)
+        ret = route_getattr(info->path, stbuf);
+    return ret;
+}
 
-    DBG("mtpfs_read(%s, %p, %zu, %llu, %p)", path, buf, size, offset, fi);
-    G_LOCK(device_lock);
+/* Reply to the lookup of name in parent, or to its creation */
+static void
+reply_entry (fuse_req_t req, fuse_ino_t parent, const gchar * name, const gchar * path,
+             int ret, struct stat *st)
+{
+    struct fuse_entry_param entry;
 
-    assert(fi->fh <= INT_MAX);
-    if ((int)fi->fh != -1) {
-        ret = pread ((int)fi->fh, buf, size, offset);
-        if (ret == -1)
-            ret = -errno;
-    } else {
+    if (ret != 0) {
+        fuse_reply_err(req, -ret);
+        return;
+    }
+    memset(&entry, 0, sizeof(entry));
+    entry.ino = remember_node(parent, name, route(&path), st);
+    entry.attr = *st;
+    entry.attr_timeout = attr_timeout;
+    entry.entry_timeout = entry_timeout;
+    if (fuse_reply_entry(req, &entry) != 0)
+        forget_node(entry.ino, 1);
+}
+
+static void
+ll_lookup (fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    gint64 start = g_get_monotonic_time();
+    struct fuse_entry_param entry;
+    const gchar *path;
+    MtpfsContext *ctx;
+    NodeInfo info;
+    struct stat st;
+    int ret;
+
+    get_node(parent, name, &info);
+    path = info.path;
+    ctx = path != NULL ? route(&path) : NULL;
+    // Within a folder already looked up, only the name is resolved
+    if (ctx != NULL && info.by_id && info.folder)
+        ret = mtpfs_lookup(ctx, path, info.storageid, info.object_id, &st);
+    else if (info.path != NULL)
+        ret = route_getattr(info.path, &st);
+    else
         ret = -ENOENT;
+    stats_time(STAT_OP_LOOKUP, start);
+    if (ret == -ENOENT && negative_timeout > 0) {
+        // The kernel remembers the name is missing
+        memset(&entry, 0, sizeof(entry));
+        entry.entry_timeout = negative_timeout;
+        fuse_reply_entry(req, &entry);
+    } else {
+        reply_entry(req, parent, name, info.path, ret, &st);
     }
+    g_free(info.path);
+}
 
-    return_unlock(ret);
+#if FUSE_USE_VERSION >= 30
+static void
+ll_forget (fuse_req_t req, fuse_ino_t ino, uint64_t nlookup)
+#else
+static void
+ll_forget (fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
+#endif
+{
+    forget_node(ino, nlookup);
+    fuse_reply_none(req);
 }
 
-static int
-mtpfs_write (const gchar * path, const gchar * buf, size_t size, off_t offset,
-             struct fuse_file_info *fi)
+static void
+ll_getattr (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
+    gint64 start = g_get_monotonic_time();
+    NodeInfo info;
+    struct stat st;
     int ret;
 
-    DBG("mtpfs_write(%s, %p, %zu, %llu, %p)", path, buf, size, offset, fi);
-    G_LOCK(device_lock);
+    get_node(ino, NULL, &info);
+    ret = node_getattr(&info, &st);
+    stats_time(STAT_OP_GETATTR, start);
+    if (ret == 0)
+        fuse_reply_attr(req, &st, attr_timeout);
+    else
+        fuse_reply_err(req, -ret);
+    g_free(info.path);
+}
 
-    assert(fi->fh <= INT_MAX);
-    if (fi->fh != (uint64_t) -1) {
-        ret = pwrite ((int)fi->fh, buf, size, offset);
-    } else {
+/* Modes are accepted and ignored, owners and times are not supported */
+static void
+ll_setattr (fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set,
+            struct fuse_file_info *fi)
+{
+    NodeInfo info;
+    struct stat st;
+    int ret = 0;
+
+    get_node(ino, NULL, &info);
+    if (info.path == NULL)
         ret = -ENOENT;
-    }
+    else if (to_set & (FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID | FUSE_SET_ATTR_ATIME |
+                       FUSE_SET_ATTR_MTIME | FUSE_SET_ATTR_ATIME_NOW | FUSE_SET_ATTR_MTIME_NOW))
+        ret = -ENOSYS;
+    else if ((to_set & FUSE_SET_ATTR_SIZE) && fi != NULL)
+        ret = timed_ftruncate(info.path, attr->st_size, fi);
+    else if (to_set & FUSE_SET_ATTR_SIZE)
+        ret = timed_truncate(info.path, attr->st_size);
+    if (ret == 0)
+        ret = node_getattr(&info, &st);
+    if (ret == 0)
+        fuse_reply_attr(req, &st, attr_timeout);
+    else
+        fuse_reply_err(req, -ret);
+    g_free(info.path);
+}
 
-    return_unlock(ret);
+static void
+ll_mknod (fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, dev_t rdev)
+{
+    NodeInfo info;
+    struct stat st;
+    int ret;
+
+    get_node(parent, name, &info);
+    ret = info.path != NULL ? timed_mknod(info.path, mode, rdev) : -ENOENT;
+    if (ret == 0)
+        ret = route_getattr(info.path, &st);
+    reply_entry(req, parent, name, info.path, ret, &st);
+    g_free(info.path);
 }
 
+static void
+ll_mkdir (fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode)
+{
+    NodeInfo info;
+    struct stat st;
+    int ret;
 
-static int
-mtpfs_unlink (const gchar * path)
+    get_node(parent, name, &info);
+    ret = info.path != NULL ? timed_mkdir(info.path, mode) : -ENOENT;
+    if (ret == 0)
+        ret = route_getattr(info.path, &st);
+    reply_entry(req, parent, name, info.path, ret, &st);
+    g_free(info.path);
+}
+
+/* The node of a name removed or renamed over is no longer found by it */
+static void
+unlink_name (fuse_ino_t parent_ino, const gchar * name)
+{
+    Node key, *node;
+
+    g_mutex_lock(&nodes_lock);
+    key.parent = find_node(parent_ino);
+    key.name = (gchar *) name;
+    node = g_hash_table_lookup(node_names, &key);
+    if (node != NULL)
+        unlink_node(node);
+    g_mutex_unlock(&nodes_lock);
+}
+
+static void
+ll_unlink (fuse_req_t req, fuse_ino_t parent, const char *name)
 {
+    NodeInfo info;
     int ret;
 
-    DBG("mtpfs_unlink(%s)", path);
-    G_LOCK(device_lock);
+    get_node(parent, name, &info);
+    ret = info.path != NULL ? timed_unlink(info.path) : -ENOENT;
+    if (ret == 0)
+        unlink_name(parent, name);
+    fuse_reply_err(req, -ret);
+    g_free(info.path);
+}
 
-    uint32_t item_id = parse_path (path);
-    if (item_id == 0 || item_id == 0xFFFFFFFF)
-        return_unlock(-ENOENT);
-    ret = LIBMTP_Delete_Object (device, item_id);
-    if (ret != 0) {
-        LIBMTP_Dump_Errorstack (device);
-    } else {
-        files_changed = TRUE;
-    }
+static void
+ll_rmdir (fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    NodeInfo info;
+    int ret;
 
-    return_unlock(ret);
+    get_node(parent, name, &info);
+    ret = info.path != NULL ? timed_rmdir(info.path) : -ENOENT;
+    if (ret == 0)
+        unlink_name(parent, name);
+    fuse_reply_err(req, -ret);
+    g_free(info.path);
 }
 
-static int
-mtpfs_mkdir_real (const char *path, mode_t mode)
+static void
+ll_rename (fuse_req_t req, fuse_ino_t parent, const char *name, fuse_ino_t newparent,
+           const char *newname)
 {
-    DBG_F("mtpfs_mkdir_real(%s, %u)", path, mode);
+    NodeInfo from, to;
+    Node key, *node;
+    int ret = -ENOENT;
+
+    get_node(parent, name, &from);
+    get_node(newparent, newname, &to);
+    if (from.path != NULL && to.path != NULL)
+        ret = timed_rename(from.path, to.path);
+    if (ret == 0) {
+        // The node moves with the entry, one it replaced is left aside
+        g_mutex_lock(&nodes_lock);
+        key.parent = find_node(parent);
+        key.name = (gchar *) name;
+        node = g_hash_table_lookup(node_names, &key);
+        if (node != NULL)
+            link_node(node, find_node(newparent), newname);
+        g_mutex_unlock(&nodes_lock);
+        if (node == NULL)
+            unlink_name(newparent, newname);
+    }
+    fuse_reply_err(req, -ret);
+    g_free(from.path);
+    g_free(to.path);
+}
 
-    if (g_str_has_prefix (path, "/.Trash") == TRUE)
-      return_unlock(-EPERM);
+#if FUSE_USE_VERSION >= 30
+/* Neither RENAME_NOREPLACE nor RENAME_EXCHANGE are supported */
+static void
+ll_rename_flags (fuse_req_t req, fuse_ino_t parent, const char *name, fuse_ino_t newparent,
+                 const char *newname, unsigned int flags)
+{
+    if (flags != 0)
+        fuse_reply_err(req, EINVAL);
+    else
+        ll_rename(req, parent, name, newparent, newname);
+}
+#endif
 
-    int ret = 0;
-    uint32_t item_id = parse_path (path);
-    int storageid = find_storage(path);
-    if ((item_id == 0xFFFFFFFF) && !g_hash_table_contains(myfiles, path)) {
-        // Split path and find parent_id
-        gchar *filename = g_strdup("");
-        gchar **fields;
-        gchar *directory;
+static void
+ll_open (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    NodeInfo info;
+    int ret;
 
-        directory = (gchar *) g_malloc (strlen (path));
-        directory = strcpy (directory, "/");
-        fields = g_strsplit (path, "/", -1);
-        int i;
-        uint32_t parent_id = 0;
-        for (i = 0; fields[i] != NULL; i++) {
-            if (strlen (fields[i]) > 0) {
-                if (fields[i + 1] == NULL) {
-                    gchar *tmp = g_strndup (directory, strlen (directory) - 1);
-                    parent_id = lookup_folder_id (storageArea[storageid].folders, tmp);
-                    g_free (tmp);
-                    if (parent_id == 0xFFFFFFFF) {
-                        DBG("parent not found");
-                        ret = -ENOENT;
-                        goto clean;
-                    }
-                    g_free (filename);
-                    filename = g_strdup (fields[i]);
-                } else {
-                    directory = strcat (directory, fields[i]);
-                    directory = strcat (directory, "/");
-                }
-            }
-        }
-        DBG("%s:%s:%d", filename, directory, parent_id);
-        item_id = LIBMTP_Create_Folder (device, filename, parent_id, storageArea[storageid].storage->id);
-        if (item_id == 0) {
-            ret = -EEXIST;
-        } else {
-            storageArea[storageid].folders_changed=TRUE;
-            ret = 0;
-        }
-clean:
-        g_strfreev (fields);
-        g_free (directory);
-        g_free (filename);
-    } else {
-        ret = -EEXIST;
-    }
-    return ret;
+    get_node(ino, NULL, &info);
+    ret = info.path != NULL ? timed_open(info.path, fi) : -ENOENT;
+    if (ret != 0)
+        fuse_reply_err(req, -ret);
+    else if (fuse_reply_open(req, fi) != 0)
+        // Interrupted, the handle is not used
+        timed_release(info.path, fi);
+    g_free(info.path);
 }
 
-static int
-mtpfs_mkdir (const char *path, mode_t mode)
+static void
+ll_read (fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi)
 {
-    DBG("mtpfs_mkdir(%s, %u)", path, mode);
-    G_LOCK(device_lock);
+    gchar *buf = g_malloc(size);
+    NodeInfo info;
+    int ret;
 
-    int ret = mtpfs_mkdir_real (path, mode);
+    get_node(ino, NULL, &info);
+    ret = info.path != NULL ? timed_read(info.path, buf, size, off, fi) : -ENOENT;
+    if (ret >= 0)
+        fuse_reply_buf(req, buf, (size_t) ret);
+    else
+        fuse_reply_err(req, -ret);
+    g_free(info.path);
+    g_free(buf);
+}
 
-    return_unlock(ret);
+static void
+ll_write (fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size, off_t off,
+          struct fuse_file_info *fi)
+{
+    NodeInfo info;
+    int ret;
+
+    get_node(ino, NULL, &info);
+    ret = info.path != NULL ? timed_write(info.path, buf, size, off, fi) : -ENOENT;
+    if (ret >= 0)
+        fuse_reply_write(req, (size_t) ret);
+    else
+        fuse_reply_err(req, -ret);
+    g_free(info.path);
 }
 
-static int
-mtpfs_rmdir (const char *path)
+static void
+ll_flush (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
-    DBG("mtpfs_rmdir(%s)", path);
-    G_LOCK(device_lock);
+    NodeInfo info;
 
-    int ret = 0;
-    uint32_t folder_id = 0xFFFFFFFF;
-    if (strcmp (path, "/") == 0) {
-        return_unlock(0);
-    }
-    int storageid=find_storage(path);
-    folder_id = lookup_folder_id (storageArea[storageid].folders, path);
-    if (folder_id == 0 || folder_id == 0xFFFFFFFF)
-        return_unlock(-ENOENT);
+    get_node(ino, NULL, &info);
+    fuse_reply_err(req, info.path != NULL ? -timed_flush(info.path, fi) : ENOENT);
+    g_free(info.path);
+}
 
-    LIBMTP_Delete_Object(device, folder_id);
+static void
+ll_release (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    NodeInfo info;
 
-    storageArea[storageid].folders_changed=TRUE;
-    return_unlock(ret);
+    get_node(ino, NULL, &info);
+    fuse_reply_err(req, info.path != NULL ? -timed_release(info.path, fi) : ENOENT);
+    g_free(info.path);
 }
 
-/* Not working. need some way in libmtp to rename objects
-int
-mtpfs_rename (const char *oldname, const char *newname)
+static void
+ll_fsync (fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi)
 {
-    uint32_t old_id = parse_path(oldname);
-    LIBMTP_track_t *track;
-    track = LIBMTP_Get_Trackmetadata(device,old_id);
-    gchar *filename;
-    gchar **fields;
-    gchar *directory;
-    directory = (gchar *) g_malloc (strlen (newname));
-    directory = strcpy (directory, "/");
-    fields = g_strsplit (newname, "/", -1);
-    int i;
-    uint32_t parent_id = 0;
-    for (i = 0; fields[i] != NULL; i++) {
-        if (strlen (fields[i]) > 0) {
-            if (fields[i + 1] == NULL) {
-                directory = g_strndup (directory, strlen (directory) - 1);
-                parent_id = lookup_folder_id (folders, directory);
-                if (parent_id < 0)
-                    parent_id = 0;
-                filename = g_strdup (fields[i]);
-            } else {
-                directory = strcat (directory, fields[i]);
-                directory = strcat (directory, "/");
+    NodeInfo info;
 
-            }
-        }
-    }
-    DBG("%s:%s:%d", filename, directory, parent_id);
+    get_node(ino, NULL, &info);
+    fuse_reply_err(req, info.path != NULL ? -timed_fsync(info.path, datasync, fi) : ENOENT);
+    g_free(info.path);
+}
 
-    track->parent_id = parent_id;
-    track->title = g_strdup(filename);
-    int ret = LIBMTP_Update_Track_Metadata(device, track);
-    return ret;
+#if FUSE_VERSION >= 29
+static void
+ll_fallocate (fuse_req_t req, fuse_ino_t ino, int mode, off_t offset, off_t length,
+              struct fuse_file_info *fi)
+{
+    NodeInfo info;
+    int ret;
+
+    get_node(ino, NULL, &info);
+    ret = info.path != NULL ? timed_fallocate(info.path, mode, offset, length, fi) : -ENOENT;
+    fuse_reply_err(req, -ret);
+    g_free(info.path);
 }
-*/
+#endif
 
-/* Allow renaming of empty folders only */
 static int
-mtpfs_rename (const char *oldname, const char *newname)
+collect_entry (void *buf, const char *name, const struct stat *st, off_t off)
 {
-    DBG("mtpfs_unlink(%s, %s)", oldname, newname);
-    G_LOCK(device_lock);
+    DirEntry entry;
 
-    uint32_t folder_id = 0xFFFFFFFF;
-    int folder_empty = 1;
-    int ret = -ENOTEMPTY;
-    LIBMTP_folder_t *folder;
-    LIBMTP_file_t *file;
+    entry.name = g_strdup(name);
+    memset(&entry.st, 0, sizeof(struct stat));
+    if (st != NULL)
+        entry.st = *st;
+    g_array_append_val((GArray *) buf, entry);
+    return 0;
+}
 
-    int storageid_old=find_storage(oldname);
-    int storageid_new=find_storage(newname);
-    if (strcmp (oldname, "/") != 0) {
-        folder_id = lookup_folder_id (storageArea[storageid_old].folders, oldname);
-    }
-    if (folder_id == 0 || folder_id == 0xFFFFFFFF)
-        return_unlock(-ENOENT);
+static void
+free_entries (GArray * entries)
+{
+    guint i;
 
-    check_folders();
-    folder = LIBMTP_Find_Folder (storageArea[storageid_old].folders, folder_id);
+    for (i = 0; i < entries->len; i++)
+        g_free(g_array_index(entries, DirEntry, i).name);
+    g_array_free(entries, TRUE);
+}
 
-    /* MTP Folder object not found? */
-    if (folder == NULL)
-        return_unlock(-ENOENT);
+/* The directory is listed at once, readdir serves the entries from there */
+static void
+ll_opendir (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    GArray *entries = g_array_new(FALSE, FALSE, sizeof(DirEntry));
+    DirEntry *entry;
+    NodeInfo info;
+    guint i;
+    int ret;
 
-    folder = folder->child;
+    get_node(ino, NULL, &info);
+    ret = info.path != NULL ? timed_readdir(info.path, entries, collect_entry, 0, fi) : -ENOENT;
+    if (ret != 0) {
+        free_entries(entries);
+        fuse_reply_err(req, -ret);
+        g_free(info.path);
+        return;
+    }
+    for (i = 0; i < entries->len; i++) {
+        entry = &g_array_index(entries, DirEntry, i);
+        if (entry->st.st_ino == 0 && strcmp(entry->name, ".") == 0) {
+            entry->st.st_ino = info.ino;
+            entry->st.st_mode = S_IFDIR;
+        } else if (entry->st.st_ino == 0 && strcmp(entry->name, "..") == 0) {
+            entry->st.st_ino = info.parent_ino;
+            entry->st.st_mode = S_IFDIR;
+        }
+    }
+    fi->fh = (uint64_t) (uintptr_t) entries;
+    if (fuse_reply_open(req, fi) != 0)
+        free_entries(entries);
+    g_free(info.path);
+}
 
-    /* Check if empty folder */
-    DBG("Checking empty folder start for: subfolders");
+static void
+ll_readdir (fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi)
+{
+    GArray *entries = DIR_ENTRIES(fi);
+    gchar *buf = g_malloc(size);
+    DirEntry *entry;
+    size_t used = 0, len;
+    guint i;
+
+    // The offset of an entry is the index of the next one
+    for (i = off > 0 ? (guint) off : 0; i < entries->len; i++) {
+        entry = &g_array_index(entries, DirEntry, i);
+        len = fuse_add_direntry(req, buf + used, size - used, entry->name, &entry->st, i + 1);
+        if (len > size - used)
+            break;
+        used += len;
+    }
+    fuse_reply_buf(req, buf, used);
+    g_free(buf);
+}
 
-    while (folder != NULL) {
-        if (folder->parent_id == folder_id) {
-            folder_empty = 0;
+#if FUSE_USE_VERSION >= 30
+/* Entries with their attributes, which the kernel keeps as if it had
+ * looked each of them up: ls -l on a directory is a single call */
+static void
+ll_readdirplus (fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                struct fuse_file_info *fi)
+{
+    GArray *entries = DIR_ENTRIES(fi);
+    GArray *counted;
+    struct fuse_entry_param param;
+    const gchar *path;
+    gchar *buf, *child;
+    DirEntry *entry;
+    size_t used = 0, len;
+    NodeInfo info;
+    guint i;
+
+    get_node(ino, NULL, &info);
+    if (info.path == NULL) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    counted = g_array_new(FALSE, FALSE, sizeof(uint64_t));
+    buf = g_malloc(size);
+    for (i = off > 0 ? (guint) off : 0; i < entries->len; i++) {
+        entry = &g_array_index(entries, DirEntry, i);
+        memset(&param, 0, sizeof(param));
+        param.attr = entry->st;
+        len = fuse_add_direntry_plus(req, NULL, 0, entry->name, &param, i + 1);
+        if (len > size - used)
             break;
+        // Returned entries count as lookups, except . and ..
+        if (strcmp(entry->name, ".") != 0 && strcmp(entry->name, "..") != 0) {
+            // The root of several devices lists them, each its own context
+            child = g_build_filename(info.path, entry->name, NULL);
+            path = child;
+            param.ino = remember_node(ino, entry->name, route(&path), &entry->st);
+            g_free(child);
+            param.attr_timeout = attr_timeout;
+            param.entry_timeout = entry_timeout;
+            g_array_append_val(counted, param.ino);
         }
-        folder = folder->sibling;
+        fuse_add_direntry_plus(req, buf + used, size - used, entry->name, &param, i + 1);
+        used += len;
     }
+    if (fuse_reply_buf(req, buf, used) != 0) {
+        for (i = 0; i < counted->len; i++)
+            forget_node(g_array_index(counted, uint64_t, i), 1);
+    }
+    g_array_free(counted, TRUE);
+    g_free(info.path);
+    g_free(buf);
+}
+#endif
 
-    DBG("Checking empty folder end for: subfolders. Result: %s", (folder_empty == 1 ? "empty" : "not empty"));
+static void
+ll_releasedir (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    free_entries(DIR_ENTRIES(fi));
+    fuse_reply_err(req, 0);
+}
 
-    if (folder_empty == 1) {
-        /* Find files */
-        check_files();
-        DBG("Checking empty folder start for: files");
-        file = files;
-        while (file != NULL) {
-            if (file->parent_id == folder_id) {
-                folder_empty = 0;
-                break;
-            }
-            file = file->next;
-        }
-        DBG("Checking empty folder end for: files. Result: %s", (folder_empty == 1 ? "empty" : "not empty"));
+static void
+ll_fsyncdir (fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi)
+{
+    NodeInfo info;
 
+    get_node(ino, NULL, &info);
+    fuse_reply_err(req, info.path != NULL ? -timed_fsyncdir(info.path, datasync, fi) : ENOENT);
+    g_free(info.path);
+}
 
-        /* Rename folder. First remove old folder, then create the new one */
-        if (folder_empty == 1) {
-            struct stat stbuf;
-            if ( (ret = mtpfs_getattr_real (oldname, &stbuf)) == 0) {
-                DBG("removing folder %s, id %d", oldname, folder_id);
+static void
+ll_statfs (fuse_req_t req, fuse_ino_t ino)
+{
+    struct statvfs st;
+    NodeInfo info;
+    int ret;
 
-                ret = mtpfs_mkdir_real (newname, stbuf.st_mode);
-                LIBMTP_Delete_Object(device, folder_id);
-                storageArea[storageid_old].folders_changed=TRUE;
-                storageArea[storageid_new].folders_changed=TRUE;
-            }
+    get_node(ino, NULL, &info);
+    ret = info.path != NULL ? timed_statvfs(info.path, &st) : -ENOENT;
+    if (ret == 0)
+        fuse_reply_statfs(req, &st);
+    else
+        fuse_reply_err(req, -ret);
+    g_free(info.path);
+}
+
+static void
+ll_setxattr (fuse_req_t req, fuse_ino_t ino, const char *name, const char *value,
+             size_t size, int flags)
+{
+    NodeInfo info;
+
+    get_node(ino, NULL, &info);
+    fuse_reply_err(req, info.path != NULL ? -timed_setxattr(info.path, name, value, size, flags)
+                                          : ENOENT);
+    g_free(info.path);
+}
+
+static struct fuse_lowlevel_ops mtpfs_oper = {
+    .init    = mtpfs_init,
+    .destroy = mtpfs_destroy,
+    .lookup  = ll_lookup,
+    .forget  = ll_forget,
+    .getattr = ll_getattr,
+    .setattr = ll_setattr,
+    .mknod   = ll_mknod,
+    .mkdir   = ll_mkdir,
+    .unlink  = ll_unlink,
+    .rmdir   = ll_rmdir,
+#if FUSE_USE_VERSION >= 30
+    .rename  = ll_rename_flags,
+#else
+    .rename  = ll_rename,
+#endif
+    .open    = ll_open,
+    .read    = ll_read,
+    .write   = ll_write,
+    .flush   = ll_flush,
+    .release = ll_release,
+    .fsync   = ll_fsync,
+    .opendir = ll_opendir,
+    .readdir = ll_readdir,
+#if FUSE_USE_VERSION >= 30
+    .readdirplus = ll_readdirplus,
+#endif
+    .releasedir = ll_releasedir,
+    .fsyncdir = ll_fsyncdir,
+    .statfs  = ll_statfs,
+    .setxattr = ll_setxattr,
+#if FUSE_VERSION >= 29
+    .fallocate = ll_fallocate,
+#endif
+};
+
+/* Command line options of mtpfs, everything else is left to FUSE */
+typedef struct
+{
+    GArray *raw_device;
+    gboolean all_devices;
+    guint64 cache_size;
+    gboolean use_index;
+    guint64 content_size;
+    GPtrArray *simulate;
+    double entry_timeout;
+    double attr_timeout;
+    double negative_timeout;
+} MtpfsOptions;
+
+enum
+{
+    KEY_DEVICE,
+    KEY_LAZY,
+    KEY_CACHE_SIZE,
+    KEY_NO_INDEX,
+    KEY_CONTENT_CACHE,
+    KEY_STAGING_SIZE,
+    KEY_SIMULATE,
+    KEY_ALL_DEVICES,
+    KEY_WRITE_BACK,
+};
+
+/* Names of each option, the value of "-z 1" and "--device 1" is given
+ * glued to them.  --staging-size has no short form, -s is FUSE's
+ * single-threaded flag. */
+static const gchar *option_names[][2] = {
+    [KEY_DEVICE]        = { "--device",        "-z" },
+    [KEY_LAZY]          = { "--lazy",          "-l" },
+    [KEY_CACHE_SIZE]    = { "--cache-size",    "-c" },
+    [KEY_NO_INDEX]      = { "--no-index",      "-n" },
+    [KEY_CONTENT_CACHE] = { "--content-cache", "-k" },
+    [KEY_STAGING_SIZE]  = { "--staging-size",  NULL },
+    [KEY_SIMULATE]      = { "--simulate",      "-S" },
+    [KEY_ALL_DEVICES]   = { "--all-devices",   "-a" },
+    [KEY_WRITE_BACK]    = { "--write-back",    "-w" },
+};
+
+static const struct fuse_opt mtpfs_opts[] = {
+    FUSE_OPT_KEY("-z ",              KEY_DEVICE),
+    FUSE_OPT_KEY("--device ",        KEY_DEVICE),
+    FUSE_OPT_KEY("--device=",        KEY_DEVICE),
+    FUSE_OPT_KEY("-l",               KEY_LAZY),
+    FUSE_OPT_KEY("--lazy",           KEY_LAZY),
+    FUSE_OPT_KEY("-c ",              KEY_CACHE_SIZE),
+    FUSE_OPT_KEY("--cache-size ",    KEY_CACHE_SIZE),
+    FUSE_OPT_KEY("--cache-size=",    KEY_CACHE_SIZE),
+    FUSE_OPT_KEY("-n",               KEY_NO_INDEX),
+    FUSE_OPT_KEY("--no-index",       KEY_NO_INDEX),
+    FUSE_OPT_KEY("-k ",              KEY_CONTENT_CACHE),
+    FUSE_OPT_KEY("--content-cache ", KEY_CONTENT_CACHE),
+    FUSE_OPT_KEY("--content-cache=", KEY_CONTENT_CACHE),
+    FUSE_OPT_KEY("--staging-size ",  KEY_STAGING_SIZE),
+    FUSE_OPT_KEY("--staging-size=",  KEY_STAGING_SIZE),
+    FUSE_OPT_KEY("-S ",              KEY_SIMULATE),
+    FUSE_OPT_KEY("--simulate ",      KEY_SIMULATE),
+    FUSE_OPT_KEY("--simulate=",      KEY_SIMULATE),
+    FUSE_OPT_KEY("-a",               KEY_ALL_DEVICES),
+    FUSE_OPT_KEY("--all-devices",    KEY_ALL_DEVICES),
+    FUSE_OPT_KEY("-w",               KEY_WRITE_BACK),
+    FUSE_OPT_KEY("--write-back",     KEY_WRITE_BACK),
+    /* Options of the high-level API, kept for existing mounts */
+    { "entry_timeout=%lf",    offsetof(MtpfsOptions, entry_timeout), 0 },
+    { "attr_timeout=%lf",     offsetof(MtpfsOptions, attr_timeout), 0 },
+    { "negative_timeout=%lf", offsetof(MtpfsOptions, negative_timeout), 0 },
+    FUSE_OPT_KEY("use_ino",          FUSE_OPT_KEY_DISCARD),
+    FUSE_OPT_END
+};
+
+/* Value of an option with an argument, as found after its name */
+static const gchar *
+option_value (const char *arg, int key)
+{
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        const gchar *name = option_names[key][i];
+        if (name != NULL && g_str_has_prefix(arg, name)) {
+            arg += strlen(name);
+            return (*arg == '=') ? arg + 1 : arg;
         }
     }
-    return_unlock(ret);
+    return arg;
 }
 
+/* Called by fuse_opt_parse for every argument, ours are dropped */
 static int
-mtpfs_statvfs (const char *path, struct statvfs *stbuf)
+parse_option (void *data, const char *arg, int key, struct fuse_args *outargs)
 {
-    int storage_id = -1;
+    MtpfsOptions *options = data;
+    int i;
 
-    DBG("mtpfs_statvfs(%s, %p)", path, stbuf);
+    switch (key) {
+    case KEY_DEVICE:
+        i = atoi(option_value(arg, key));
+        g_array_append_val(options->raw_device, i);
+        return 0;
+    case KEY_ALL_DEVICES:
+        options->all_devices = TRUE;
+        return 0;
+    case KEY_CACHE_SIZE:
+        options->cache_size = g_ascii_strtoull(option_value(arg, key), NULL, 10);
+        return 0;
+    case KEY_STAGING_SIZE:
+        staging_budget = g_ascii_strtoull(option_value(arg, key), NULL, 10) * 1024 * 1024;
+        return 0;
+    case KEY_CONTENT_CACHE:
+        options->content_size = g_ascii_strtoull(option_value(arg, key), NULL, 10);
+        return 0;
+    case KEY_SIMULATE:
+        g_ptr_array_add(options->simulate, g_strdup(option_value(arg, key)));
+        return 0;
+    case KEY_NO_INDEX:
+        options->use_index = FALSE;
+        return 0;
+    case KEY_LAZY:
+        lazy = TRUE;
+        return 0;
+    case KEY_WRITE_BACK:
+        write_back = TRUE;
+        return 0;
+    default:
+        /* Mount point and FUSE options, including -o lists */
+        return 1;
+    }
+}
 
-    stbuf->f_bsize = 1024;
+/* Read what is needed of an opened device, NULL if it is not usable */
+static MtpfsContext *
+new_context (LIBMTP_mtpdevice_t * device, const MtpBackend * mtp)
+{
+    MtpfsContext *ctx;
+    char *friendlyname;
+    int i;
 
-    storage_id = find_storage(path);
-    if (storage_id == -1) {
-        stbuf->f_blocks = 0;
-        stbuf->f_bfree = 0;
-        stbuf->f_ffree = 0;
-        for (storage_id = 0; storage_id < MAX_STORAGE_AREA; ++storage_id) {
-            if (storageArea[storage_id].storage != NULL) {
-                stbuf->f_blocks += storageArea[storage_id].storage->MaxCapacity / 1024;
-                stbuf->f_bfree  += storageArea[storage_id].storage->FreeSpaceInBytes /1024;
-                stbuf->f_ffree  += storageArea[storage_id].storage->FreeSpaceInObjects;
-            }
+    ctx = g_new0(MtpfsContext, 1);
+    g_rw_lock_init(&ctx->tree_lock);
+    g_mutex_init(&ctx->revalidate_lock);
+    g_cond_init(&ctx->revalidate_cond);
+    g_mutex_init(&ctx->device_lock);
+    g_cond_init(&ctx->device_cond);
+    ctx->files_changed = TRUE;
+    ctx->device = device;
+    ctx->mtp = mtp;
+
+    /* Echo the friendly name so we know which device we are working with */
+    friendlyname = ctx->mtp->get_friendlyname(ctx->device);
+    if (friendlyname == NULL) {
+        printf("Listing File Information on Device with name: (NULL)\n");
+    } else {
+        printf("Listing File Information on Device with name: %s\n", friendlyname);
+        ctx->name = friendlyname;
+    }
+
+    ctx->partial_read = ctx->mtp->check_capability(ctx->device, LIBMTP_DEVICECAP_GetPartialObject) != 0;
+    DBG("GetPartialObject %s", ctx->partial_read ? "supported" : "unsupported");
+    ctx->move_objects = ctx->mtp->check_capability(ctx->device, LIBMTP_DEVICECAP_MoveObject) != 0;
+    ctx->copy_objects = ctx->mtp->check_capability(ctx->device, LIBMTP_DEVICECAP_CopyObject) != 0;
+    ctx->edit_objects = ctx->mtp->check_capability(ctx->device, LIBMTP_DEVICECAP_EditObjects) != 0;
+
+    /* Get all storages for this device */
+    int ret = ctx->mtp->get_storage(ctx->device, LIBMTP_STORAGE_SORTBY_NOTSORTED);
+    if (ret != 0) {
+        if (ret == 1) {
+            fprintf(stdout, "LIBMTP_Get_Storage() failed: unable to get storage properties\n");
+        } else {
+            fprintf(stdout,"LIBMTP_Get_Storage() failed:%d\n", ret);
         }
+        dump_mtp_error(ctx->device);
+        ctx->mtp->release_device(ctx->device);
+        g_free(ctx->name);
+        g_free(ctx);
+        return NULL;
+    }
+
+    /* Check if multiple storage areas */
+    LIBMTP_devicestorage_t *storage;
+    i = 0;
+    for (storage = ctx->device->storage; storage != 0 && i < MAX_STORAGE_AREA; storage = storage->next)  {
+        ctx->storageArea[i].storage = storage;
+        ctx->storageArea[i].folders = NULL;
+        ctx->storageArea[i].folders_changed = TRUE;
+        DBG("Storage%d: %d - %s\n",i, storage->id, storage->StorageDescription);
+        i++;
+    }
+
+    ctx->myfiles = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    ctx->shared_stages = g_hash_table_new(g_direct_hash, g_direct_equal);
+    ctx->resolved = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    ctx->missing = g_hash_table_new_full(g_int64_hash, g_int64_equal, g_free,
+                                         (GDestroyNotify) g_hash_table_destroy);
+    if (lazy)
+        ctx->populated = g_hash_table_new_full(g_int64_hash, g_int64_equal, g_free, NULL);
+    if (write_back) {
+        g_mutex_init(&ctx->writeback_lock);
+        g_cond_init(&ctx->writeback_cond);
+        g_queue_init(&ctx->writeback);
+        ctx->pending = g_hash_table_new(g_str_hash, g_str_equal);
+        ctx->failed = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    }
+
+    /* Caches kept on disk are only valid for this device */
+    gchar *serial = ctx->mtp->get_serialnumber(ctx->device);
+    if (serial != NULL && *serial != '\0') {
+        ctx->device_serial = g_strcanon(serial, "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ-_", '_');
     } else {
-        stbuf->f_blocks = storageArea[storage_id].storage->MaxCapacity / 1024;
-        stbuf->f_bfree  = storageArea[storage_id].storage->FreeSpaceInBytes / 1024;
-        stbuf->f_ffree  = storageArea[storage_id].storage->FreeSpaceInObjects;
+        g_free(serial);
     }
-    stbuf->f_bavail = stbuf->f_bfree;
-    return 0;
-}
 
-static void *
-mtpfs_init ()
-{
-    DBG("mtpfs_init");
-    files_changed=TRUE;
-    DBG("Ready");
-    return 0;
+    /* Reuse the tree saved by the last mount */
+    load_indexes(ctx);
+    return ctx;
 }
 
-static int
-mtpfs_blank()
+static gboolean
+name_taken (MtpfsContext * first, MtpfsContext * ctx)
 {
-    // Do nothing
-    return 0;
+    MtpfsContext *other;
+
+    for (other = first; other != ctx; other = other->next) {
+        if (strcmp(other->name, ctx->name) == 0)
+            return TRUE;
+    }
+    return FALSE;
 }
 
-static struct fuse_operations mtpfs_oper = {
-    .chmod   = mtpfs_blank,
-    .release = mtpfs_release,
-    .readdir = mtpfs_readdir,
-    .getattr = mtpfs_getattr,
-    .open    = mtpfs_open,
-    .mknod   = mtpfs_mknod,
-    .read    = mtpfs_read,
-    .write   = mtpfs_write,
-    .unlink  = mtpfs_unlink,
-    .destroy = mtpfs_destroy,
-    .mkdir   = mtpfs_mkdir,
-    .rmdir   = mtpfs_rmdir,
-    .rename  = mtpfs_rename,
-    .statfs  = mtpfs_statvfs,
-    .init    = mtpfs_init,
-};
+/* Each device of several gets a subdirectory named after it */
+static void
+name_contexts (MtpfsContext * first)
+{
+    MtpfsContext *ctx;
+    gchar *base;
+    guint n;
 
-static const struct option long_options[] = {
-  {"device",       required_argument, 0,  'z' },
-  {NULL,                           0, 0,  0 }
-};
+    for (ctx = first; ctx != NULL; ctx = ctx->next) {
+        if (ctx->name != NULL && *ctx->name != '\0' && *ctx->name != '.') {
+            base = g_strdelimit(ctx->name, "/", '_');
+        } else {
+            g_free(ctx->name);
+            base = g_strdup(ctx->device_serial != NULL ? ctx->device_serial : "device");
+        }
+        ctx->name = g_strdup(base);
+        // Same models keep their default names, number them
+        for (n = 2; name_taken(first, ctx); n++) {
+            g_free(ctx->name);
+            ctx->name = g_strdup_printf("%s-%u", base, n);
+        }
+        g_free(base);
+        DBG("Device %u mounted as %s", ctx->index, ctx->name);
+    }
+}
 
 int
 main (int argc, char *argv[])
@@ -1197,31 +6475,109 @@ main (int argc, char *argv[])
     LIBMTP_raw_device_t * rawdevices;
     int numrawdevices;
     LIBMTP_error_number_t err;
-    int raw_device;
-    int opt_seen;
-    int opt;
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    MtpfsOptions options;
+    GArray *raw_device;
+    gboolean all_devices;
+    guint64 cache_size;
+    gboolean use_index;
+    guint64 content_size;
     int i;
-    char *friendlyname;
+    GPtrArray *simulate;
+    MtpfsContext *first, *ctx, **last;
+    guint count;
+    struct fuse_session *se;
+#if FUSE_USE_VERSION >= 30
+    struct fuse_cmdline_opts cmdline;
+#else
+    struct fuse_chan *ch;
+    char *mountpoint;
+    int multithreaded, foreground;
+#endif
+    int ret;
 
-    /* Silently accept unknown opt */
-    opterr = 0;
-    raw_device = 0;
-    opt_seen = 0;
-    while ((opt = getopt_long(argc, argv, "z:", long_options, NULL)) != -1 ) {
-        switch (opt) {
-        case 'z':
-            raw_device = atoi(optarg);
-            opt_seen += 2;
-            break;
-        default:
-            break;
-        }
+    options.raw_device = g_array_new(FALSE, FALSE, sizeof(int));
+    options.all_devices = FALSE;
+    options.cache_size = DEFAULT_CACHE_SIZE_MB;
+    options.use_index = TRUE;
+    options.content_size = 0;
+    options.simulate = g_ptr_array_new();
+    options.entry_timeout = DEFAULT_ENTRY_TIMEOUT;
+    options.attr_timeout = DEFAULT_ATTR_TIMEOUT;
+    options.negative_timeout = DEFAULT_NEGATIVE_TIMEOUT;
+    if (fuse_opt_parse(&args, &options, mtpfs_opts, parse_option) != 0) {
+        fprintf(stderr, "Invalid arguments\n");
+        return 1;
+    }
+    raw_device = options.raw_device;
+    all_devices = options.all_devices;
+    cache_size = options.cache_size;
+    use_index = options.use_index;
+    content_size = options.content_size;
+    simulate = options.simulate;
+    entry_timeout = options.entry_timeout;
+    attr_timeout = options.attr_timeout;
+    negative_timeout = options.negative_timeout;
+#if FUSE_USE_VERSION >= 30
+    if (fuse_parse_cmdline(&args, &cmdline) != 0)
+        return 1;
+    if (cmdline.show_help) {
+        printf("usage: %s [options] <mountpoint>\n\n", argv[0]);
+        fuse_cmdline_help();
+        fuse_lowlevel_help();
+        return 0;
+    }
+    if (cmdline.show_version) {
+        fuse_lowlevel_version();
+        return 0;
+    }
+    if (cmdline.mountpoint == NULL) {
+        fprintf(stderr, "No mount point given\n");
+        return 1;
+    }
+#else
+    if (fuse_parse_cmdline(&args, &mountpoint, &multithreaded, &foreground) != 0)
+        return 1;
+    if (mountpoint == NULL) {
+        fprintf(stderr, "No mount point given\n");
+        return 1;
+    }
+#endif
+
+    if (raw_device->len == 0 && !all_devices) {
+        i = 0;
+        g_array_append_val(raw_device, i);
     }
 
-    argc -= opt_seen;
-    argv += opt_seen;
+    /* Trees kept on disk across mounts, lazy mounts never have all of it */
+    if (use_index && !lazy) {
+        index_dir = g_build_filename(g_get_user_cache_dir(), "mtpfs", NULL);
+        if (g_mkdir_with_parents(index_dir, 0700) != 0) {
+            g_free(index_dir);
+            index_dir = NULL;
+        }
+    }
 
     LIBMTP_Init ();
+    first = NULL;
+    last = &first;
+    count = 0;
+
+    if (simulate->len > 0) {
+        for (i = 0; i < (int) simulate->len; i++) {
+            LIBMTP_mtpdevice_t *device = sim_open(g_ptr_array_index(simulate, i));
+            if (device == NULL) {
+                fprintf(stderr, "Invalid simulated device: %s\n", (gchar *) g_ptr_array_index(simulate, i));
+                return 1;
+            }
+            if ((ctx = new_context(device, &sim_backend)) == NULL)
+                return 1;
+            ctx->index = count++;
+            *last = ctx;
+            last = &ctx->next;
+        }
+        goto opened;
+    }
 
     fprintf(stdout, "Listing raw device(s)\n");
     err = LIBMTP_Detect_Raw_Devices(&rawdevices, &numrawdevices);
@@ -1264,51 +6620,95 @@ main (int argc, char *argv[])
         return 1;
     }
 
-    fprintf(stdout, "Attempting to connect device %d\n", raw_device);
-    if (raw_device >= numrawdevices) {
-        fprintf(stderr, "Device %d does not exist\n", raw_device);
-        return 1;
+    /* Every device of a sync station, or the ones asked for */
+    if (all_devices) {
+        for (i = 0; i < numrawdevices; i++) {
+            g_array_append_val(raw_device, i);
+        }
+    }
+    for (i = 0; i < (int) raw_device->len; i++) {
+        int n = g_array_index(raw_device, int, i);
+        LIBMTP_mtpdevice_t *device;
+
+        fprintf(stdout, "Attempting to connect device %d\n", n);
+        if (n < 0 || n >= numrawdevices) {
+            fprintf(stderr, "Device %d does not exist\n", n);
+            return 1;
+        }
+        device = LIBMTP_Open_Raw_Device(&rawdevices[n]);
+        ctx = device != NULL ? new_context(device, &libmtp_backend) : NULL;
+        if (ctx == NULL) {
+            fprintf(stderr, "Unable to open raw device %d\n", n);
+            // A device that is not ready does not keep the others out
+            if (all_devices)
+                continue;
+            return 1;
+        }
+        ctx->index = count++;
+        *last = ctx;
+        last = &ctx->next;
     }
-    device = LIBMTP_Open_Raw_Device(&rawdevices[raw_device]);
-    if (device == NULL) {
-        fprintf(stderr, "Unable to open raw device %d\n", raw_device);
+    if (first == NULL) {
+        fprintf(stderr, "No device could be opened\n");
         return 1;
     }
 
-    /* Echo the friendly name so we know which device we are working with */
-    friendlyname = LIBMTP_Get_Friendlyname(device);
-    if (friendlyname == NULL) {
-        printf("Listing File Information on Device with name: (NULL)\n");
+opened:
+    /* Alone, a device is mounted at the root as it always was */
+    if (count > 1 || all_devices) {
+        name_contexts(first);
     } else {
-        printf("Listing File Information on Device with name: %s\n", friendlyname);
-        g_free(friendlyname);
+        g_free(first->name);
+        first->name = NULL;
     }
 
-    /* Get all storages for this device */
-    int ret = LIBMTP_Get_Storage(device, LIBMTP_STORAGE_SORTBY_NOTSORTED);
-    if (ret != 0) {
-        if (ret == 1) {
-            fprintf(stdout, "LIBMTP_Get_Storage() failed: unable to get storage properties\n");
-        } else {
-            fprintf(stdout,"LIBMTP_Get_Storage() failed:%d\n", ret);
+    init_block_cache(cache_size * 1024 * 1024);
+    if (content_size > 0)
+        init_content_cache(content_size * 1024 * 1024);
+    signal(SIGUSR1, request_refresh);
+    contexts = first;
+    owner_uid = getuid();
+    owner_gid = getgid();
+    init_nodes();
+
+    DBG("Start fuse");
+#if FUSE_USE_VERSION >= 30
+    ret = 1;
+    se = fuse_session_new(&args, &mtpfs_oper, sizeof(mtpfs_oper), first);
+    if (se != NULL) {
+        if (fuse_set_signal_handlers(se) == 0) {
+            if (fuse_session_mount(se, cmdline.mountpoint) == 0) {
+                if (fuse_daemonize(cmdline.foreground) == 0)
+                    ret = cmdline.singlethread ? fuse_session_loop(se)
+                                               : fuse_session_loop_mt(se, cmdline.clone_fd);
+                fuse_session_unmount(se);
+            }
+            fuse_remove_signal_handlers(se);
         }
-        dump_mtp_error(device);
-        return 1;
+        // Calls mtpfs_destroy, which waits for the queued uploads
+        fuse_session_destroy(se);
     }
-
-    /* Check if multiple storage areas */
-    LIBMTP_devicestorage_t *storage;
-    i = 0;
-    for (storage = device->storage; storage != 0 && i < MAX_STORAGE_AREA; storage = storage->next)  {
-        storageArea[i].storage = storage;
-        storageArea[i].folders = NULL;
-        storageArea[i].folders_changed = TRUE;
-        DBG("Storage%d: %d - %s\n",i, storage->id, storage->StorageDescription);
-        i++;
+    free(cmdline.mountpoint);
+#else
+    ch = fuse_mount(mountpoint, &args);
+    if (ch == NULL)
+        return 1;
+    ret = 1;
+    se = fuse_lowlevel_new(&args, &mtpfs_oper, sizeof(mtpfs_oper), first);
+    if (se != NULL) {
+        if (fuse_set_signal_handlers(se) == 0) {
+            fuse_session_add_chan(se, ch);
+            if (fuse_daemonize(foreground) == 0)
+                ret = multithreaded ? fuse_session_loop_mt(se) : fuse_session_loop(se);
+            fuse_remove_signal_handlers(se);
+            fuse_session_remove_chan(ch);
+        }
+        // Calls mtpfs_destroy, which waits for the queued uploads
+        fuse_session_destroy(se);
     }
-
-    myfiles = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
-
-    DBG("Start fuse");
-    return fuse_main(argc, argv, &mtpfs_oper, NULL); //TODO: use privdata instead of static vars
+    fuse_unmount(mountpoint, ch);
+    free(mountpoint);
+#endif
+    fuse_opt_free_args(&args);
+    return ret != 0 ? 1 : 0;
 }
@@ -12,10 +12,76 @@
 #ifdef linux
 /* For pread()/pwrite() */
 # define _XOPEN_SOURCE 500
+/* For memfd_create() */
+# define _GNU_SOURCE
 #endif
 
-#define FUSE_USE_VERSION 26
+/* readdirplus needs FUSE 3, FUSE 2 is still supported without it */
+#ifdef HAVE_FUSE3
+# define FUSE_USE_VERSION 31
+#else
+# define FUSE_USE_VERSION 26
+#endif
 
 #define MAX_STORAGE_AREA 4
 
+/* Block cache for partial reads */
+#define CACHE_BLOCK_SIZE (128 * 1024)
+#define DEFAULT_CACHE_SIZE_MB 32
+
+/* Upper bound of the read-ahead window, in cache blocks */
+#define READAHEAD_MAX_BLOCKS 32
+
+/* Downloads are split in chunks so other requests can reach the device */
+#define STAGE_CHUNK_SIZE (1024 * 1024)
+
+/* Written ranges of an existing file closer than this are sent as one */
+#define DIRTY_MERGE_GAP (64 * 1024)
+
+/* Staging files share a budget, the smaller ones are kept in memory */
+#define DEFAULT_STAGING_SIZE_MB 512
+#define STAGING_MEMORY_MAX (4 * 1024 * 1024)
+/* Seconds an open waits for the budget before exceeding it */
+#define STAGING_WAIT 30
+
+/* Write-back: files queued at most, each holds its staging file open */
+#define WRITEBACK_MAX_FILES 64
+/* Seconds a failed upload is kept for fsync and close to report it */
+#define WRITEBACK_FAILED_KEEP 600
+
+/* Inode numbers: object ids are unique on a device, they are offset past
+ * the inodes of the other entries */
+#define ROOT_INODE 1
+#define LOST_FOUND_INODE 2
+#define STATS_DIR_INODE 3
+#define STATS_FILE_INODE 4
+#define STORAGE_INODE(storage_id) (((uint64_t) 1 << 33) | (storage_id))
+#define OBJECT_INODE(item_id) (((uint64_t) 1 << 32) | (item_id))
+/* Files not uploaded yet, from a hash of their path */
+#define NEW_FILE_INODE(hash) (((uint64_t) 1 << 31) | ((hash) & 0x7FFFFFFF))
+/* Several devices: their directories, and the inodes of each one */
+#define DEVICE_DIR_INODE(index) (((uint64_t) 1 << 34) | (index))
+#define DEVICE_INODE(index, inode) (((uint64_t) (index) << 40) | (inode))
+#define LOCAL_INODE(inode) ((inode) & (((uint64_t) 1 << 40) - 1))
+/* Node ids of new files whose inode is already the node of another name */
+#define SPARE_INODE(n) (((uint64_t) 1 << 35) | (n))
+
+/* Seconds the kernel keeps names, attributes and names found missing */
+#define DEFAULT_ENTRY_TIMEOUT 10
+#define DEFAULT_ATTR_TIMEOUT 10
+#define DEFAULT_NEGATIVE_TIMEOUT 10
+/* Missing names remembered per directory before starting over */
+#define MISSING_PER_DIR 256
+/* Names folded for lookups without allocating, MTP limits them to 255 */
+#define FOLD_BUFFER_SIZE 256
+
+/* Runtime statistics, read from a virtual file */
+#define STATS_DIR "/.mtpfs"
+#define STATS_FILE "/.mtpfs/stats"
+/* Latency histograms: powers of two of microseconds, then the rest */
+#define STAT_BUCKETS 24
+
+/* Setting it on a file copies it on the device, to the path given as value */
+#define COPY_XATTR "user.mtpfs.copy"
+
 #endif /* _MTPFS_H_ */
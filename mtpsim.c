@@ -0,0 +1,759 @@
+/*
+    Simulated MTP device, to measure mtpfs without a phone.
+
+    This program can be distributed under the terms of the GNU GPL.
+    See the file COPYING.
+*/
+
+/* Headers */
+#include "mtpfs.h"
+#include "backend.h"
+
+#include <errno.h>
+#include <glib.h>
+#include <libmtp.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* The device is described by a comma separated list of key=value, see
+ * sim_open.  It starts with a generated tree: every folder down to depth
+ * holds fanout folders and files files of size bytes. */
+
+typedef struct
+{
+    uint32_t id;
+    uint32_t parent_id;        /* 0 in the root of a storage */
+    uint32_t storage_id;
+    gchar *name;
+    gboolean folder;
+    uint64_t size;
+    time_t date;
+    LIBMTP_filetype_t filetype;
+    GByteArray *data;          /* Uploaded or edited content, NULL for generated content */
+    gboolean editing;          /* Between BeginEditObject and EndEditObject */
+} SimObject;
+
+typedef struct
+{
+    guint storages;
+    guint depth;
+    guint fanout;
+    guint files;
+    uint64_t size;
+    guint latency;             /* Microseconds added to every call */
+    guint bandwidth;           /* KB/s of transfers, 0 for unlimited */
+    guint faults;              /* Calls failing, per thousand */
+    gboolean partial;          /* GetPartialObject support */
+    gboolean edit;             /* Android edit extensions support */
+    guint seed;
+} SimConfig;
+
+/* Each simulated device has its own tree, several can be mounted */
+typedef struct
+{
+    LIBMTP_mtpdevice_t device;         /* First, handed out to mtpfs */
+    SimConfig config;
+    GHashTable *objects;               /* id -> SimObject */
+    uint32_t next_id;
+    GRand *rand;
+    gchar *serial;
+} SimDevice;
+
+#define SIM(device) ((SimDevice *) (device))
+
+static guint sim_opened = 0;              /* Numbers the devices of a mount */
+
+#define SIM_CAPACITY ((uint64_t) 64 * 1024 * 1024 * 1024)
+#define SIM_TRANSFER_CHUNK (64 * 1024)
+
+/* Cost of a call */
+
+static void
+sim_delay (SimDevice * sim, uint64_t bytes)
+{
+    uint64_t us = sim->config.latency;
+
+    if (sim->config.bandwidth > 0)
+        us += bytes * 1000000 / ((uint64_t) sim->config.bandwidth * 1024);
+    if (us > 0)
+        g_usleep((gulong) us);
+}
+
+static gboolean
+sim_fault (SimDevice * sim)
+{
+    return sim->config.faults > 0 && (guint) g_rand_int_range(sim->rand, 0, 1000) < sim->config.faults;
+}
+
+/* Content of generated objects, stable across mounts */
+static unsigned char
+sim_byte (const SimObject * object, uint64_t offset)
+{
+    if (object->data != NULL)
+        return object->data->data[offset];
+    return (unsigned char) ((object->id * 131 + offset) % 251);
+}
+
+/* Object tree */
+
+static void
+free_object (SimObject * object)
+{
+    g_free(object->name);
+    if (object->data != NULL)
+        g_byte_array_free(object->data, TRUE);
+    g_free(object);
+}
+
+static SimObject *
+add_object (SimDevice * sim, uint32_t storage_id, uint32_t parent_id, gchar * name, gboolean folder, uint64_t size)
+{
+    SimObject *object = g_new0(SimObject, 1);
+
+    object->id = sim->next_id++;
+    object->parent_id = parent_id;
+    object->storage_id = storage_id;
+    object->name = name;
+    object->folder = folder;
+    object->size = size;
+    object->date = time(NULL);
+    object->filetype = folder ? LIBMTP_FILETYPE_FOLDER : LIBMTP_FILETYPE_UNKNOWN;
+    g_hash_table_insert(sim->objects, GUINT_TO_POINTER(object->id), object);
+    return object;
+}
+
+static void
+generate_tree (SimDevice * sim, uint32_t storage_id, uint32_t parent_id, guint depth)
+{
+    guint i;
+
+    for (i = 0; i < sim->config.files; ++i)
+        add_object(sim, storage_id, parent_id, g_strdup_printf("file%u.bin", i), FALSE, sim->config.size);
+    if (depth == 0)
+        return;
+    for (i = 0; i < sim->config.fanout; ++i) {
+        SimObject *folder = add_object(sim, storage_id, parent_id, g_strdup_printf("dir%u", i), TRUE, 0);
+        generate_tree(sim, storage_id, folder->id, depth - 1);
+    }
+}
+
+static gboolean
+has_children (SimDevice * sim, uint32_t id)
+{
+    GHashTableIter iter;
+    SimObject *object;
+
+    g_hash_table_iter_init(&iter, sim->objects);
+    while (g_hash_table_iter_next(&iter, NULL, (gpointer *) &object)) {
+        if (object->parent_id == id)
+            return TRUE;
+    }
+    return FALSE;
+}
+
+static LIBMTP_file_t *
+new_file (const SimObject * object)
+{
+    LIBMTP_file_t *file = LIBMTP_new_file_t();
+
+    file->item_id = object->id;
+    file->parent_id = object->parent_id;
+    file->storage_id = object->storage_id;
+    file->filename = strdup(object->name);
+    file->filesize = object->size;
+    file->modificationdate = object->date;
+    file->filetype = object->filetype;
+    return file;
+}
+
+static void
+update_storages (SimDevice * sim)
+{
+    LIBMTP_mtpdevice_t *device = &sim->device;
+    LIBMTP_devicestorage_t *storage;
+    GHashTableIter iter;
+    SimObject *object;
+
+    for (storage = device->storage; storage != NULL; storage = storage->next) {
+        storage->FreeSpaceInBytes = storage->MaxCapacity;
+        storage->FreeSpaceInObjects = 0xFFFFFFFF;
+    }
+    g_hash_table_iter_init(&iter, sim->objects);
+    while (g_hash_table_iter_next(&iter, NULL, (gpointer *) &object)) {
+        for (storage = device->storage; storage != NULL; storage = storage->next) {
+            if (storage->id == object->storage_id) {
+                storage->FreeSpaceInBytes -= MIN(object->size, storage->FreeSpaceInBytes);
+                storage->FreeSpaceInObjects--;
+            }
+        }
+    }
+}
+
+/* Backend */
+
+static void
+sim_release_device (LIBMTP_mtpdevice_t * device)
+{
+    SimDevice *sim = SIM(device);
+    LIBMTP_devicestorage_t *storage, *next;
+
+    for (storage = device->storage; storage != NULL; storage = next) {
+        next = storage->next;
+        g_free(storage->StorageDescription);
+        g_free(storage->VolumeIdentifier);
+        free(storage);
+    }
+    g_hash_table_destroy(sim->objects);
+    g_rand_free(sim->rand);
+    g_free(sim->serial);
+    g_free(sim);
+}
+
+static char *
+sim_get_friendlyname (LIBMTP_mtpdevice_t * device)
+{
+    return strdup("Simulated device");
+}
+
+static char *
+sim_get_serialnumber (LIBMTP_mtpdevice_t * device)
+{
+    return strdup(SIM(device)->serial);
+}
+
+static int
+sim_check_capability (LIBMTP_mtpdevice_t * device, LIBMTP_devicecap_t cap)
+{
+    return (cap == LIBMTP_DEVICECAP_GetPartialObject && SIM(device)->config.partial) ||
+        (cap == LIBMTP_DEVICECAP_EditObjects && SIM(device)->config.edit) ||
+        cap == LIBMTP_DEVICECAP_MoveObject || cap == LIBMTP_DEVICECAP_CopyObject;
+}
+
+static int
+sim_get_storage (LIBMTP_mtpdevice_t * device, int sortby)
+{
+    SimDevice *sim = SIM(device);
+
+    sim_delay(sim, 0);
+    if (sim_fault(sim))
+        return -1;
+    update_storages(sim);
+    return 0;
+}
+
+static LIBMTP_file_t *
+sim_get_filelisting_with_callback (LIBMTP_mtpdevice_t * device, LIBMTP_progressfunc_t callback,
+                                   void const *data)
+{
+    SimDevice *sim = SIM(device);
+    LIBMTP_file_t *list = NULL, *file;
+    GHashTableIter iter;
+    SimObject *object;
+
+    if (sim_fault(sim))
+        return NULL;
+    g_hash_table_iter_init(&iter, sim->objects);
+    while (g_hash_table_iter_next(&iter, NULL, (gpointer *) &object)) {
+        // One round trip per object, as devices without object lists do
+        sim_delay(sim, 0);
+        if (object->folder)
+            continue;
+        file = new_file(object);
+        file->next = list;
+        list = file;
+    }
+    return list;
+}
+
+static LIBMTP_folder_t *
+folder_tree (SimDevice * sim, uint32_t storage_id, uint32_t parent_id)
+{
+    LIBMTP_folder_t *list = NULL, *folder;
+    GHashTableIter iter;
+    SimObject *object;
+
+    g_hash_table_iter_init(&iter, sim->objects);
+    while (g_hash_table_iter_next(&iter, NULL, (gpointer *) &object)) {
+        if (!object->folder || object->storage_id != storage_id || object->parent_id != parent_id)
+            continue;
+        folder = LIBMTP_new_folder_t();
+        folder->folder_id = object->id;
+        folder->parent_id = parent_id;
+        folder->storage_id = storage_id;
+        folder->name = strdup(object->name);
+        folder->child = folder_tree(sim, storage_id, object->id);
+        folder->sibling = list;
+        list = folder;
+    }
+    return list;
+}
+
+static LIBMTP_folder_t *
+sim_get_folder_list_for_storage (LIBMTP_mtpdevice_t * device, uint32_t storage_id)
+{
+    SimDevice *sim = SIM(device);
+
+    sim_delay(sim, 0);
+    if (sim_fault(sim))
+        return NULL;
+    return folder_tree(sim, storage_id, 0);
+}
+
+static LIBMTP_file_t *
+sim_get_files_and_folders (LIBMTP_mtpdevice_t * device, uint32_t storage_id, uint32_t parent_id)
+{
+    SimDevice *sim = SIM(device);
+    LIBMTP_file_t *list = NULL, *file;
+    GHashTableIter iter;
+    SimObject *object;
+
+    if (parent_id == LIBMTP_FILES_AND_FOLDERS_ROOT)
+        parent_id = 0;
+    sim_delay(sim, 0);
+    if (sim_fault(sim))
+        return NULL;
+    g_hash_table_iter_init(&iter, sim->objects);
+    while (g_hash_table_iter_next(&iter, NULL, (gpointer *) &object)) {
+        if (object->storage_id != storage_id || object->parent_id != parent_id)
+            continue;
+        file = new_file(object);
+        file->next = list;
+        list = file;
+    }
+    return list;
+}
+
+static int
+sim_get_partial_object (LIBMTP_mtpdevice_t * device, uint32_t id, uint64_t offset,
+                        uint32_t maxbytes, unsigned char **data, unsigned int *size)
+{
+    SimDevice *sim = SIM(device);
+    SimObject *object = g_hash_table_lookup(sim->objects, GUINT_TO_POINTER(id));
+    uint32_t i, len;
+
+    if (!sim->config.partial || object == NULL || object->folder || offset > object->size || sim_fault(sim))
+        return -1;
+    len = (uint32_t) MIN((uint64_t) maxbytes, object->size - offset);
+    sim_delay(sim, len);
+    *data = malloc(len > 0 ? len : 1);
+    for (i = 0; i < len; ++i)
+        (*data)[i] = sim_byte(object, offset + i);
+    *size = len;
+    return 0;
+}
+
+static int
+sim_get_file_to_file_descriptor (LIBMTP_mtpdevice_t * device, uint32_t id, int fd,
+                                 LIBMTP_progressfunc_t callback, void const *data)
+{
+    SimDevice *sim = SIM(device);
+    SimObject *object = g_hash_table_lookup(sim->objects, GUINT_TO_POINTER(id));
+    unsigned char buf[SIM_TRANSFER_CHUNK];
+    uint64_t offset;
+    uint32_t i, len;
+
+    if (object == NULL || object->folder || sim_fault(sim))
+        return -1;
+    sim_delay(sim, object->size);
+    for (offset = 0; offset < object->size; offset += len) {
+        len = (uint32_t) MIN((uint64_t) SIM_TRANSFER_CHUNK, object->size - offset);
+        for (i = 0; i < len; ++i)
+            buf[i] = sim_byte(object, offset + i);
+        if (write(fd, buf, len) != (ssize_t) len)
+            return -1;
+    }
+    return 0;
+}
+
+/* Store a sent file, its content coming from get */
+static int
+receive_file (SimDevice * sim, LIBMTP_file_t * file,
+              gssize (*get) (void *, unsigned char *, uint32_t), void *priv)
+{
+    unsigned char buf[SIM_TRANSFER_CHUNK];
+    GByteArray *content;
+    SimObject *object;
+    gssize len;
+
+    if (file->parent_id != 0 && g_hash_table_lookup(sim->objects, GUINT_TO_POINTER(file->parent_id)) == NULL)
+        return -1;
+    content = g_byte_array_sized_new((guint) MIN(file->filesize, (uint64_t) G_MAXUINT));
+    while (content->len < file->filesize) {
+        len = get(priv, buf, (uint32_t) MIN((uint64_t) sizeof(buf), file->filesize - content->len));
+        if (len <= 0)
+            break;
+        g_byte_array_append(content, buf, (guint) len);
+    }
+    sim_delay(sim, content->len);
+    if (content->len != file->filesize || sim_fault(sim)) {
+        g_byte_array_free(content, TRUE);
+        return -1;
+    }
+    object = add_object(sim, file->storage_id, file->parent_id, g_strdup(file->filename), FALSE, file->filesize);
+    object->filetype = file->filetype;
+    object->data = content;
+    file->item_id = object->id;
+    update_storages(sim);
+    return 0;
+}
+
+static gssize
+get_from_fd (void *priv, unsigned char *buf, uint32_t len)
+{
+    return read(*(int *) priv, buf, len);
+}
+
+static int
+sim_send_file_from_file_descriptor (LIBMTP_mtpdevice_t * device, int fd, LIBMTP_file_t * file,
+                                    LIBMTP_progressfunc_t callback, void const *data)
+{
+    return receive_file(SIM(device), file, get_from_fd, &fd);
+}
+
+static int
+sim_delete_object (LIBMTP_mtpdevice_t * device, uint32_t id)
+{
+    SimDevice *sim = SIM(device);
+
+    sim_delay(sim, 0);
+    if (g_hash_table_lookup(sim->objects, GUINT_TO_POINTER(id)) == NULL || has_children(sim, id) ||
+        sim_fault(sim))
+        return -1;
+    g_hash_table_remove(sim->objects, GUINT_TO_POINTER(id));
+    update_storages(sim);
+    return 0;
+}
+
+static uint32_t
+sim_create_folder (LIBMTP_mtpdevice_t * device, char *name, uint32_t parent_id, uint32_t storage_id)
+{
+    SimDevice *sim = SIM(device);
+
+    sim_delay(sim, 0);
+    if ((parent_id != 0 && g_hash_table_lookup(sim->objects, GUINT_TO_POINTER(parent_id)) == NULL) ||
+        sim_fault(sim))
+        return 0;
+    return add_object(sim, storage_id, parent_id, g_strdup(name), TRUE, 0)->id;
+}
+
+static SimObject *
+rename_object (SimDevice * sim, uint32_t id, const char *name)
+{
+    SimObject *object = g_hash_table_lookup(sim->objects, GUINT_TO_POINTER(id));
+
+    sim_delay(sim, 0);
+    if (object == NULL || sim_fault(sim))
+        return NULL;
+    g_free(object->name);
+    object->name = g_strdup(name);
+    return object;
+}
+
+/* Like libmtp, the name of the object passed is updated */
+static int
+sim_set_file_name (LIBMTP_mtpdevice_t * device, LIBMTP_file_t * file, const char *name)
+{
+    if (rename_object(SIM(device), file->item_id, name) == NULL)
+        return -1;
+    free(file->filename);
+    file->filename = strdup(name);
+    return 0;
+}
+
+static int
+sim_set_folder_name (LIBMTP_mtpdevice_t * device, LIBMTP_folder_t * folder, const char *name)
+{
+    if (rename_object(SIM(device), folder->folder_id, name) == NULL)
+        return -1;
+    free(folder->name);
+    folder->name = strdup(name);
+    return 0;
+}
+
+/* The content of a folder follows it to another storage */
+static void
+move_children (SimDevice * sim, uint32_t parent_id, uint32_t storage_id)
+{
+    GHashTableIter iter;
+    SimObject *object;
+
+    g_hash_table_iter_init(&iter, sim->objects);
+    while (g_hash_table_iter_next(&iter, NULL, (gpointer *) &object)) {
+        if (object->parent_id == parent_id && object->storage_id != storage_id) {
+            object->storage_id = storage_id;
+            if (object->folder)
+                move_children(sim, object->id, storage_id);
+        }
+    }
+}
+
+static int
+sim_move_object (LIBMTP_mtpdevice_t * device, uint32_t id, uint32_t storage_id, uint32_t parent_id)
+{
+    SimDevice *sim = SIM(device);
+    SimObject *object = g_hash_table_lookup(sim->objects, GUINT_TO_POINTER(id));
+    uint32_t ancestor;
+
+    sim_delay(sim, 0);
+    if (object == NULL || sim_fault(sim))
+        return -1;
+    // Neither into a missing folder nor into itself
+    for (ancestor = parent_id; ancestor != 0; ) {
+        SimObject *parent = g_hash_table_lookup(sim->objects, GUINT_TO_POINTER(ancestor));
+
+        if (ancestor == id || parent == NULL || !parent->folder)
+            return -1;
+        ancestor = parent->parent_id;
+    }
+    object->parent_id = parent_id;
+    if (object->storage_id != storage_id) {
+        object->storage_id = storage_id;
+        if (object->folder)
+            move_children(sim, id, storage_id);
+        update_storages(sim);
+    }
+    return 0;
+}
+
+/* Files only, the copy keeps the name and gets a new id */
+static int
+sim_copy_object (LIBMTP_mtpdevice_t * device, uint32_t id, uint32_t storage_id, uint32_t parent_id)
+{
+    SimDevice *sim = SIM(device);
+    SimObject *object = g_hash_table_lookup(sim->objects, GUINT_TO_POINTER(id));
+    SimObject *copy;
+
+    if (object == NULL || object->folder ||
+        (parent_id != 0 && g_hash_table_lookup(sim->objects, GUINT_TO_POINTER(parent_id)) == NULL))
+        return -1;
+    // Within the device, at the speed of its storage
+    sim_delay(sim, 0);
+    if (sim_fault(sim))
+        return -1;
+    copy = add_object(sim, storage_id, parent_id, g_strdup(object->name), FALSE, object->size);
+    copy->filetype = object->filetype;
+    if (object->data != NULL)
+        copy->data = g_byte_array_append(g_byte_array_sized_new(object->data->len),
+                                         object->data->data, object->data->len);
+    update_storages(sim);
+    return 0;
+}
+
+/* Android edit extensions */
+
+static SimObject *
+edited_object (SimDevice * sim, uint32_t id)
+{
+    SimObject *object = g_hash_table_lookup(sim->objects, GUINT_TO_POINTER(id));
+
+    if (!sim->config.edit || object == NULL || object->folder)
+        return NULL;
+    return object;
+}
+
+/* Generated content becomes real before it is changed */
+static GByteArray *
+edited_data (SimObject * object)
+{
+    GByteArray *data;
+    uint64_t offset;
+
+    if (object->data != NULL)
+        return object->data;
+    data = g_byte_array_sized_new((guint) object->size);
+    g_byte_array_set_size(data, (guint) object->size);
+    for (offset = 0; offset < object->size; ++offset)
+        data->data[offset] = sim_byte(object, offset);
+    object->data = data;
+    return data;
+}
+
+static int
+sim_begin_edit_object (LIBMTP_mtpdevice_t * device, uint32_t const id)
+{
+    SimDevice *sim = SIM(device);
+    SimObject *object = edited_object(sim, id);
+
+    sim_delay(sim, 0);
+    if (object == NULL || object->editing || sim_fault(sim))
+        return -1;
+    object->editing = TRUE;
+    return 0;
+}
+
+static int
+sim_send_partial_object (LIBMTP_mtpdevice_t * device, uint32_t const id, uint64_t offset,
+                         unsigned char *data, unsigned int size)
+{
+    SimDevice *sim = SIM(device);
+    SimObject *object = edited_object(sim, id);
+    GByteArray *content;
+
+    sim_delay(sim, size);
+    if (object == NULL || !object->editing || offset > object->size || sim_fault(sim))
+        return -1;
+    content = edited_data(object);
+    if (offset + size > content->len)
+        g_byte_array_set_size(content, (guint) (offset + size));
+    memcpy(content->data + offset, data, size);
+    object->size = content->len;
+    object->date = time(NULL);
+    update_storages(sim);
+    return 0;
+}
+
+static int
+sim_truncate_object (LIBMTP_mtpdevice_t * device, uint32_t const id, uint64_t size)
+{
+    SimDevice *sim = SIM(device);
+    SimObject *object = edited_object(sim, id);
+    GByteArray *content;
+    guint len;
+
+    sim_delay(sim, 0);
+    if (object == NULL || !object->editing || sim_fault(sim))
+        return -1;
+    content = edited_data(object);
+    len = content->len;
+    g_byte_array_set_size(content, (guint) size);
+    if (content->len > len)
+        memset(content->data + len, 0, content->len - len);
+    object->size = content->len;
+    object->date = time(NULL);
+    update_storages(sim);
+    return 0;
+}
+
+static int
+sim_end_edit_object (LIBMTP_mtpdevice_t * device, uint32_t const id)
+{
+    SimDevice *sim = SIM(device);
+    SimObject *object = edited_object(sim, id);
+
+    sim_delay(sim, 0);
+    if (object == NULL || !object->editing)
+        return -1;
+    object->editing = FALSE;
+    return 0;
+}
+
+const MtpBackend sim_backend = {
+    .release_device = sim_release_device,
+    .get_friendlyname = sim_get_friendlyname,
+    .get_serialnumber = sim_get_serialnumber,
+    .check_capability = sim_check_capability,
+    .get_storage = sim_get_storage,
+    .get_filelisting_with_callback = sim_get_filelisting_with_callback,
+    .get_folder_list_for_storage = sim_get_folder_list_for_storage,
+    .get_files_and_folders = sim_get_files_and_folders,
+    .get_partial_object = sim_get_partial_object,
+    .get_file_to_file_descriptor = sim_get_file_to_file_descriptor,
+    .send_file_from_file_descriptor = sim_send_file_from_file_descriptor,
+    .delete_object = sim_delete_object,
+    .create_folder = sim_create_folder,
+    .set_file_name = sim_set_file_name,
+    .set_folder_name = sim_set_folder_name,
+    .move_object = sim_move_object,
+    .copy_object = sim_copy_object,
+    .begin_edit_object = sim_begin_edit_object,
+    .send_partial_object = sim_send_partial_object,
+    .truncate_object = sim_truncate_object,
+    .end_edit_object = sim_end_edit_object,
+};
+
+/* Create the device described by spec, for example
+ * "depth=3,fanout=4,files=8,size=1048576,latency=2000,bandwidth=8192,faults=1".
+ * Returns NULL if spec cannot be parsed. */
+LIBMTP_mtpdevice_t *
+sim_open (const char *spec)
+{
+    SimConfig config;
+    SimDevice *sim;
+    LIBMTP_devicestorage_t *storage, *last = NULL;
+    gchar **fields;
+    gboolean valid = TRUE;
+    guint i;
+
+    config.storages = 1;
+    config.depth = 3;
+    config.fanout = 4;
+    config.files = 8;
+    config.size = 1024 * 1024;
+    config.latency = 1000;
+    config.bandwidth = 0;
+    config.faults = 0;
+    config.partial = TRUE;
+    config.edit = TRUE;
+    config.seed = 0;
+
+    fields = g_strsplit(spec, ",", -1);
+    for (i = 0; fields[i] != NULL; ++i) {
+        gchar *value = strchr(fields[i], '=');
+        guint64 number;
+
+        if (*fields[i] == '\0')
+            continue;
+        if (value == NULL) {
+            valid = FALSE;
+            break;
+        }
+        *value++ = '\0';
+        number = g_ascii_strtoull(value, NULL, 10);
+        if (strcmp(fields[i], "storages") == 0) {
+            config.storages = (guint) CLAMP(number, 1, MAX_STORAGE_AREA);
+        } else if (strcmp(fields[i], "depth") == 0) {
+            config.depth = (guint) number;
+        } else if (strcmp(fields[i], "fanout") == 0) {
+            config.fanout = (guint) number;
+        } else if (strcmp(fields[i], "files") == 0) {
+            config.files = (guint) number;
+        } else if (strcmp(fields[i], "size") == 0) {
+            config.size = number;
+        } else if (strcmp(fields[i], "latency") == 0) {
+            config.latency = (guint) number;
+        } else if (strcmp(fields[i], "bandwidth") == 0) {
+            config.bandwidth = (guint) number;
+        } else if (strcmp(fields[i], "faults") == 0) {
+            config.faults = (guint) MIN(number, 1000);
+        } else if (strcmp(fields[i], "partial") == 0) {
+            config.partial = number != 0;
+        } else if (strcmp(fields[i], "edit") == 0) {
+            config.edit = number != 0;
+        } else if (strcmp(fields[i], "seed") == 0) {
+            config.seed = (guint) number;
+        } else {
+            valid = FALSE;
+            break;
+        }
+    }
+    g_strfreev(fields);
+    if (!valid)
+        return NULL;
+
+    sim = g_new0(SimDevice, 1);
+    sim->config = config;
+    sim->objects = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, (GDestroyNotify) free_object);
+    sim->next_id = 1;
+    sim->rand = g_rand_new_with_seed(config.seed);
+    // Caches kept on disk must not mix up different trees, nor devices
+    // simulated with the same spec
+    sim->serial = g_strdup_printf("SIM%08x-%u", g_str_hash(spec), sim_opened++);
+    for (i = 0; i < config.storages; ++i) {
+        storage = calloc(1, sizeof(LIBMTP_devicestorage_t));
+        storage->id = 0x00010001 + (i << 16);
+        storage->MaxCapacity = SIM_CAPACITY;
+        storage->StorageDescription = g_strdup_printf("Storage%u", i);
+        storage->VolumeIdentifier = g_strdup(storage->StorageDescription);
+        storage->prev = last;
+        if (last == NULL) {
+            sim->device.storage = storage;
+        } else {
+            last->next = storage;
+        }
+        last = storage;
+        generate_tree(sim, storage->id, 0, config.depth);
+    }
+    update_storages(sim);
+    return &sim->device;
+}